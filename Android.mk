@@ -61,7 +61,9 @@ LOCAL_SRC_FILES := \
     twrp.cpp \
     fixContexts.cpp \
     twrpTar.cpp \
+    twrpCrypt.cpp \
     exclude.cpp \
+    direnum.cpp \
     find_file.cpp \
     infomanager.cpp \
     data.cpp \
@@ -69,6 +71,7 @@ LOCAL_SRC_FILES := \
     partitionmanager.cpp \
     progresstracking.cpp \
     startupArgs.cpp \
+    startupTrace.cpp \
     twrp-functions.cpp \
     orangefox.cpp \
     twrpDigestDriver.cpp \
@@ -304,8 +307,6 @@ ifneq ($(TW_ADDITIONAL_APEX_FILES),)
 endif
 ifneq ($(TW_LOAD_VENDOR_MODULES),)
     LOCAL_SRC_FILES += kernel_module_loader.cpp
-    LOCAL_C_INCLUDES += system/core/libmodprobe/include
-    LOCAL_STATIC_LIBRARIES += libmodprobe
     LOCAL_CFLAGS += -DTW_LOAD_VENDOR_MODULES=$(TW_LOAD_VENDOR_MODULES)
 endif
 ifeq ($(TW_INCLUDE_PYTHON),true)
@@ -591,10 +592,6 @@ ifeq ($(TARGET_USERIMAGES_USE_F2FS), true)
         libinit
 endif
 
-ifneq ($(TW_LOAD_VENDOR_MODULES),)
-    TWRP_REQUIRED_MODULES += libmodprobe
-endif
-
 TWRP_REQUIRED_MODULES += file_contexts_text
 
 ifeq ($(BOARD_CACHEIMAGE_PARTITION_SIZE),)
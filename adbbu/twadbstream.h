@@ -36,10 +36,12 @@
 #define TWEOF "tweof"					//End of File for Image/File
 #define MD5TRAILER "md5trailer"				//Image/File MD5 Trailer
 #define TWDATA "twdatablock"				// twrp adb backup data block header
+#define TWFRAME "twdataframe"				// length-prefixed data frame header (version 4+)
 #define TWMD5 "twverifymd5"				//This command is compared to the md5trailer by ORS to verify transfer
 #define TWENDADB "twendadb"				//End Protocol
 #define TWERROR "twerror"				//Send error
-#define ADB_BACKUP_VERSION 3				//Backup Version
+#define ADB_BACKUP_VERSION 4				//Backup Version
+#define ADB_BACKUP_MIN_VERSION 3			//Oldest stream version we can still restore
 #define DATA_MAX_CHUNK_SIZE 1048576			//Maximum size between each data header
 #define MAX_ADB_READ 512				//align with default tar size for amount to read fom adb stream
 
@@ -60,6 +62,13 @@ struct but not really a command
   | File Data              |
   | File/Image MD5 Trailer |
   | etc...                 |
+
+  Version 3 file data is a series of TWDATA blocks, each followed by
+  DATA_MAX_CHUNK_SIZE - 512 bytes of data, with the last chunk zero padded.
+
+  Version 4 file data is a series of TWFRAME headers, each followed by
+  length bytes of data (at most DATA_MAX_CHUNK_SIZE) zero padded to the next
+  512 byte boundary. The MD5 trailer covers the data only, not the padding.
 */
 
 //determine whether struct is 512 bytes, if not fail compilation
@@ -99,6 +108,15 @@ struct AdbBackupFileTrailer {
 	char space[440];				//stores space to align the struct to 512 bytes
 };
 
+//header for a version 4 data frame
+struct AdbBackupDataFrame {
+	char start_of_header[8];			//stores the magic value #define TWRP
+	char type[16];					//stores the AdbBackupDataFrame type TWFRAME
+	uint64_t length;				//stores the number of data bytes following this header, excluding padding
+	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupDataFrame struct to allow for making sure we are processing metadata
+	char space[476];				//stores space to align the struct to 512 bytes
+};
+
 //info for version and number of partitions backed up
 struct AdbBackupStreamHeader {
 	char start_of_header[8];			//stores the magic value #define TWRP
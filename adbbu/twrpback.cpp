@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 #include <zlib.h>
 #include <ctype.h>
 #include <semaphore.h>
@@ -52,6 +53,19 @@ twrpback::twrpback(void) {
 	ors_fd = 0;
 	debug_adb_fd = 0;
 	firstPart = true;
+	frame_pipe[0] = frame_pipe[1] = -1;
+	hash_pipe[0] = hash_pipe[1] = -1;
+	send_pipe[0] = send_pipe[1] = -1;
+	use_splice = true;
+	splice_to_adbd = true;
+	frameBytes = 0;
+	frameCapacity = DATA_MAX_CHUNK_SIZE;
+	sendStarted = false;
+	sendBusy = false;
+	sendExit = false;
+	sendErrno = 0;
+	pthread_mutex_init(&sendLock, NULL);
+	pthread_cond_init(&sendCond, NULL);
 	createFifos();
 	adbloginit();
 }
@@ -59,6 +73,8 @@ twrpback::twrpback(void) {
 twrpback::~twrpback(void) {
 	adblogfile.close();
 	closeFifos();
+	pthread_cond_destroy(&sendCond);
+	pthread_mutex_destroy(&sendLock);
 }
 
 void twrpback::printErrMsg(std::string msg, int errNum) {
@@ -99,6 +115,8 @@ void twrpback::adblogwrite(std::string writemsg) {
 }
 
 void twrpback::close_backup_fds() {
+	stopSender();
+	closeFramePipes();
 	if (ors_fd > 0)
 		close(ors_fd);
 	if (write_fd > 0)
@@ -118,6 +136,7 @@ void twrpback::close_backup_fds() {
 }
 
 void twrpback::close_restore_fds() {
+	stopSender();
 	if (ors_fd > 0)
 		close(ors_fd);
 	if (write_fd > 0)
@@ -138,9 +157,8 @@ void twrpback::close_restore_fds() {
 
 bool twrpback::backup(std::string command) {
 	twrpMD5 digest;
-	int bytes = 0, errctr = 0;
-	char adbReadStream[MAX_ADB_READ];
-	uint64_t totalbytes = 0, dataChunkBytes = 0, fileBytes = 0;
+	int errctr = 0;
+	uint64_t totalbytes = 0;
 	uint64_t md5fnsize = 0;
 	struct AdbBackupControlType endadb;
 
@@ -148,7 +166,6 @@ bool twrpback::backup(std::string command) {
 
 	bool writedata = true;
 	bool compressed = false;
-	bool firstDataPacket = true;
 
 	adbd_fp = fdopen(adbd_fd, "w");
 	if (adbd_fp == NULL) {
@@ -188,7 +205,6 @@ bool twrpback::backup(std::string command) {
 		return false;
 	}
 
-	memset(&adbReadStream, 0, sizeof(adbReadStream));
 	memset(&cmd, 0, sizeof(cmd));
 
 	adblogwrite("opening TW_ADB_BU_CONTROL\n");
@@ -206,6 +222,8 @@ bool twrpback::backup(std::string command) {
 		close_backup_fds();
 		return false;
 	}
+	openFramePipes();
+	startSender();
 
 	//loop until TWENDADB sent
 	while (true) {
@@ -236,13 +254,12 @@ bool twrpback::backup(std::string command) {
 			else if (cmdtype == TWSTREAMHDR) {
 				writedata = false;
 				adblogwrite("writing TWSTREAMHDR\n");
-				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
+				if (!writeAdbd(cmd, sizeof(cmd))) {
 					std::string msg = "Error writing TWSTREAMHDR to adbd";
 					printErrMsg(msg, errno);
 					close_backup_fds();
 					return false;
 				}
-				fflush(adbd_fp);
 			}
 			//we will be writing an image from TWRP
 			else if (cmdtype == TWIMG) {
@@ -263,12 +280,11 @@ bool twrpback::backup(std::string command) {
 				adblogwrite("Opening adb debug tar\n");
 				#endif
 
-				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
+				if (!writeAdbd(cmd, sizeof(cmd))) {
 					adblogwrite("Error writing TWIMG to adbd\n");
 					close_backup_fds();
 					return false;
 				}
-				fflush(adbd_fp);
 				writedata = true;
 			}
 			//we will be writing a tar from TWRP
@@ -294,75 +310,23 @@ bool twrpback::backup(std::string command) {
 				adblogwrite("Opening adb debug tar\n");
 				#endif
 
-				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
+				if (!writeAdbd(cmd, sizeof(cmd))) {
 					adblogwrite("Error writing TWFN to adbd\n");
 					close_backup_fds();
 					return false;
 				}
-				fflush(adbd_fp);
 				writedata = true;
 			}
 			/*
 			We received the command that we are done with the file stream.
-			We will flush the remaining data stream.
-			Update md5 and write final results to adb stream.
-			If we need padding because the total bytes are not a multiple
-			of 512, we pad the end with 0s to we reach 512.
-			We also write the final md5 to the adb stream.
+			Frame whatever data is still in the fifo, then write the
+			final md5 to the adb stream.
 			*/
 			else if (cmdtype == TWEOF) {
 				adblogwrite("received TWEOF\n");
-				while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream)) != 0)) {
-					totalbytes += bytes;
-					fileBytes += bytes;
-					dataChunkBytes += bytes;
-
-					char *writeAdbReadStream = new char [bytes];
-					memcpy(writeAdbReadStream, adbReadStream, bytes);
-
-					digest.update((unsigned char *) writeAdbReadStream, bytes);
-					if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-						std::string msg = "Cannot write to adbd stream: ";
-						printErrMsg(msg, errno);
-					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					fflush(adbd_fp);
-					delete [] writeAdbReadStream;
-					memset(adbReadStream, 0, sizeof(adbReadStream));
-				}
-
-				if (fileBytes % DATA_MAX_CHUNK_SIZE != 0) {
-					int64_t count = fileBytes / DATA_MAX_CHUNK_SIZE + 1;
-					uint64_t ceilingBytes = count * DATA_MAX_CHUNK_SIZE;
-					char padding[ceilingBytes - fileBytes];
-					int paddingBytes = sizeof(padding);
-					memset(padding, 0, paddingBytes);
-					std::stringstream paddingStr;
-					paddingStr << paddingBytes;
-					adblogwrite("writing padding to stream: " + paddingStr.str() + " bytes\n");
-					if (fwrite(padding, 1, paddingBytes, adbd_fp) != sizeof(padding)) {
-						adblogwrite("Error writing padding to adbd\n");
-						close_backup_fds();
-						return false;
-					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, padding, paddingBytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					totalbytes += paddingBytes;
-					digest.update((unsigned char *) padding, paddingBytes);
-					fflush(adbd_fp);
+				if (!streamFrames(&digest, true, &totalbytes)) {
+					close_backup_fds();
+					return false;
 				}
 
 				AdbBackupFileTrailer md5trailer;
@@ -382,120 +346,33 @@ bool twrpback::backup(std::string command) {
 				md5trailer.ident = crc32(md5trailer.ident, (const unsigned char*) &md5trailer, sizeof(md5trailer));
 				md5trailer.ident = crc32(md5trailer.ident, (const unsigned char*) &md5fnsize, sizeof(md5fnsize));
 
-				if (fwrite(&md5trailer, 1, sizeof(md5trailer), adbd_fp) != sizeof(md5trailer))  {
+				if (!writeAdbd(&md5trailer, sizeof(md5trailer)))  {
 					adblogwrite("Error writing md5trailer to adbd\n");
 					close_backup_fds();
 					return false;
 				}
-				fflush(adbd_fp);
 				writedata = false;
-				firstDataPacket = true;
-				fileBytes = 0;
 			}
 			memset(&cmd, 0, sizeof(cmd));
-			dataChunkBytes = 0;
 		}
 		//If we are to write data because of a new file stream, lets write all the data.
 		//This will allow us to not write data after a command structure has been written
 		//to the adb stream.
 		//If the stream is compressed, we need to always write the data.
 		if (writedata || compressed) {
-			while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream))) > 0) {
-				if (firstDataPacket) {
-					if (!twadbbu::Write_TWDATA(adbd_fp)) {
-						close_backup_fds();
-						return false;
-					}
-					fileBytes += MAX_ADB_READ;
-					fflush(adbd_fp);
-					firstDataPacket = false;
-					dataChunkBytes += sizeof(adbReadStream);
-				}
-				char *writeAdbReadStream = new char [bytes];
-				memcpy(writeAdbReadStream, adbReadStream, bytes);
-
-				digest.update((unsigned char *) writeAdbReadStream, bytes);
-
-				totalbytes += bytes;
-				fileBytes += bytes;
-				dataChunkBytes += bytes;
-
-				if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) != (unsigned long long)bytes) {
-					adblogwrite("Error writing backup data to adbd\n");
-					close_backup_fds();
-					return false;
-				}
-				#ifdef _DEBUG_ADB_BACKUP
-				if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-					std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-					printErrMsg(msg, errno);
-					close_restore_fds();
-					return false;
-				}
-				#endif
-				fflush(adbd_fp);
-				delete [] writeAdbReadStream;
-
-				memset(&adbReadStream, 0, sizeof(adbReadStream));
-
-				if (dataChunkBytes == DATA_MAX_CHUNK_SIZE) {
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
-				else if (dataChunkBytes > (DATA_MAX_CHUNK_SIZE - sizeof(adbReadStream))) {
-					int bytesLeft = DATA_MAX_CHUNK_SIZE - dataChunkBytes;
-					char extraData[bytesLeft];
-
-					memset(&extraData, 0, bytesLeft);
-					while ((bytes = read(adb_read_fd, &extraData, bytesLeft)) != 0) {
-						if (bytes > 0) {
-							totalbytes += bytes;
-							fileBytes += bytes;
-							dataChunkBytes += bytes;
-
-							bytesLeft -= bytes;
-							char *writeAdbReadStream = new char [bytes];
-							memcpy(writeAdbReadStream, extraData, bytes);
-
-							digest.update((unsigned char *) writeAdbReadStream, bytes);
-							if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-								std::string msg = "Cannot write to adbd stream: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#ifdef _DEBUG_ADB_BACKUP
-							if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-								std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#endif
-							fflush(adbd_fp);
-							delete [] writeAdbReadStream;
-						}
-						memset(&extraData, 0, bytesLeft);
-						if (bytesLeft == 0) {
-							break;
-						}
-					}
-
-					fflush(adbd_fp);
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
+			if (!streamFrames(&digest, false, &totalbytes)) {
+				close_backup_fds();
+				return false;
 			}
 		}
 	}
 
 	//Write the final end adb structure to the adb stream
-	if (fwrite(&endadb, 1, sizeof(endadb), adbd_fp) != sizeof(endadb)) {
+	if (!writeAdbd(&endadb, sizeof(endadb))) {
 		adblogwrite("Error writing endadb to adbd\n");
 		close_backup_fds();
 		return false;
 	}
-	fflush(adbd_fp);
 	close_backup_fds();
 	return true;
 }
@@ -508,11 +385,13 @@ bool twrpback::restore(void) {
 	int errctr = 0;
 	uint64_t totalbytes = 0, dataChunkBytes = 0;
 	uint64_t md5fnsize = 0, fileBytes = 0;
+	uint64_t streamVersion = ADB_BACKUP_MIN_VERSION;
 	bool read_from_adb;
 	bool md5sumdata;
 	bool compressed, tweofrcvd, extraData;
 
 	read_from_adb = true;
+	startSender();
 
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGHUP, SIG_IGN);
@@ -594,6 +473,10 @@ bool twrpback::restore(void) {
 				adblogwrite("Received TWEOF\n");
 				read_from_adb = true;
 				tweofrcvd = true;
+				if (!waitSender()) {
+					close_restore_fds();
+					return false;
+				}
 				close(adb_write_fd);
 			}
 			//Break when TWRP sends TWENDADB
@@ -660,6 +543,14 @@ bool twrpback::restore(void) {
 					crc = crc32(crc, (const unsigned char*) &cnthdr, sizeof(cnthdr));
 
 					if (crc == cnthdrcrc) {
+						streamVersion = cnthdr.version;
+						if (streamVersion < ADB_BACKUP_MIN_VERSION || streamVersion > ADB_BACKUP_VERSION) {
+							std::stringstream str;
+							str << streamVersion;
+							adblogwrite("Unsupported adb backup version " + str.str() + "\n");
+							close_restore_fds();
+							return false;
+						}
 						adblogwrite("Restoring TWSTREAMHDR\n");
 						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
 							std::string msg = "Cannot write to adb_control_twrp_fd: ";
@@ -769,8 +660,16 @@ bool twrpback::restore(void) {
 					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
 				}
 				else if (cmdtype == MD5TRAILER) {
-					if (fileBytes >= md5fnsize)
+					if (!waitSender()) {
+						close_restore_fds();
+						return false;
+					}
+					// Version 4 frames carry no padding, so the trailer is the
+					// only sign that a compressed file is complete.
+					if (streamVersion >= 4 || fileBytes >= md5fnsize) {
 						close(adb_write_fd);
+						adb_write_fd = -1;
+					}
 					if (tweofrcvd) {
 						read_from_adb = true;
 						tweofrcvd = false;
@@ -784,6 +683,18 @@ bool twrpback::restore(void) {
 					}
 					continue;
 				}
+				//Pass a length-prefixed data frame to TWRP
+				else if (cmdtype == TWFRAME) {
+					uint64_t bytes = 0;
+
+					if (!restoreFrame(readAdbStream, &digest, &bytes)) {
+						close_restore_fds();
+						return false;
+					}
+					totalbytes += bytes;
+					fileBytes += bytes;
+					read_from_adb = true;
+				}
 				//Send the tar or partition image md5 to TWRP
 				else if (cmdtype == TWDATA) {
 					dataChunkBytes += sizeof(readAdbStream);
@@ -933,3 +844,403 @@ bool twrpback::checkMD5Trailer(char readAdbStream[], uint64_t md5fnsize, twrpMD5
 	}
 	return false;
 }
+
+void twrpback::openFramePipes(void) {
+	int size;
+
+	frameBytes = 0;
+	frameCapacity = DATA_MAX_CHUNK_SIZE;
+	frameBuf.resize(DATA_MAX_CHUNK_SIZE);
+
+	// Let TWRP hand us large writes without waiting on every 64k.
+	fcntl(adb_read_fd, F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE);
+
+	if (!use_splice)
+		return;
+	if (pipe2(frame_pipe, O_CLOEXEC) < 0 || pipe2(hash_pipe, O_CLOEXEC) < 0 || pipe2(send_pipe, O_CLOEXEC) < 0) {
+		printErrMsg("Unable to create frame pipes, copying backup data:", errno);
+		closeFramePipes();
+		use_splice = false;
+		return;
+	}
+
+	// A whole frame has to sit in frame_pipe before its length is known,
+	// and hash_pipe must be able to take a tee of all of it at once.
+	size = fcntl(frame_pipe[1], F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE);
+	if (size < 0)
+		size = fcntl(frame_pipe[1], F_GETPIPE_SZ);
+	// send_pipe holds the frame being written to adbd and the next one.
+	if (size <= 0 || fcntl(hash_pipe[1], F_SETPIPE_SZ, size) < size || fcntl(send_pipe[1], F_SETPIPE_SZ, size) < size) {
+		adblogwrite("Unable to size frame pipes, copying backup data\n");
+		closeFramePipes();
+		use_splice = false;
+		return;
+	}
+	if ((uint64_t)size < frameCapacity)
+		frameCapacity = size;
+	fcntl(send_pipe[1], F_SETPIPE_SZ, size * 2);
+}
+
+void twrpback::closeFramePipes(void) {
+	for (int i = 0; i < 2; i++) {
+		if (frame_pipe[i] >= 0)
+			close(frame_pipe[i]);
+		if (hash_pipe[i] >= 0)
+			close(hash_pipe[i]);
+		if (send_pipe[i] >= 0)
+			close(send_pipe[i]);
+		frame_pipe[i] = hash_pipe[i] = send_pipe[i] = -1;
+	}
+}
+
+// Returns the bytes added to the current frame, 0 when TWRP has closed
+// TW_ADB_BACKUP, -1 on error, -2 when the fifo is empty and -3 when the
+// frame can't take any more data.
+int twrpback::fillFrame(void) {
+	size_t room = frameCapacity - frameBytes;
+	ssize_t bytes;
+	int avail = 0;
+
+	if (room == 0)
+		return -3;
+	if (use_splice) {
+		bytes = splice(adb_read_fd, NULL, frame_pipe[1], NULL, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (bytes < 0 && errno == EINVAL && frameBytes == 0) {
+			adblogwrite("splice unsupported, copying backup data\n");
+			if (!waitSender())
+				return -1;
+			closeFramePipes();
+			use_splice = false;
+			frameCapacity = DATA_MAX_CHUNK_SIZE;
+			return fillFrame();
+		}
+		if (bytes < 0 && errno == EAGAIN) {
+			// frame_pipe counts pages, not bytes, so it can fill up
+			// before frameCapacity if TWRP wrote in small pieces.
+			if (ioctl(adb_read_fd, FIONREAD, &avail) == 0 && avail > 0)
+				return -3;
+			return -2;
+		}
+	} else {
+		bytes = read(adb_read_fd, &frameBuf[frameBytes], room);
+		if (bytes < 0 && errno == EAGAIN)
+			return -2;
+	}
+	if (bytes < 0) {
+		printErrMsg("Error reading TW_ADB_BACKUP:", errno);
+		return -1;
+	}
+	frameBytes += bytes;
+	return bytes;
+}
+
+bool twrpback::flushFrame(twrpMD5* digest) {
+	struct AdbBackupDataFrame frame;
+	adbSendJob job;
+	uint64_t done = 0;
+	ssize_t bytes;
+
+	if (frameBytes == 0)
+		return true;
+
+	if (use_splice) {
+		// tee shares frame_pipe's pages with hash_pipe, so reading them
+		// back for the md5 is the only copy of the data we make.
+		bytes = tee(frame_pipe[0], hash_pipe[1], frameBytes, 0);
+		if (bytes != (ssize_t)frameBytes) {
+			printErrMsg("Unable to tee backup data:", errno);
+			return false;
+		}
+		while (done < frameBytes) {
+			bytes = read(hash_pipe[0], &frameBuf[done], frameBytes - done);
+			if (bytes <= 0) {
+				printErrMsg("Unable to read teed backup data:", errno);
+				return false;
+			}
+			done += bytes;
+		}
+	}
+	digest->update((unsigned char*) &frameBuf[0], frameBytes);
+
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(debug_adb_fd, &frameBuf[0], frameBytes) < 1) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+	}
+	#endif
+
+	memset(&frame, 0, sizeof(frame));
+	strncpy(frame.start_of_header, TWRP, sizeof(frame.start_of_header));
+	strncpy(frame.type, TWFRAME, sizeof(frame.type));
+	frame.length = frameBytes;
+	frame.crc = crc32(0L, Z_NULL, 0);
+	frame.crc = crc32(frame.crc, (const unsigned char*) &frame, sizeof(frame));
+
+	job.fd = adbd_fd;
+	job.data.assign((char*) &frame, (char*) &frame + sizeof(frame));
+	job.spliceBytes = 0;
+	job.padBytes = (MAX_ADB_READ - frameBytes % MAX_ADB_READ) % MAX_ADB_READ;
+	if (use_splice) {
+		// Hand the pages on to the sender so the next frame can be
+		// filled while this one goes out to adbd.
+		for (done = 0; done < frameBytes; done += bytes) {
+			bytes = splice(frame_pipe[0], NULL, send_pipe[1], NULL, frameBytes - done, SPLICE_F_MOVE);
+			if (bytes <= 0) {
+				printErrMsg("Unable to queue backup data:", errno);
+				return false;
+			}
+		}
+		job.spliceBytes = frameBytes;
+	} else {
+		job.data.insert(job.data.end(), frameBuf.begin(), frameBuf.begin() + frameBytes);
+	}
+	frameBytes = 0;
+	return queueSend(job, "backup data to adbd");
+}
+
+bool twrpback::streamFrames(twrpMD5* digest, bool drain, uint64_t* bytes) {
+	int ret;
+
+	while (true) {
+		ret = fillFrame();
+		if (ret > 0) {
+			*bytes += ret;
+			continue;
+		}
+		if (ret == -1)
+			return false;
+		if (ret == -3) {
+			if (!flushFrame(digest))
+				return false;
+			continue;
+		}
+		if (ret == -2 && drain) {
+			// TWRP has sent TWEOF but still has the fifo open
+			usleep(1000);
+			continue;
+		}
+		break;
+	}
+	if (drain)
+		return flushFrame(digest);
+	return true;
+}
+
+bool twrpback::restoreFrame(char hdr[], twrpMD5* digest, uint64_t* bytes) {
+	struct AdbBackupDataFrame frame;
+	adbSendJob job;
+	uint32_t crc, framecrc;
+	uint64_t padded;
+
+	memcpy(&frame, hdr, sizeof(frame));
+	framecrc = frame.crc;
+	memset(&frame.crc, 0, sizeof(frame.crc));
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char*) &frame, sizeof(frame));
+	if (crc != framecrc || frame.length > DATA_MAX_CHUNK_SIZE) {
+		adblogwrite("ADB TWFRAME crc header doesn't match\n");
+		return false;
+	}
+
+	padded = (frame.length + MAX_ADB_READ - 1) / MAX_ADB_READ * MAX_ADB_READ;
+	job.data.resize(padded);
+	if (fread(&job.data[0], 1, padded, adbd_fp) != padded) {
+		adblogwrite("Unable to read TWFRAME data from adbd\n");
+		return false;
+	}
+	job.data.resize(frame.length);
+	digest->update((unsigned char*) &job.data[0], frame.length);
+
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(debug_adb_fd, &job.data[0], frame.length) < 0) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+	}
+	#endif
+
+	// TWRP writes the data out while we read the next frame from adbd.
+	job.fd = adb_write_fd;
+	job.spliceBytes = 0;
+	job.padBytes = 0;
+	if (!queueSend(job, "TWRP ADB FIFO"))
+		return false;
+	*bytes = frame.length;
+	return true;
+}
+
+void twrpback::startSender(void) {
+	sendQueue.clear();
+	sendBusy = false;
+	sendExit = false;
+	sendErrno = 0;
+	sendError.clear();
+	splice_to_adbd = true;
+	sendStarted = pthread_create(&sendThread, NULL, senderThread, this) == 0;
+	if (!sendStarted)
+		adblogwrite("Unable to start sender thread, writing inline\n");
+}
+
+void twrpback::stopSender(void) {
+	if (!sendStarted)
+		return;
+	pthread_mutex_lock(&sendLock);
+	sendQueue.clear();
+	sendExit = true;
+	pthread_cond_broadcast(&sendCond);
+	pthread_mutex_unlock(&sendLock);
+	pthread_join(sendThread, NULL);
+	sendStarted = false;
+}
+
+// Only one job waits behind the one being written, so at most two
+// frames are ever held in memory or in send_pipe.
+bool twrpback::queueSend(adbSendJob& job, const std::string& what) {
+	int err = 0;
+
+	if (!sendStarted) {
+		if (!runSendJob(job, &err)) {
+			printErrMsg("Error writing " + what + ":", err);
+			return false;
+		}
+		return true;
+	}
+	pthread_mutex_lock(&sendLock);
+	while (sendErrno == 0 && !sendQueue.empty())
+		pthread_cond_wait(&sendCond, &sendLock);
+	if (sendErrno == 0) {
+		sendQueue.push_back(adbSendJob());
+		sendQueue.back().fd = job.fd;
+		sendQueue.back().data.swap(job.data);
+		sendQueue.back().spliceBytes = job.spliceBytes;
+		sendQueue.back().padBytes = job.padBytes;
+		sendError = what;
+		pthread_cond_broadcast(&sendCond);
+	}
+	err = sendErrno;
+	pthread_mutex_unlock(&sendLock);
+	if (err != 0) {
+		printErrMsg("Error writing " + sendError + ":", err);
+		return false;
+	}
+	return true;
+}
+
+bool twrpback::waitSender(void) {
+	int err;
+
+	if (!sendStarted)
+		return true;
+	pthread_mutex_lock(&sendLock);
+	while (sendErrno == 0 && (sendBusy || !sendQueue.empty()))
+		pthread_cond_wait(&sendCond, &sendLock);
+	err = sendErrno;
+	pthread_mutex_unlock(&sendLock);
+	if (err != 0) {
+		printErrMsg("Error writing " + sendError + ":", err);
+		return false;
+	}
+	return true;
+}
+
+bool twrpback::runSendJob(adbSendJob& job, int* err) {
+	char buf[MAX_ADB_READ];
+	uint64_t done, left;
+	ssize_t bytes;
+
+	for (done = 0; done < job.data.size(); done += bytes) {
+		bytes = write(job.fd, &job.data[done], job.data.size() - done);
+		if (bytes < 0 && errno == EINTR) {
+			bytes = 0;
+			continue;
+		}
+		if (bytes <= 0) {
+			*err = bytes < 0 ? errno : EIO;
+			return false;
+		}
+	}
+	for (left = job.spliceBytes; left > 0; left -= bytes) {
+		if (splice_to_adbd) {
+			bytes = splice(send_pipe[0], NULL, job.fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (bytes < 0 && errno == EINVAL) {
+				// adbd can't take spliced data, copy it from now on
+				splice_to_adbd = false;
+				bytes = 0;
+				continue;
+			}
+		} else {
+			bytes = read(send_pipe[0], buf, std::min<uint64_t>(left, sizeof(buf)));
+			if (bytes > 0 && write(job.fd, buf, bytes) != bytes)
+				bytes = -1;
+		}
+		if (bytes <= 0) {
+			*err = bytes < 0 ? errno : EIO;
+			// Drop the rest so the main thread never blocks on send_pipe.
+			while (left > 0 && (bytes = read(send_pipe[0], buf, std::min<uint64_t>(left, sizeof(buf)))) > 0)
+				left -= bytes;
+			return false;
+		}
+	}
+	if (job.padBytes > 0) {
+		memset(buf, 0, job.padBytes);
+		if (write(job.fd, buf, job.padBytes) != (ssize_t)job.padBytes) {
+			*err = errno;
+			return false;
+		}
+	}
+	return true;
+}
+
+void* twrpback::senderThread(void* cookie) {
+	twrpback* back = (twrpback*) cookie;
+	adbSendJob job;
+	char buf[MAX_ADB_READ];
+	ssize_t bytes;
+	bool failed;
+	int err;
+
+	pthread_mutex_lock(&back->sendLock);
+	while (true) {
+		while (!back->sendExit && back->sendQueue.empty())
+			pthread_cond_wait(&back->sendCond, &back->sendLock);
+		if (back->sendExit)
+			break;
+		job.fd = back->sendQueue.front().fd;
+		job.data.swap(back->sendQueue.front().data);
+		job.spliceBytes = back->sendQueue.front().spliceBytes;
+		job.padBytes = back->sendQueue.front().padBytes;
+		back->sendQueue.pop_front();
+		back->sendBusy = true;
+		failed = back->sendErrno != 0;
+		pthread_cond_broadcast(&back->sendCond);
+		pthread_mutex_unlock(&back->sendLock);
+
+		err = 0;
+		if (failed) {
+			// An earlier write failed; only drain what the job queued.
+			for (uint64_t left = job.spliceBytes; left > 0; left -= bytes) {
+				bytes = read(back->send_pipe[0], buf, std::min<uint64_t>(left, sizeof(buf)));
+				if (bytes <= 0)
+					break;
+			}
+		} else if (!back->runSendJob(job, &err)) {
+			err = err ? err : EIO;
+		}
+
+		pthread_mutex_lock(&back->sendLock);
+		if (err != 0 && back->sendErrno == 0)
+			back->sendErrno = err;
+		back->sendBusy = false;
+		pthread_cond_broadcast(&back->sendCond);
+	}
+	pthread_mutex_unlock(&back->sendLock);
+	return NULL;
+}
+
+bool twrpback::writeAdbd(const void* buf, size_t len) {
+	if (!waitSender())
+		return false;
+	if (fwrite(buf, 1, len, adbd_fp) != len)
+		return false;
+	fflush(adbd_fp);
+	return true;
+}
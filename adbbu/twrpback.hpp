@@ -17,9 +17,21 @@
 #ifndef _TWRPBACK_HPP
 #define _TWRPBACK_HPP
 
+#include <deque>
 #include <fstream>
+#include <vector>
+#include <pthread.h>
 #include "../twrpDigest/twrpMD5.hpp"
 
+// Bytes the sender thread writes to one fd: data first, then spliceBytes
+// moved from send_pipe, then padBytes of zeros.
+struct adbSendJob {
+	int fd;
+	std::vector<char> data;
+	uint64_t spliceBytes;
+	size_t padBytes;
+};
+
 class twrpback {
 public:
 	int adbd_fd;                                                             // adbd data stream
@@ -49,12 +61,42 @@ private:
 	char operation[512];                                                     // operation to send to ors
 	std::ofstream adblogfile;                                                // adb stream log file
 	std::string streamFn;
+	int frame_pipe[2];                                                       // payload of the frame being built, spliced to adbd
+	int hash_pipe[2];                                                        // tee of frame_pipe read back for the md5
+	bool use_splice;                                                         // false once splice is found unsupported
+	uint64_t frameBytes;                                                     // payload bytes queued for the current frame
+	uint64_t frameCapacity;                                                  // max payload bytes per frame
+	std::vector<char> frameBuf;                                              // frame payload without splice, md5 scratch with it
+	int send_pipe[2];                                                        // spliced frame payloads waiting for the sender thread
+	bool splice_to_adbd;                                                     // false once adbd is found not to take spliced data
+	pthread_t sendThread;                                                    // writes frames while the next one is read
+	bool sendStarted;                                                        // sendThread is running, otherwise jobs run inline
+	pthread_mutex_t sendLock;                                                // guards the send state below
+	pthread_cond_t sendCond;
+	std::deque<adbSendJob> sendQueue;                                        // jobs not yet picked up by the sender
+	bool sendBusy;                                                           // sender is writing a job
+	bool sendExit;                                                           // tell the sender to quit
+	int sendErrno;                                                           // first failed write, 0 if none
+	std::string sendError;                                                   // what the sender was writing when it failed
 	typedef void (twrpback::*ThreadPtr)(void);
 	typedef void* (*PThreadPtr)(void *);
 	void adbloginit(void);                                                   // setup adb log stream file
 	void close_backup_fds();                                                 // close backup resources
 	void close_restore_fds();                                                // close restore resources
 	bool checkMD5Trailer(char adbReadStream[], uint64_t md5fnsize, twrpMD5* digest); // Check MD5 Trailer
+	void openFramePipes(void);                                               // set up the splice pipes for backup frames
+	void closeFramePipes(void);                                              // release the splice pipes
+	int fillFrame(void);                                                     // move data from TW_ADB_BACKUP into the current frame
+	bool flushFrame(twrpMD5* digest);                                        // write the current frame to adbd
+	bool streamFrames(twrpMD5* digest, bool drain, uint64_t* bytes);         // frame everything TWRP has written so far
+	bool restoreFrame(char hdr[], twrpMD5* digest, uint64_t* bytes);         // pass one frame from adbd to TW_ADB_RESTORE
+	void startSender(void);                                                  // start the sender thread
+	void stopSender(void);                                                   // stop it, dropping anything not yet written
+	bool queueSend(adbSendJob& job, const std::string& what);                // hand a job to the sender
+	bool waitSender(void);                                                   // wait until every queued job is written
+	bool runSendJob(adbSendJob& job, int* err);                             // write one job, returns false with *err set
+	static void* senderThread(void* cookie);                                 // sender thread body
+	bool writeAdbd(const void* buf, size_t len);                             // write a control block to adbd after any queued frames
 	void printErrMsg(std::string msg, int errNum);                          // print error msg to adb log
 };
 
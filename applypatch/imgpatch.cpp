@@ -26,8 +26,12 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -40,6 +44,10 @@
 #include "edify/expr.h"
 #include "otautil/print_sha1.h"
 
+// Upper bound on the threads used to apply the chunks of a single patch. Each in-flight deflate
+// chunk holds its expanded source and patched output in memory.
+static constexpr size_t kMaxPatchThreads = 4;
+
 static inline int64_t Read8(const void *address) {
   return android::base::get_unaligned<int64_t>(address);
 }
@@ -139,152 +147,305 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsign
   return ApplyImagePatch(old_data, old_size, patch, sink, nullptr);
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    const Value* bonus_data) {
-  if (patch.data.size() < 12) {
-    printf("patch too short to contain header\n");
-    return -1;
-  }
-
-  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
-  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
+// Location of one chunk within an IMGDIFF2 patch, as found by ParseImagePatchChunks().
+struct ImagePatchChunk {
+  int type;
+  // The type-specific chunk header, following the 4-byte type.
+  const char* header;
+  // For CHUNK_RAW, the offset and length of the literal data within the patch.
+  size_t raw_offset;
+  size_t raw_len;
+};
+
+// Walks the chunk records of |patch| and checks that all the headers and raw data are within the
+// patch. The chunk payloads themselves are not examined.
+static bool ParseImagePatchChunks(const Value& patch, std::vector<ImagePatchChunk>* chunks) {
   const char* const patch_header = patch.data.data();
-  if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
-    printf("corrupt patch file header (magic number)\n");
-    return -1;
-  }
-
   int num_chunks = Read4(patch_header + 8);
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
     if (pos + 4 > patch.data.size()) {
       printf("failed to read chunk %d record\n", i);
-      return -1;
+      return false;
     }
-    int type = Read4(patch_header + pos);
+    ImagePatchChunk chunk = { Read4(patch_header + pos), nullptr, 0, 0 };
     pos += 4;
+    chunk.header = patch_header + pos;
 
-    if (type == CHUNK_NORMAL) {
-      const char* normal_header = patch_header + pos;
+    if (chunk.type == CHUNK_NORMAL) {
       pos += 24;
       if (pos > patch.data.size()) {
         printf("failed to read chunk %d normal header data\n", i);
-        return -1;
+        return false;
       }
-
-      size_t src_start = static_cast<size_t>(Read8(normal_header));
-      size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
-
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
-        return -1;
-      }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
-      }
-
-      LOG(DEBUG) << "Processed chunk type normal";
-    } else if (type == CHUNK_RAW) {
-      const char* raw_header = patch_header + pos;
+    } else if (chunk.type == CHUNK_RAW) {
       pos += 4;
       if (pos > patch.data.size()) {
         printf("failed to read chunk %d raw header data\n", i);
-        return -1;
+        return false;
       }
 
-      size_t data_len = static_cast<size_t>(Read4(raw_header));
-
-      if (pos + data_len > patch.data.size()) {
+      chunk.raw_offset = pos;
+      chunk.raw_len = static_cast<size_t>(Read4(chunk.header));
+      if (pos + chunk.raw_len > patch.data.size()) {
         printf("failed to read chunk %d raw data\n", i);
-        return -1;
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
-        return -1;
+        return false;
       }
-      pos += data_len;
-
-      LOG(DEBUG) << "Processed chunk type raw";
-    } else if (type == CHUNK_DEFLATE) {
+      pos += chunk.raw_len;
+    } else if (chunk.type == CHUNK_DEFLATE) {
       // deflate chunks have an additional 60 bytes in their chunk header.
-      const char* deflate_header = patch_header + pos;
       pos += 60;
       if (pos > patch.data.size()) {
         printf("failed to read chunk %d deflate header data\n", i);
-        return -1;
+        return false;
       }
+    } else {
+      printf("patch chunk %d is unknown type %d\n", i, chunk.type);
+      return false;
+    }
+    chunks->push_back(chunk);
+  }
+  return true;
+}
 
-      size_t src_start = static_cast<size_t>(Read8(deflate_header));
-      size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+// Applies the |index|-th chunk of |patch| and streams the result to |sink|.
+static int ApplyImagePatchChunk(const unsigned char* old_data, size_t old_size, const Value& patch,
+                                const ImagePatchChunk& chunk, size_t index, SinkFn sink,
+                                const Value* bonus_data) {
+  if (chunk.type == CHUNK_NORMAL) {
+    const char* normal_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(normal_header));
+    size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
+
+    if (src_start + src_len > old_size) {
+      printf("source data too short\n");
+      return -1;
+    }
+    if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink) != 0) {
+      printf("Failed to apply bsdiff patch.\n");
+      return -1;
+    }
+
+    LOG(DEBUG) << "Processed chunk type normal";
+  } else if (chunk.type == CHUNK_RAW) {
+    if (sink(reinterpret_cast<const unsigned char*>(patch.data.data() + chunk.raw_offset),
+             chunk.raw_len) != chunk.raw_len) {
+      printf("failed to write chunk %zu raw data\n", index);
+      return -1;
+    }
+
+    LOG(DEBUG) << "Processed chunk type raw";
+  } else if (chunk.type == CHUNK_DEFLATE) {
+    const char* deflate_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(deflate_header));
+    size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+    size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+    if (src_start + src_len > old_size) {
+      printf("source data too short\n");
+      return -1;
+    }
 
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if the patch was constructed with
+    // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
+    // from the bonus_data value.
+    size_t bonus_size = (index == 1 && bonus_data != nullptr) ? bonus_data->data.size() : 0;
+
+    std::vector<unsigned char> expanded_source(expanded_len);
+
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (expanded_len != 0) {
+      z_stream strm;
+      strm.zalloc = Z_NULL;
+      strm.zfree = Z_NULL;
+      strm.opaque = Z_NULL;
+      strm.avail_in = src_len;
+      strm.next_in = old_data + src_start;
+      strm.avail_out = expanded_len;
+      strm.next_out = expanded_source.data();
+
+      int ret = inflateInit2(&strm, -15);
+      if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
         return -1;
       }
 
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if the patch was constructed with
-      // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
-      // from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != nullptr) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
-
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
+      // Because we've provided enough room to accommodate the output
+      // data, we expect one call to inflate() to suffice.
+      ret = inflate(&strm, Z_SYNC_FLUSH);
+      if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        inflateEnd(&strm);
+        return -1;
+      }
+      // We should have filled the output buffer exactly, except
+      // for the bonus_size.
+      if (strm.avail_out != bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
         inflateEnd(&strm);
+        return -1;
+      }
+      inflateEnd(&strm);
 
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), bonus_data->data.data(),
-                 bonus_size);
-        }
+      if (bonus_size) {
+        memcpy(expanded_source.data() + (expanded_len - bonus_size), bonus_data->data.data(),
+               bonus_size);
       }
+    }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
-        return -1;
+    if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
+                                         patch_offset, deflate_header, sink)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return -1;
+    }
+
+    LOG(DEBUG) << "Processed chunk type deflate";
+  }
+
+  return 0;
+}
+
+// Applies the normal and deflate chunks on a pool of threads. Each chunk's output is collected in
+// memory and handed to |sink| in chunk order by the calling thread; raw chunks are written
+// straight from the patch. At most two chunks per thread are in flight past the last one written,
+// which bounds the memory held by buffered outputs.
+static int ApplyImagePatchChunksInParallel(const unsigned char* old_data, size_t old_size,
+                                           const Value& patch,
+                                           const std::vector<ImagePatchChunk>& chunks,
+                                           size_t num_threads, SinkFn sink,
+                                           const Value* bonus_data) {
+  const size_t chunk_window = num_threads * 2;
+
+  enum class ChunkState { kPending, kDone, kFailed };
+  struct ChunkOutput {
+    ChunkState state = ChunkState::kPending;
+    std::vector<uint8_t> data;
+  };
+  std::vector<ChunkOutput> outputs(chunks.size());
+
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t next_chunk = 0;
+  size_t written_chunks = 0;
+  bool abort = false;
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mu);
+    while (true) {
+      cv.wait(lock, [&] {
+        return abort || next_chunk >= chunks.size() || next_chunk < written_chunks + chunk_window;
+      });
+      if (abort || next_chunk >= chunks.size()) {
+        return;
+      }
+      size_t index = next_chunk++;
+      if (chunks[index].type == CHUNK_RAW) {
+        outputs[index].state = ChunkState::kDone;
+        cv.notify_all();
+        continue;
       }
+      lock.unlock();
+
+      std::vector<uint8_t> data;
+      auto buffer_sink = [&data](const unsigned char* buf, size_t len) -> size_t {
+        data.insert(data.end(), buf, buf + len);
+        return len;
+      };
+      int result = ApplyImagePatchChunk(old_data, old_size, patch, chunks[index], index,
+                                        buffer_sink, bonus_data);
+
+      lock.lock();
+      outputs[index].data = std::move(data);
+      outputs[index].state = result == 0 ? ChunkState::kDone : ChunkState::kFailed;
+      cv.notify_all();
+    }
+  };
 
-      LOG(DEBUG) << "Processed chunk type deflate";
-    } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+
+  int result = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    std::vector<uint8_t> data;
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock, [&] { return outputs[i].state != ChunkState::kPending; });
+      if (outputs[i].state == ChunkState::kFailed) {
+        result = -1;
+        break;
+      }
+      data = std::move(outputs[i].data);
+    }
+
+    if (chunks[i].type == CHUNK_RAW) {
+      result = ApplyImagePatchChunk(old_data, old_size, patch, chunks[i], i, sink, bonus_data);
+    } else if (sink(data.data(), data.size()) != data.size()) {
+      printf("failed to write chunk %zu output\n", i);
+      result = -1;
+    }
+    if (result != 0) {
+      break;
+    }
+
+    std::lock_guard<std::mutex> lock(mu);
+    written_chunks++;
+    cv.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    abort = true;
+    cv.notify_all();
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return result;
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    const Value* bonus_data) {
+  if (patch.data.size() < 12) {
+    printf("patch too short to contain header\n");
+    return -1;
+  }
+
+  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
+  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
+  const char* const patch_header = patch.data.data();
+  if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
+    printf("corrupt patch file header (magic number)\n");
+    return -1;
+  }
+
+  std::vector<ImagePatchChunk> chunks;
+  if (!ParseImagePatchChunks(patch, &chunks)) {
+    return -1;
+  }
+
+  // Only the normal and deflate chunks are worth handing to other threads. With a single one of
+  // those, stream it directly to the sink rather than buffering its output.
+  size_t patched_chunks = std::count_if(chunks.begin(), chunks.end(), [](const auto& chunk) {
+    return chunk.type != CHUNK_RAW;
+  });
+  size_t num_threads = std::min<size_t>(
+      { static_cast<size_t>(std::thread::hardware_concurrency()), kMaxPatchThreads, patched_chunks });
+  if (num_threads > 1) {
+    return ApplyImagePatchChunksInParallel(old_data, old_size, patch, chunks, num_threads, sink,
+                                           bonus_data);
+  }
+
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    if (ApplyImagePatchChunk(old_data, old_size, patch, chunks[i], i, sink, bonus_data) != 0) {
       return -1;
     }
   }
@@ -19,12 +19,16 @@
 	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/stat.h>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <cctype>
+#include <atomic>
+#include <unordered_map>
 #include <cutils/properties.h>
 #include <unistd.h>
 
@@ -75,6 +79,108 @@ pthread_mutex_t DataManager::m_valuesLock =
   PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #endif
 
+// Every variable name gets an interned slot holding its value resolved
+// over mConst, mPersist and mData, plus the numeric forms parsed once on
+// store. Slots are spread over shards guarded by rwlocks, so the GUI,
+// action threads and progress updates only wait on a writer to the same
+// shard, never on each other or on m_valuesLock. The InfoManager maps stay
+// authoritative: bulk changes to them bump values_epoch and stale slots
+// are refilled on their next read.
+#define DATA_SHARD_COUNT 16
+
+enum data_slot_result {
+	DATA_SLOT_HIT,
+	DATA_SLOT_ABSENT,
+	DATA_SLOT_MAGIC,
+	DATA_SLOT_MISS
+};
+
+struct data_slot {
+	bool magic;
+	bool present;
+	unsigned epoch;
+	string value;
+	int int_value;
+	float float_value;
+	unsigned long long ull_value;
+};
+
+struct data_shard {
+	data_shard() { pthread_rwlock_init(&lock, NULL); }
+	pthread_rwlock_t lock;
+	unordered_map<string, data_slot*> slots;
+};
+
+static data_shard data_shards[DATA_SHARD_COUNT];
+static atomic<unsigned> values_epoch(1);
+
+static data_shard& data_shard_for(const string& varName)
+{
+	return data_shards[hash<string>()(varName) % DATA_SHARD_COUNT];
+}
+
+// Only checked once per name, when its slot is interned
+static bool data_is_magic(const string& varName)
+{
+	return varName == "tw_time" || varName == "tw_cpu_temp" || varName == "tw_battery" || varName == "tw_battery_charge";
+}
+
+static void data_slot_copy(const data_slot* slot, string* value, int* int_value, float* float_value, unsigned long long* ull_value)
+{
+	if (value)
+		*value = slot->value;
+	if (int_value)
+		*int_value = slot->int_value;
+	if (float_value)
+		*float_value = slot->float_value;
+	if (ull_value)
+		*ull_value = slot->ull_value;
+}
+
+static data_slot_result data_slot_read(const string& varName, string* value, int* int_value, float* float_value, unsigned long long* ull_value)
+{
+	data_shard& shard = data_shard_for(varName);
+	data_slot_result ret = DATA_SLOT_MISS;
+
+	pthread_rwlock_rdlock(&shard.lock);
+	unordered_map<string, data_slot*>::const_iterator it = shard.slots.find(varName);
+	if (it != shard.slots.end()) {
+		const data_slot* slot = it->second;
+		if (slot->magic) {
+			ret = DATA_SLOT_MAGIC;
+		} else if (slot->epoch == values_epoch) {
+			if (slot->present) {
+				data_slot_copy(slot, value, int_value, float_value, ull_value);
+				ret = DATA_SLOT_HIT;
+			} else {
+				ret = DATA_SLOT_ABSENT;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&shard.lock);
+	return ret;
+}
+
+// Must be called with m_valuesLock held so the epoch and value agree
+static void data_slot_store(const string& varName, bool present, const string& value)
+{
+	data_shard& shard = data_shard_for(varName);
+
+	pthread_rwlock_wrlock(&shard.lock);
+	data_slot*& slot = shard.slots[varName];
+	if (slot == NULL) {
+		slot = new data_slot;
+		slot->magic = data_is_magic(varName);
+	}
+	slot->present = present;
+	slot->epoch = values_epoch;
+	slot->value = value;
+	slot->int_value = atoi(value.c_str());
+	slot->float_value = atof(value.c_str());
+	slot->ull_value = strtoull(value.c_str(), NULL, 10);
+	pthread_rwlock_unlock(&shard.lock);
+}
+
 // Device ID functions
 void DataManager::sanitize_device_id(char *device_id)
 {
@@ -243,6 +349,7 @@ int DataManager::ResetDefaults()
   mPersist.Clear();
   mData.Clear();
   mConst.Clear();
+  values_epoch++;
   pthread_mutex_unlock(&m_valuesLock);
 
   SetDefaultValues();
@@ -258,13 +365,14 @@ int DataManager::LoadValues(const string & filename)
 
   GetValue("device_id", dev_id);
   // Save off the backing file for set operations
+  pthread_mutex_lock(&m_valuesLock);
   mBackingFile = filename;
   mPersist.SetFile(filename);
   mPersist.SetFileVersion(FILE_VERSION);
 
   // Read in the file, if possible
-  pthread_mutex_lock(&m_valuesLock);
   mPersist.LoadValues();
+  values_epoch++;
 
 #ifndef TW_NO_SCREEN_TIMEOUT
   blankTimer.setTime(mPersist.GetIntValue("tw_screen_timeout_secs"));
@@ -334,12 +442,13 @@ int DataManager::LoadPersistValues(void)
     SetDefaultValues();
 
   GetValue("device_id", dev_id);
+  pthread_mutex_lock(&m_valuesLock);
   mPersist.SetFile(PERSIST_SETTINGS_FILE);
   mPersist.SetFileVersion(FILE_VERSION);
 
   // Read in the file, if possible
-  pthread_mutex_lock(&m_valuesLock);
   mPersist.LoadValues();
+  values_epoch++;
 
 #ifndef TW_NO_SCREEN_TIMEOUT
   blankTimer.setTime(mPersist.GetIntValue("tw_screen_timeout_secs"));
@@ -357,24 +466,208 @@ int DataManager::LoadPersistValues(void)
   return 0;
 }
 
-int DataManager::Flush()
+// Settings writes happen on a background thread. Flush() mounts the
+// target storage on the caller, records where to write and (re)arms the
+// debounce timer, so a burst of requests from GUI actions coalesces into
+// one write once things have been quiet for DATA_FLUSH_DELAY_MS.
+// FlushAndWait() skips the timer and returns once everything requested so
+// far is on disk; use it before rebooting.
+//
+// The writer never touches PartitionManager, which has no locking. If the
+// storage recorded by Flush() has been unmounted or replaced by the time
+// the write runs, the write is dropped rather than remounting it.
+#define DATA_FLUSH_DELAY_MS 500
+
+struct flush_target {
+  string file;
+  dev_t dev;
+};
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond;
+static bool flush_started = false;
+static bool flush_now = false;
+static unsigned flush_requested = 0;
+static unsigned flush_completed = 0;
+static int flush_result = 0;
+static struct timespec flush_deadline;
+static flush_target flush_persist;
+static flush_target flush_settings;
+
+// Records File as a write target if the directory holding it exists
+static flush_target flush_target_for(const string & File)
+{
+  flush_target target;
+  struct stat st;
+
+  target.dev = 0;
+  if (!File.empty() && stat(TWFunc::Get_Path(File).c_str(), &st) == 0)
+    {
+      target.file = File;
+      target.dev = st.st_dev;
+    }
+  return target;
+}
+
+// True if the target's directory is still on the filesystem it was on
+// when Flush() mounted it
+static bool flush_target_mounted(const flush_target & target)
+{
+  struct stat st;
+
+  if (target.file.empty())
+    return false;
+  if (stat(TWFunc::Get_Path(target.file).c_str(), &st) != 0
+      || st.st_dev != target.dev)
+    {
+      LOGINFO("Storage for '%s' went away, not saving it\n",
+	      target.file.c_str());
+      return false;
+    }
+  return true;
+}
+
+// Called with flush_lock held; returns false if no writer could be started
+static bool flush_start_thread(void *(*func) (void *))
+{
+  if (flush_started)
+    return true;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&flush_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, func, NULL) != 0)
+    {
+      LOGINFO("Unable to start settings writer, saving synchronously\n");
+      pthread_cond_destroy(&flush_cond);
+      return false;
+    }
+  pthread_detach(thread);
+  flush_started = true;
+  return true;
+}
+
+void *DataManager::FlushThread(void *cookie __unused)
+{
+  pthread_mutex_lock(&flush_lock);
+  for (;;)
+    {
+      while (flush_completed == flush_requested)
+	pthread_cond_wait(&flush_cond, &flush_lock);
+
+      // Each new request pushes the deadline back
+      while (!flush_now
+	     && pthread_cond_timedwait(&flush_cond, &flush_lock,
+				       &flush_deadline) != ETIMEDOUT)
+	;
+
+      unsigned generation = flush_requested;
+      flush_now = false;
+      pthread_mutex_unlock(&flush_lock);
+
+      int ret = SaveValues();
+
+      pthread_mutex_lock(&flush_lock);
+      flush_completed = generation;
+      flush_result = ret;
+      pthread_cond_broadcast(&flush_cond);
+    }
+  return NULL;
+}
+
+void DataManager::PrepareSave()
+{
+  flush_target persist, settings;
+
+#ifndef TW_OEM_BUILD
+#ifndef OF_DEVICE_WITHOUT_PERSIST
+  if (PartitionManager.Mount_By_Path("/persist", false))
+    persist = flush_target_for(PERSIST_SETTINGS_FILE);
+#endif
+
+  pthread_mutex_lock(&m_valuesLock);
+  string backing_file = mBackingFile;
+  pthread_mutex_unlock(&m_valuesLock);
+
+  if (!backing_file.empty())
+    {
+      PartitionManager.Mount_By_Path(GetSettingsStoragePath(), 1);
+      settings = flush_target_for(backing_file);
+    }
+#endif
+
+  pthread_mutex_lock(&flush_lock);
+  flush_persist = persist;
+  flush_settings = settings;
+  pthread_mutex_unlock(&flush_lock);
+}
+
+void DataManager::Flush()
+{
+  PrepareSave();
+
+  pthread_mutex_lock(&flush_lock);
+  if (!flush_start_thread(FlushThread))
+    {
+      pthread_mutex_unlock(&flush_lock);
+      SaveValues();
+      return;
+    }
+  flush_requested++;
+  clock_gettime(CLOCK_MONOTONIC, &flush_deadline);
+  flush_deadline.tv_nsec += DATA_FLUSH_DELAY_MS * 1000000L;
+  flush_deadline.tv_sec += flush_deadline.tv_nsec / 1000000000L;
+  flush_deadline.tv_nsec %= 1000000000L;
+  pthread_cond_broadcast(&flush_cond);
+  pthread_mutex_unlock(&flush_lock);
+}
+
+int DataManager::FlushAndWait()
 {
-  return SaveValues();
+  PrepareSave();
+
+  pthread_mutex_lock(&flush_lock);
+  if (!flush_start_thread(FlushThread))
+    {
+      pthread_mutex_unlock(&flush_lock);
+      return SaveValues();
+    }
+  unsigned generation = ++flush_requested;
+  flush_now = true;
+  pthread_cond_broadcast(&flush_cond);
+  // A write already in progress predates this request, so wait for ours
+  while ((int) (flush_completed - generation) < 0)
+    pthread_cond_wait(&flush_cond, &flush_lock);
+  int ret = flush_result;
+  pthread_mutex_unlock(&flush_lock);
+  return ret;
 }
 
 int DataManager::SaveValues()
 {
 #ifndef TW_OEM_BUILD
+  pthread_mutex_lock(&flush_lock);
+  flush_target persist_target = flush_persist;
+  flush_target settings_target = flush_settings;
+  pthread_mutex_unlock(&flush_lock);
+
+  // Copy under the lock and write without it, so the GUI and action
+  // threads can keep setting values while storage is slow
+  pthread_mutex_lock(&m_valuesLock);
+  InfoManager values(mPersist);
+  pthread_mutex_unlock(&m_valuesLock);
+  values.SetFileVersion(FILE_VERSION);
 
   #ifndef OF_DEVICE_WITHOUT_PERSIST
-  if (PartitionManager.Mount_By_Path("/persist", false))
+  if (flush_target_mounted(persist_target))
     {
-      mPersist.SetFile(PERSIST_SETTINGS_FILE);
-      mPersist.SetFileVersion(FILE_VERSION);
-      pthread_mutex_lock(&m_valuesLock);
-      mPersist.SaveValues();
-      pthread_mutex_unlock(&m_valuesLock);
-      LOGINFO("Saved settings file values to %s\n", PERSIST_SETTINGS_FILE);
+      values.SetFile(persist_target.file);
+      values.WriteValues();
+      LOGINFO("Saved settings file values to %s\n", persist_target.file.c_str());
 
       ofstream file;
 
@@ -389,98 +682,103 @@ int DataManager::SaveValues()
     }
   #endif
 
-  if (mBackingFile.empty())
+  if (!flush_target_mounted(settings_target))
     return -1;
 
-  string mount_path = GetSettingsStoragePath();
-  PartitionManager.Mount_By_Path(mount_path.c_str(), 1);
-
-  mPersist.SetFile(mBackingFile);
-  mPersist.SetFileVersion(FILE_VERSION);
-  pthread_mutex_lock(&m_valuesLock);
-  mPersist.SaveValues();
-  pthread_mutex_unlock(&m_valuesLock);
+  values.SetFile(settings_target.file);
+  if (values.WriteValues() != 0)
+    {
+      LOGINFO("Unable to save settings file '%s'\n", settings_target.file.c_str());
+      return -1;
+    }
 
-  tw_set_default_metadata(mBackingFile.c_str());
-  LOGINFO("Saved settings file values to '%s'\n", mBackingFile.c_str());
+  tw_set_default_metadata(settings_target.file.c_str());
+  LOGINFO("Saved settings file values to '%s'\n", settings_target.file.c_str());
 #endif // ifdef TW_OEM_BUILD
   return 0;
 }
 
 int DataManager::GetValue(const string & varName, string & value)
 {
-  string localStr = varName;
-  int ret = 0;
+  return ReadValue(varName, &value, NULL, NULL, NULL);
+}
+
+int DataManager::GetValue(const string & varName, int &value)
+{
+  return ReadValue(varName, NULL, &value, NULL, NULL);
+}
+
+int DataManager::GetValue(const string & varName, float &value)
+{
+  return ReadValue(varName, NULL, NULL, &value, NULL);
+}
+
+int DataManager::GetValue(const string & varName, unsigned long long &value)
+{
+  return ReadValue(varName, NULL, NULL, NULL, &value);
+}
+
+int DataManager::ReadValue(const string & varName, string * value,
+			   int *int_value, float *float_value,
+			   unsigned long long *ull_value)
+{
+  const string *name = &varName;
+  string localStr, data;
 
   if (!mInitialized)
     SetDefaultValues();
 
   // Strip off leading and trailing '%' if provided
-  if (localStr.length() > 2 && localStr[0] == '%'
-      && localStr[localStr.length() - 1] == '%')
+  if (varName.length() > 2 && varName[0] == '%'
+      && varName[varName.length() - 1] == '%')
     {
-      localStr.erase(0, 1);
-      localStr.erase(localStr.length() - 1, 1);
+      localStr = varName.substr(1, varName.length() - 2);
+      name = &localStr;
     }
 
-  // Handle magic values
-  if (GetMagicValue(localStr, value) == 0)
+  // Fast path, the slot already knows the name is not magic
+  data_slot_result slot = data_slot_read(*name, value, int_value, float_value, ull_value);
+  if (slot == DATA_SLOT_HIT)
     return 0;
+  if (slot == DATA_SLOT_ABSENT)
+    return -1;
+
+  // Handle magic values
+  if ((slot == DATA_SLOT_MAGIC || data_is_magic(*name))
+      && GetMagicValue(*name, data) == 0)
+    goto parse;
 
   // Handle property
-  if (localStr.length() > 9 && localStr.substr(0, 9) == "property.")
+  if (name->length() > 9 && name->compare(0, 9, "property.") == 0)
     {
       char property_value[PROPERTY_VALUE_MAX];
-      property_get(localStr.substr(9).c_str(), property_value, "");
-      value = property_value;
-      return 0;
+      property_get(name->c_str() + 9, property_value, "");
+      data = property_value;
+      goto parse;
     }
 
-  pthread_mutex_lock(&m_valuesLock);
-  ret = mConst.GetValue(localStr, value);
-  if (ret == 0)
-    goto exit;
-
-  ret = mPersist.GetValue(localStr, value);
-  if (ret == 0)
-    goto exit;
-
-  ret = mData.GetValue(localStr, value);
-exit:
-  pthread_mutex_unlock(&m_valuesLock);
-  return ret;
-}
-
-int DataManager::GetValue(const string & varName, int &value)
-{
-  string data;
-
-  if (GetValue(varName, data) != 0)
-    return -1;
-
-  value = atoi(data.c_str());
-  return 0;
-}
-
-int DataManager::GetValue(const string & varName, float &value)
-{
-  string data;
-
-  if (GetValue(varName, data) != 0)
-    return -1;
-
-  value = atof(data.c_str());
-  return 0;
-}
-
-int DataManager::GetValue(const string & varName, unsigned long long &value)
-{
-  string data;
-
-  if (GetValue(varName, data) != 0)
-    return -1;
+  {
+    pthread_mutex_lock(&m_valuesLock);
+    int ret = mConst.GetValue(*name, data);
+    if (ret != 0)
+      ret = mPersist.GetValue(*name, data);
+    if (ret != 0)
+      ret = mData.GetValue(*name, data);
+    data_slot_store(*name, ret == 0, data);
+    pthread_mutex_unlock(&m_valuesLock);
+    if (ret != 0)
+      return ret;
+  }
 
-  value = strtoull(data.c_str(), NULL, 10);
+parse:
+  if (int_value)
+    *int_value = atoi(data.c_str());
+  if (float_value)
+    *float_value = atof(data.c_str());
+  if (ull_value)
+    *ull_value = strtoull(data.c_str(), NULL, 10);
+  if (value)
+    value->swap(data);
   return 0;
 }
 
@@ -509,9 +807,9 @@ int DataManager::SetValue(const string & varName, const string & value,
     SetDefaultValues();
 
   // Handle property
-  if (varName.length() > 9 && varName.substr(0, 9) == "property.")
+  if (varName.length() > 9 && varName.compare(0, 9, "property.") == 0)
     {
-      int ret = property_set(varName.substr(9).c_str(), value.c_str());
+      int ret = property_set(varName.c_str() + 9, value.c_str());
       if (ret)
 	LOGERR("Error setting property '%s' to '%s'\n",
 	       varName.substr(9).c_str(), value.c_str());
@@ -547,6 +845,8 @@ int DataManager::SetValue(const string & varName, const string & value,
 	  mData.SetValue(varName, value);
 	}
     }
+  // Whichever map took it, the value now resolves to this one
+  data_slot_store(varName, true, value);
 
   pthread_mutex_unlock(&m_valuesLock);
 
@@ -568,26 +868,26 @@ int DataManager::SetValue(const string & varName, const string & value,
 int DataManager::SetValue(const string & varName, const int value,
 			  const int persist /* = 0 */ )
 {
-  ostringstream valStr;
-  valStr << value;
-  return SetValue(varName, valStr.str(), persist);
+  char valStr[32];
+  snprintf(valStr, sizeof(valStr), "%d", value);
+  return SetValue(varName, string(valStr), persist);
 }
 
 int DataManager::SetValue(const string & varName, const float value,
 			  const int persist /* = 0 */ )
 {
-  ostringstream valStr;
-  valStr << value;
-  return SetValue(varName, valStr.str(), persist);;
+  char valStr[32];
+  snprintf(valStr, sizeof(valStr), "%g", value);
+  return SetValue(varName, string(valStr), persist);
 }
 
 int DataManager::SetValue(const string & varName,
 			  const unsigned long long &value,
 			  const int persist /* = 0 */ )
 {
-  ostringstream valStr;
-  valStr << value;
-  return SetValue(varName, valStr.str(), persist);
+  char valStr[32];
+  snprintf(valStr, sizeof(valStr), "%llu", value);
+  return SetValue(varName, string(valStr), persist);
 }
 
 // For legacy code that doesn't set a scope
@@ -1151,6 +1451,7 @@ void DataManager::SetDefaultValues()
   mPersist.SetValue(TW_DISABLE_FREE_SPACE_VAR, "0");
   mPersist.SetValue(TW_FORCE_DIGEST_CHECK_VAR, "0");
   mPersist.SetValue(TW_USE_COMPRESSION_VAR, "0");
+  mPersist.SetValue(TW_TAR_BUFFER_SIZE_VAR, "1024");
   mPersist.SetValue(TW_GUI_SORT_ORDER, "1");
   mPersist.SetValue(TW_RM_RF_VAR, "0");
   mPersist.SetValue(TW_SKIP_DIGEST_CHECK_VAR, "0");
@@ -1184,6 +1485,7 @@ void DataManager::SetDefaultValues()
   mData.SetValue("tw_background_thread_running", "0");
   mData.SetValue(TW_RESTORE_FILE_DATE, "0");
   mPersist.SetValue("tw_military_time", "1");
+  mPersist.SetValue("tw_boot_trace", "0");
   mPersist.SetValue(TW_UNMOUNT_VENDOR, "1");
 #ifdef AB_OTA_UPDATER
 	mPersist.SetValue(TW_UNMOUNT_SYSTEM, "0");
@@ -1364,6 +1666,8 @@ void DataManager::SetDefaultValues()
 	else
 		mConst.SetValue("tw_has_repack_tools", "0");
 
+	// Everything above went straight into the maps
+	values_epoch++;
 	pthread_mutex_unlock(&m_valuesLock);
 }
 
@@ -35,7 +35,10 @@ public:
 	static int LoadPersistValues(void);
 	static int FindPasswordBackup(void);
 	static int RestorePasswordBackup(void);
-	static int Flush();
+	// Mounts the settings storage and queues a debounced background write.
+	// Write errors are only logged; use FlushAndWait if the result matters.
+	static void Flush();
+	static int FlushAndWait(); // Writes anything pending now; call before reboot
 
 	// Core get routines
 	static int GetValue(const string& varName, string& value);
@@ -81,9 +84,13 @@ protected:
 	static map<string, string> mConstValues;
 
 protected:
+	static void PrepareSave();
 	static int SaveValues();
+	static void* FlushThread(void* cookie);
 
 	static int GetMagicValue(const string& varName, string& value);
+	// Shared body of the GetValue overloads; fills whichever outputs are non-NULL
+	static int ReadValue(const string& varName, string* value, int* int_value, float* float_value, unsigned long long* ull_value);
 
 private:
 	static void sanitize_device_id(char* device_id);
@@ -0,0 +1,424 @@
+/*
+		Copyright 2026 TeamWin
+		This file is part of TWRP/TeamWin Recovery Project.
+
+		TWRP is free software: you can redistribute it and/or modify
+		it under the terms of the GNU General Public License as published by
+		the Free Software Foundation, either version 3 of the License, or
+		(at your option) any later version.
+
+		TWRP is distributed in the hope that it will be useful,
+		but WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+		GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License
+		along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+#include "direnum.hpp"
+
+#define DIRENUM_BUFFER_SIZE		(256 * 1024)	// getdents64 buffer per thread
+#define DIRENUM_MAX_THREADS		8
+#define DIRENUM_STAT_BATCH		64		// entries a stat worker claims at a time
+#define DIRENUM_THREAD_ENTRIES	512		// entries per extra stat worker
+#define DIRENUM_PROGRESS_STEP	4096	// removals between progress reports
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+struct direnum_stat_job {
+	int dir_fd;
+	int flags;
+	bool fill_type;
+	std::vector<TWDirEntry>* entries;
+	std::atomic<size_t> next;
+};
+
+// A directory being removed. pending counts its own scan plus each
+// subdirectory still queued or in progress; when it drops to zero the
+// directory is empty (unless keep is set) and can be removed.
+struct direnum_rm_dir {
+	std::string path;
+	direnum_rm_dir* parent;
+	unsigned pending;
+	bool keep;
+};
+
+struct direnum_rm_job {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::deque<direnum_rm_dir*> queue;
+	unsigned busy;
+	bool remove_root;
+	const TWDirEnum::Remove_Filter* skip;
+	const TWDirEnum::Remove_Progress* progress;
+	uint64_t removed;
+	uint64_t reported;
+	int error;
+	bool error_is_dir;
+	std::string error_path;
+};
+
+struct direnum_walk_job {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::deque<std::string> queue;
+	unsigned busy;
+	TWDirEnum::Stat_Mode mode;
+	const TWDirEnum::Visitor* visit;
+};
+
+unsigned TWDirEnum::Default_Threads() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		return 1;
+	return cpus > DIRENUM_MAX_THREADS ? DIRENUM_MAX_THREADS : (unsigned)cpus;
+}
+
+static void direnum_stat_range(direnum_stat_job* job) {
+	std::vector<TWDirEntry>& entries = *job->entries;
+	size_t count = entries.size();
+
+	for (;;) {
+		size_t start = job->next.fetch_add(DIRENUM_STAT_BATCH);
+		if (start >= count)
+			return;
+		size_t end = start + DIRENUM_STAT_BATCH < count ? start + DIRENUM_STAT_BATCH : count;
+		for (size_t i = start; i < end; i++) {
+			TWDirEntry& entry = entries[i];
+			if (fstatat(job->dir_fd, entry.name.c_str(), &entry.st, job->flags) != 0) {
+				entry.err = errno;
+				continue;
+			}
+			entry.err = 0;
+			if (job->fill_type && entry.type == DT_UNKNOWN)
+				entry.type = IFTODT(entry.st.st_mode);
+		}
+	}
+}
+
+static void* direnum_stat_thread(void* cookie) {
+	direnum_stat_range((direnum_stat_job*)cookie);
+	return NULL;
+}
+
+// Stats every entry relative to dir_fd. Small directories are done inline;
+// big ones are split over up to Threads workers claiming batches of entries.
+static void direnum_stat_entries(int dir_fd, std::vector<TWDirEntry>& Entries, TWDirEnum::Stat_Mode Mode, unsigned Threads) {
+	direnum_stat_job job;
+	std::vector<pthread_t> workers;
+
+	job.dir_fd = dir_fd;
+	job.flags = Mode == TWDirEnum::Stat_Lstat ? AT_SYMLINK_NOFOLLOW : 0;
+	job.fill_type = Mode == TWDirEnum::Stat_Lstat;
+	job.entries = &Entries;
+	job.next = 0;
+
+	unsigned wanted = Entries.size() / DIRENUM_THREAD_ENTRIES;
+	if (wanted > Threads)
+		wanted = Threads;
+	for (unsigned i = 1; i < wanted; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, direnum_stat_thread, &job) != 0)
+			break;
+		workers.push_back(thread);
+	}
+	direnum_stat_range(&job);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+}
+
+// Reads the names and d_types of an open directory, without "." and "..".
+static int direnum_read_fd(int fd, std::vector<TWDirEntry>& Entries) {
+	static thread_local std::vector<char> buffer;
+
+	if (buffer.empty())
+		buffer.resize(DIRENUM_BUFFER_SIZE);
+	Entries.clear();
+	for (;;) {
+		long len = syscall(SYS_getdents64, fd, &buffer[0], buffer.size());
+		if (len == 0)
+			return 0;
+		if (len < 0)
+			return -1;
+		for (long pos = 0; pos < len;) {
+			struct linux_dirent64* de = (struct linux_dirent64*)&buffer[pos];
+			const char* name = &buffer[pos] + offsetof(struct linux_dirent64, d_name);
+			pos += de->d_reclen;
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+				continue;
+			Entries.push_back(TWDirEntry());
+			TWDirEntry& entry = Entries.back();
+			entry.name = name;
+			entry.type = de->d_type;
+			entry.err = 0;
+			memset(&entry.st, 0, sizeof(entry.st));
+		}
+	}
+}
+
+static int direnum_read_dir(const std::string& Path, std::vector<TWDirEntry>& Entries, TWDirEnum::Stat_Mode Mode, unsigned Threads) {
+	int fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (direnum_read_fd(fd, Entries) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	if (Mode != TWDirEnum::Stat_None)
+		direnum_stat_entries(fd, Entries, Mode, Threads);
+	close(fd);
+	return 0;
+}
+
+int TWDirEnum::Read_Dir(const std::string& Path, std::vector<TWDirEntry>& Entries, Stat_Mode Mode) {
+	return direnum_read_dir(Path, Entries, Mode, Default_Threads());
+}
+
+static void* direnum_walk_thread(void* cookie) {
+	direnum_walk_job* job = (direnum_walk_job*)cookie;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (job->queue.empty() && job->busy > 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->queue.empty())
+			break; // nothing queued and nobody left to queue more
+		std::string dir = job->queue.front();
+		job->queue.pop_front();
+		job->busy++;
+		pthread_mutex_unlock(&job->lock);
+
+		// The walk already runs one directory per worker, so each
+		// directory's stats stay on the worker that read it.
+		std::vector<TWDirEntry> entries;
+		std::vector<std::string> descend;
+		int err = direnum_read_dir(dir, entries, job->mode, 1) == 0 ? 0 : errno;
+		(*job->visit)(dir, err, entries, descend);
+
+		pthread_mutex_lock(&job->lock);
+		job->busy--;
+		for (size_t i = 0; i < descend.size(); i++)
+			job->queue.push_back(descend[i]);
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+void TWDirEnum::Walk(const std::string& Root, Stat_Mode Mode, const Visitor& Visit, unsigned Threads) {
+	direnum_walk_job job;
+	std::vector<pthread_t> workers;
+
+	if (Threads == 0)
+		Threads = Default_Threads();
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	job.queue.push_back(Root);
+	job.busy = 0;
+	job.mode = Mode;
+	job.visit = &Visit;
+
+	for (unsigned i = 1; i < Threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, direnum_walk_thread, &job) != 0)
+			break;
+		workers.push_back(thread);
+	}
+	direnum_walk_thread(&job);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+}
+
+// Called with job->lock held. A directory failure replaces an earlier
+// file one, since callers treat it as the more serious of the two.
+static void direnum_rm_error(direnum_rm_job* job, int err, const std::string& path, bool is_dir) {
+	if (job->error == 0 || (is_dir && !job->error_is_dir)) {
+		job->error = err;
+		job->error_is_dir = is_dir;
+		job->error_path = path;
+	}
+}
+
+// Unlinks the files of one directory relative to its fd and returns the
+// subdirectories still to be emptied.
+static void direnum_rm_scan(direnum_rm_job* job, direnum_rm_dir* dir, std::vector<direnum_rm_dir*>& subdirs, uint64_t& removed) {
+	std::vector<TWDirEntry> entries;
+	// Subdirectories came from d_type, so refuse one swapped for a symlink.
+	int fd = open(dir->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | (dir->parent ? O_NOFOLLOW : 0));
+
+	if (fd < 0 || direnum_read_fd(fd, entries) != 0) {
+		int err = errno;
+		pthread_mutex_lock(&job->lock);
+		direnum_rm_error(job, err, dir->path, true);
+		pthread_mutex_unlock(&job->lock);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	for (size_t i = 0; i < entries.size(); i++) {
+		TWDirEntry& entry = entries[i];
+		std::string path = dir->path + "/" + entry.name;
+		if (job->skip && (*job->skip)(path)) {
+			dir->keep = true;
+			continue;
+		}
+		if (entry.type == DT_UNKNOWN && fstatat(fd, entry.name.c_str(), &entry.st, AT_SYMLINK_NOFOLLOW) == 0)
+			entry.type = IFTODT(entry.st.st_mode);
+		if (entry.type == DT_DIR) {
+			direnum_rm_dir* sub = new direnum_rm_dir;
+			sub->path = path;
+			sub->parent = dir;
+			sub->pending = 1;
+			sub->keep = false;
+			subdirs.push_back(sub);
+		} else if (unlinkat(fd, entry.name.c_str(), 0) == 0) {
+			removed++;
+		} else {
+			int err = errno;
+			pthread_mutex_lock(&job->lock);
+			direnum_rm_error(job, err, path, false);
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+	close(fd);
+}
+
+static void* direnum_rm_thread(void* cookie) {
+	direnum_rm_job* job = (direnum_rm_job*)cookie;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (job->queue.empty() && job->busy > 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->queue.empty())
+			break;
+		direnum_rm_dir* dir = job->queue.front();
+		job->queue.pop_front();
+		job->busy++;
+		pthread_mutex_unlock(&job->lock);
+
+		std::vector<direnum_rm_dir*> subdirs;
+		std::vector<direnum_rm_dir*> finished;
+		uint64_t removed = 0;
+		direnum_rm_scan(job, dir, subdirs, removed);
+
+		pthread_mutex_lock(&job->lock);
+		dir->pending += subdirs.size();
+		for (size_t i = 0; i < subdirs.size(); i++)
+			job->queue.push_back(subdirs[i]);
+		// Drop the scan's reference and collect every directory that is now
+		// done, innermost first, so they can be removed outside the lock.
+		for (direnum_rm_dir* node = dir; node && --node->pending == 0; node = node->parent) {
+			finished.push_back(node);
+			if (node->keep && node->parent)
+				node->parent->keep = true;
+		}
+		pthread_mutex_unlock(&job->lock);
+
+		for (size_t i = 0; i < finished.size(); i++) {
+			direnum_rm_dir* node = finished[i];
+			if (node->keep || (!node->parent && !job->remove_root))
+				continue;
+			if (rmdir(node->path.c_str()) == 0) {
+				removed++;
+			} else {
+				int err = errno;
+				pthread_mutex_lock(&job->lock);
+				direnum_rm_error(job, err, node->path, true);
+				pthread_mutex_unlock(&job->lock);
+			}
+		}
+
+		pthread_mutex_lock(&job->lock);
+		job->removed += removed;
+		for (size_t i = 0; i < finished.size(); i++) {
+			if (finished[i]->parent)
+				delete finished[i];
+		}
+		if (job->progress && job->removed - job->reported >= DIRENUM_PROGRESS_STEP) {
+			job->reported = job->removed;
+			(*job->progress)(job->removed);
+		}
+		job->busy--;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+int TWDirEnum::Remove_Tree(const std::string& Path, bool Remove_Root, const Remove_Filter& Skip,
+	const Remove_Progress& Progress, std::string* Error_Path, bool* Error_Is_Dir, unsigned Threads) {
+	direnum_rm_job job;
+	direnum_rm_dir root;
+	std::vector<pthread_t> workers;
+
+	if (Threads == 0)
+		Threads = Default_Threads();
+	root.path = Path;
+	root.parent = NULL;
+	root.pending = 1;
+	root.keep = false;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	job.queue.push_back(&root);
+	job.busy = 0;
+	job.remove_root = Remove_Root;
+	job.skip = Skip ? &Skip : NULL;
+	job.progress = Progress ? &Progress : NULL;
+	job.removed = 0;
+	job.reported = 0;
+	job.error = 0;
+	job.error_is_dir = false;
+
+	for (unsigned i = 1; i < Threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, direnum_rm_thread, &job) != 0)
+			break;
+		workers.push_back(thread);
+	}
+	direnum_rm_thread(&job);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+
+	if (job.progress)
+		Progress(job.removed);
+	if (job.error) {
+		if (Error_Path)
+			*Error_Path = job.error_path;
+		if (Error_Is_Dir)
+			*Error_Is_Dir = job.error_is_dir;
+		errno = job.error;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+		Copyright 2026 TeamWin
+		This file is part of TWRP/TeamWin Recovery Project.
+
+		TWRP is free software: you can redistribute it and/or modify
+		it under the terms of the GNU General Public License as published by
+		the Free Software Foundation, either version 3 of the License, or
+		(at your option) any later version.
+
+		TWRP is distributed in the hope that it will be useful,
+		but WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+		GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License
+		along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWDIRENUM_HPP
+#define TWDIRENUM_HPP
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// One directory entry as returned by TWDirEnum. type is the d_type
+// reported by getdents64; with Stat_Lstat it is filled in from st_mode
+// when the filesystem reports DT_UNKNOWN. err is 0 when st is valid and
+// the errno of the failed stat otherwise.
+struct TWDirEntry {
+	std::string name;
+	unsigned char type;
+	int err;
+	struct stat st;
+};
+
+// Shared directory enumeration for MTP, the file manager and size scans.
+// Entries are read with getdents64 into a large buffer and stat'ed with
+// fstatat relative to the directory fd, on several threads for big
+// directories. Nothing here logs; callers report errors their own way.
+class TWDirEnum {
+public:
+	enum Stat_Mode {
+		Stat_None,		// names and d_type only
+		Stat_Lstat,		// lstat semantics, symlinks are not followed
+		Stat_Follow		// stat semantics, symlinks are followed
+	};
+
+	// Called once per directory by Walk, possibly from several threads at
+	// once. Err is the errno if Dir could not be read, in which case
+	// Entries is empty. Append the full paths of subdirectories to
+	// descend into to Descend.
+	typedef std::function<void(const std::string& Dir, int Err, std::vector<TWDirEntry>& Entries, std::vector<std::string>& Descend)> Visitor;
+
+	// Remove_Tree hooks. Skip gets the full path of every entry and returns
+	// true to leave it (and so its parent directories) in place. Progress
+	// gets the running count of removed entries every few thousand
+	// removals and once at the end; calls are serialized.
+	typedef std::function<bool(const std::string& Path)> Remove_Filter;
+	typedef std::function<void(uint64_t Removed)> Remove_Progress;
+
+	// Reads all entries of Path except "." and "..". Returns 0, or -1
+	// with errno set if the directory could not be opened or read.
+	static int Read_Dir(const std::string& Path, std::vector<TWDirEntry>& Entries, Stat_Mode Mode);
+
+	// Walks the tree below Root breadth first on up to Threads workers
+	// (0 picks one per CPU). Each directory is read with Read_Dir in Mode.
+	static void Walk(const std::string& Root, Stat_Mode Mode, const Visitor& Visit, unsigned Threads = 0);
+
+	// Deletes everything below Path, and Path itself if Remove_Root, with
+	// directories fanned out over up to Threads workers and entries removed
+	// with unlinkat relative to their directory fd. Keeps going past
+	// failures; returns 0, or -1 with errno and Error_Path set from the
+	// first directory that could not be opened or removed, or failing
+	// that the first file that could not be unlinked. Error_Is_Dir tells
+	// which of the two it was. Path itself is opened like opendir would,
+	// so a symlink to a directory empties its target.
+	static int Remove_Tree(const std::string& Path, bool Remove_Root, const Remove_Filter& Skip = Remove_Filter(),
+		const Remove_Progress& Progress = Remove_Progress(), std::string* Error_Path = NULL,
+		bool* Error_Is_Dir = NULL, unsigned Threads = 0);
+
+	static unsigned Default_Threads();
+};
+
+#endif // TWDIRENUM_HPP
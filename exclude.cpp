@@ -23,8 +23,11 @@ extern "C" {
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <atomic>
 #include <string>
 #include <vector>
+#include "direnum.hpp"
 #include "exclude.hpp"
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
@@ -59,45 +62,53 @@ void TWExclude::add_absolute_dir(const string& dir) {
 }
 
 uint64_t TWExclude::Get_Folder_Size(const string& Path) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	uint64_t dusize = 0;
-	string FullPath;
-
-	d = opendir(Path.c_str());
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		return 0;
-	}
-
+	std::atomic<uint64_t> dusize(0);
+	pthread_mutex_t msg_lock = PTHREAD_MUTEX_INITIALIZER;
 	static uint64_t i = 0;
-	while ((de = readdir(d)) != NULL) {
-		FullPath = Path + "/";
-		FullPath += de->d_name;
-		if (lstat(FullPath.c_str(), &st)) {
-
-			// DJ9: avoid continued spamming of the log screen after a few reports
-			if (i < 10) // eventually stop increasing the count
-			   i++;
-
-			if (i < 4) {
-			   gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
-			   LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
-			}
-
-			if (i == 7) // ok, the errors continue - so, inform the user
-			   LOGERR("** Persistent read errors! **\nDecryption has probably failed!\n\n");
 
-			continue;
+	// Subdirectories are read and stat'ed in parallel; the visitor runs on
+	// several threads, so the error counter and messages share one lock.
+	TWDirEnum::Walk(Path, TWDirEnum::Stat_Lstat, [&](const string& Dir, int Err, vector<TWDirEntry>& Entries, vector<string>& Descend) {
+		if (Err) {
+			pthread_mutex_lock(&msg_lock);
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Dir)(strerror(Err)));
+			pthread_mutex_unlock(&msg_lock);
+			return;
 		}
-		if ((st.st_mode & S_IFDIR) && !check_skip_dirs(FullPath) && de->d_type != DT_SOCK) {
-			dusize += Get_Folder_Size(FullPath);
-		} else if (st.st_mode & S_IFREG || st.st_mode & S_IFLNK) {
-			dusize += (uint64_t)(st.st_size);
+		uint64_t size = 0;
+		for (size_t e = 0; e < Entries.size(); e++) {
+			const TWDirEntry& entry = Entries[e];
+			if (entry.err) {
+				string FullPath = Dir + "/" + entry.name;
+				pthread_mutex_lock(&msg_lock);
+
+				// DJ9: avoid continued spamming of the log screen after a few reports
+				if (i < 10) // eventually stop increasing the count
+				   i++;
+
+				if (i < 4) {
+				   gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(entry.err)));
+				   LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
+				}
+
+				if (i == 7) // ok, the errors continue - so, inform the user
+				   LOGERR("** Persistent read errors! **\nDecryption has probably failed!\n\n");
+
+				pthread_mutex_unlock(&msg_lock);
+				continue;
+			}
+			if ((entry.st.st_mode & S_IFDIR) && entry.type != DT_SOCK) {
+				string FullPath = Dir + "/" + entry.name;
+				if (!check_skip_dirs(FullPath)) {
+					Descend.push_back(FullPath);
+					continue;
+				}
+			}
+			if (entry.st.st_mode & S_IFREG || entry.st.st_mode & S_IFLNK)
+				size += (uint64_t)(entry.st.st_size);
 		}
-	}
-	closedir(d);
+		dusize += size;
+	});
 	return dusize;
 }
 
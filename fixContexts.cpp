@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <cctype>
 #include "fixContexts.hpp"
 #include "twrp-functions.hpp"
@@ -36,60 +37,99 @@ struct selabel_handle *sehandle;
 struct selinux_opt selinux_options[] = {
 	{ SELABEL_OPT_PATH, "/file_contexts" }
 };
+// selabel_lookup keeps regex match state inside the handle, so each
+// walker thread opens its own; it is closed when the thread exits.
+static pthread_key_t sehandle_key;
+static pthread_once_t sehandle_key_once = PTHREAD_ONCE_INIT;
 
-int fixContexts::restorecon(string entry, struct stat *sb) {
-	char *oldcontext, *newcontext;
+static void close_thread_sehandle(void *handle) {
+	selabel_close((struct selabel_handle*) handle);
+}
 
-	if (lgetfilecon(entry.c_str(), &oldcontext) < 0) {
-		LOGINFO("Couldn't get selinux context for %s\n", entry.c_str());
-		return -1;
+static void make_sehandle_key(void) {
+	pthread_key_create(&sehandle_key, close_thread_sehandle);
+}
+
+static struct selabel_handle* thread_sehandle(void) {
+	pthread_once(&sehandle_key_once, make_sehandle_key);
+	struct selabel_handle *handle = (struct selabel_handle*) pthread_getspecific(sehandle_key);
+	if (!handle) {
+		handle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
+		if (handle)
+			pthread_setspecific(sehandle_key, handle);
 	}
-	if (selabel_lookup(sehandle, &newcontext, entry.c_str(), sb->st_mode) < 0) {
+	return handle;
+}
+
+int fixContexts::lookup(const string& entry, mode_t mode, string& context) {
+	char *newcontext;
+	struct selabel_handle *handle = thread_sehandle();
+
+	if (!handle || selabel_lookup(handle, &newcontext, entry.c_str(), mode) < 0) {
 		LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
 		return -1;
 	}
-	if (strcmp(oldcontext, newcontext) != 0) {
-		LOGINFO("Relabeling %s from %s to %s\n", entry.c_str(), oldcontext, newcontext);
-		if (lsetfilecon(entry.c_str(), newcontext) < 0) {
-			LOGINFO("Couldn't label %s with %s: %s\n", entry.c_str(), newcontext, strerror(errno));
+	context = newcontext;
+	freecon(newcontext);
+	return 0;
+}
+
+int fixContexts::restorecon(const string& entry, const string& context) {
+	char *oldcontext;
+
+	if (lgetfilecon(entry.c_str(), &oldcontext) < 0) {
+		LOGINFO("Couldn't get selinux context for %s\n", entry.c_str());
+		return -1;
+	}
+	if (context != oldcontext) {
+		LOGINFO("Relabeling %s from %s to %s\n", entry.c_str(), oldcontext, context.c_str());
+		if (lsetfilecon(entry.c_str(), context.c_str()) < 0) {
+			LOGINFO("Couldn't label %s with %s: %s\n", entry.c_str(), context.c_str(), strerror(errno));
 		}
 	}
 	freecon(oldcontext);
-	freecon(newcontext);
 	return 0;
 }
 
-int fixContexts::fixContextsRecursively(string name, int level) {
-	DIR *d;
-	struct dirent *de;
-	struct stat sb;
-	string path;
+int fixContexts::restorecon(const string& entry, mode_t mode) {
+	string context;
 
-	if (!(d = opendir(name.c_str())))
-		return -1;
-	if (!(de = readdir(d)))
+	if (lookup(entry, mode, context) < 0)
 		return -1;
+	return restorecon(entry, context);
+}
 
-	do {
-		if (de->d_type ==  DT_DIR) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-				continue;
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-			fixContextsRecursively(path, level + 1);
-		}
-		else {
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
+// Relabels the entries of one directory; TWDirEnum::Walk runs this on
+// several directories at once.
+void fixContexts::relabelDir(const string& dir, int err, vector<TWDirEntry>& entries, vector<string>& descend) {
+	if (err) {
+		LOGINFO("opendir failed for '%s' (%s)\n", dir.c_str(), strerror(err));
+		return;
+	}
+	for (size_t i = 0; i < entries.size(); i++) {
+		const TWDirEntry& entry = entries[i];
+		string path = dir + "/" + entry.name;
+		if (entry.err) {
+			LOGINFO("Couldn't stat %s: %s\n", path.c_str(), strerror(entry.err));
+			continue;
 		}
-	} while ((de = readdir(d)));
-	closedir(d);
+		// file_contexts rules match on the full path, so every entry
+		// gets its own lookup
+		string context;
+		if (lookup(path, entry.st.st_mode, context) < 0)
+			continue;
+		restorecon(path, context);
+		if (S_ISDIR(entry.st.st_mode))
+			descend.push_back(path);
+	}
+}
+
+int fixContexts::fixContextsRecursively(string name) {
+	TWDirEnum::Walk(name, TWDirEnum::Stat_Lstat, relabelDir);
 	return 0;
 }
 
 int fixContexts::fixDataMediaContexts(string Mount_Point) {
-	DIR *d;
-	struct dirent *de;
 	struct stat sb;
 
 	LOGINFO("Fixing media contexts on '%s'\n", Mount_Point.c_str());
@@ -99,47 +139,51 @@ int fixContexts::fixDataMediaContexts(string Mount_Point) {
 		LOGINFO("Unable to open /file_contexts\n");
 		return 0;
 	}
+	// This thread walks too; it uses sehandle, which is closed below.
+	pthread_once(&sehandle_key_once, make_sehandle_key);
+	pthread_setspecific(sehandle_key, sehandle);
 
 	if (TWFunc::Path_Exists(Mount_Point + "/media/0")) {
 		string dir = Mount_Point + "/media";
-		if (!(d = opendir(dir.c_str()))) {
+		vector<TWDirEntry> entries;
+		if (TWDirEnum::Read_Dir(dir, entries, TWDirEnum::Stat_Lstat) != 0) {
 			LOGINFO("opendir failed (%s)\n", strerror(errno));
-			return -1;
-		}
-		if (!(de = readdir(d))) {
-			LOGINFO("readdir failed (%s)\n", strerror(errno));
-			closedir(d);
+			closeHandle();
 			return -1;
 		}
 
-		do {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || de->d_type != DT_DIR)
+		for (size_t e = 0; e < entries.size(); e++) {
+			const TWDirEntry& entry = entries[e];
+			if (entry.err || !S_ISDIR(entry.st.st_mode))
 				continue;
-			size_t len = strlen(de->d_name);
 			bool is_numeric = true;
-			char* folder_name = de->d_name;
-			for (size_t i = 0; i < len; i++) {
-				if (!isdigit(*folder_name)) {
+			for (size_t i = 0; i < entry.name.size(); i++) {
+				if (!isdigit(entry.name[i])) {
 					is_numeric = false;
 					break;
 				}
-				folder_name++;
 			}
 			if (is_numeric) {
-				dir = Mount_Point + "/media/";
-				dir += de->d_name;
-				restorecon(dir, &sb);
-				fixContextsRecursively(dir, 0);
+				dir = Mount_Point + "/media/" + entry.name;
+				restorecon(dir, entry.st.st_mode);
+				fixContextsRecursively(dir);
 			}
-		} while ((de = readdir(d)));
-		closedir(d);
+		}
 	} else if (TWFunc::Path_Exists(Mount_Point + "/media")) {
-		restorecon(Mount_Point + "/media", &sb);
-		fixContextsRecursively(Mount_Point + "/media", 0);
+		if (lstat((Mount_Point + "/media").c_str(), &sb) == 0)
+			restorecon(Mount_Point + "/media", sb.st_mode);
+		fixContextsRecursively(Mount_Point + "/media");
 	} else {
 		LOGINFO("fixDataMediaContexts: %s/media does not exist!\n", Mount_Point.c_str());
+		closeHandle();
 		return 0;
 	}
-	selabel_close(sehandle);
+	closeHandle();
 	return 0;
 }
+
+void fixContexts::closeHandle(void) {
+	pthread_setspecific(sehandle_key, NULL);
+	selabel_close(sehandle);
+	sehandle = NULL;
+}
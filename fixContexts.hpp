@@ -20,6 +20,8 @@
 #define __FIXCONTEXTS_HPP
 
 #include <string>
+#include <vector>
+#include "direnum.hpp"
 
 using namespace std;
 
@@ -28,8 +30,12 @@ class fixContexts {
 		static int fixDataMediaContexts(string Mount_Point);
 
 	private:
-		static int restorecon(string entry, struct stat *sb);
-		static int fixContextsRecursively(string path, int level);
+		static int lookup(const string& entry, mode_t mode, string& context);
+		static int restorecon(const string& entry, mode_t mode);
+		static int restorecon(const string& entry, const string& context);
+		static void relabelDir(const string& dir, int err, vector<TWDirEntry>& entries, vector<string>& descend);
+		static int fixContextsRecursively(string path);
+		static void closeHandle(void);
 };
 
 #endif
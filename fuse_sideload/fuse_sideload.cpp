@@ -57,8 +57,16 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/stringprintf.h>
@@ -71,8 +79,27 @@ static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
 static constexpr int NO_STATUS = 1;
 static constexpr int NO_STATUS_EXIT = 2;
 
+// Total memory used for cached blocks, and the maximum number of blocks to read ahead once the
+// reads look sequential. The cache always holds at least two blocks, since a read may span two.
+static constexpr size_t kBlockCacheBytes = 8 * 1024 * 1024;
+static constexpr size_t kMaxReadaheadBlocks = 8;
+// Number of threads serving FUSE_READ requests. Each of them fetches, hashes and replies on its
+// own, so host round trips, hashing and replies to the kernel overlap across requests.
+static constexpr size_t kReadWorkers = 4;
+
 using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
+struct CachedBlock {
+  uint32_t block;
+  std::vector<uint8_t> data;
+};
+
+// A FUSE_READ request handed from the request loop to a read worker.
+struct ReadRequest {
+  fuse_in_header hdr;
+  fuse_read_in in;
+};
+
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
 
@@ -86,15 +113,42 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently read from the host
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+  // Everything below is shared with the prefetch thread and guarded by cache_mu.
+  std::mutex cache_mu;
+  std::condition_variable cache_cv;
 
   std::vector<SHA256Digest>
       hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+
+  std::list<CachedBlock> cache;  // verified blocks, most recently used first
+  std::unordered_map<uint32_t, std::list<CachedBlock>::iterator> cache_index;
+  size_t cache_capacity;  // in blocks
+  std::set<uint32_t> fetching;  // blocks currently being read from the provider
+
+  uint32_t last_block;  // last block requested by the kernel, to detect sequential reads
+  size_t readahead;     // number of blocks to prefetch on sequential reads
+  std::deque<uint32_t> prefetch_queue;
+  bool prefetch_exit;
+  std::thread prefetch_thread;
+
+  std::mutex provider_mu;  // providers serve one request at a time
+
+  // Pending read requests, guarded by read_mu.
+  std::mutex read_mu;
+  std::condition_variable read_cv;
+  std::deque<ReadRequest> read_queue;
+  bool read_exit;
+  std::vector<std::thread> read_workers;
 };
 
+static void fuse_reply_error(const fuse_data* fd, uint64_t unique, int error) {
+  fuse_out_header outhdr;
+  outhdr.len = sizeof(outhdr);
+  outhdr.error = error;
+  outhdr.unique = unique;
+  TEMP_FAILURE_RETRY(write(fd->ffd, &outhdr, sizeof(outhdr)));
+}
+
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
   fuse_out_header hdr;
   hdr.len = len + sizeof(hdr);
@@ -140,7 +194,9 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
 
   out.major = FUSE_KERNEL_VERSION;
   out.max_readahead = req->max_readahead;
-  out.flags = 0;
+  // Let the kernel issue readahead requests concurrently, so that the read workers have something
+  // to overlap.
+  out.flags = req->flags & FUSE_ASYNC_READ;
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
@@ -223,43 +279,40 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint64_t block) {
-  if (block == fd->curr_block) {
-    return 0;
-  }
-
+// Reads |block| from the provider into |buffer| and checks it against the hash recorded on the
+// first read of that block. Returns 0 on success, negative otherwise.
+static int read_block(fuse_data* fd, uint32_t block, uint8_t* buffer) {
   if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
+    memset(buffer, 0, fd->block_size);
     return 0;
   }
 
   uint32_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
+  if (static_cast<uint64_t>(block) * fd->block_size + fetch_size > fd->file_size) {
     // If we're reading the last (partial) block of the file, expect a shorter response from the
     // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+    fetch_size = fd->file_size - (static_cast<uint64_t>(block) * fd->block_size);
+    memset(buffer + fetch_size, 0, fd->block_size - fetch_size);
   }
 
-  if (!fd->provider->ReadBlockAlignedData(fd->block_data, fetch_size, block)) {
-    return -EIO;
+  {
+    std::lock_guard<std::mutex> lock(fd->provider_mu);
+    if (!fd->provider->ReadBlockAlignedData(buffer, fetch_size, block)) {
+      return -EIO;
+    }
   }
 
-  fd->curr_block = block;
-
   // Verify the hash of the block we just got from the host.
   //
   // - If the hash of the just-received data matches the stored hash for the block, accept it.
   // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
   //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+  // - Otherwise, return -EIO for the read.
 
   SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
+  SHA256(buffer, fd->block_size, hash.data());
 
+  std::lock_guard<std::mutex> lock(fd->cache_mu);
   const SHA256Digest& blockhash = fd->hashes[block];
   if (hash == blockhash) {
     return 0;
@@ -267,7 +320,6 @@ static int fetch_block(fuse_data* fd, uint64_t block) {
 
   for (uint8_t i : blockhash) {
     if (i != 0) {
-      fd->curr_block = -1;
       return -EIO;
     }
   }
@@ -276,7 +328,109 @@ static int fetch_block(fuse_data* fd, uint64_t block) {
   return 0;
 }
 
-static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
+// Returns a buffer for a new cache entry, evicting the least recently used block if the cache is
+// full. Must be called with cache_mu held.
+static std::vector<uint8_t> take_cache_buffer(fuse_data* fd) {
+  if (fd->cache.size() + fd->fetching.size() < fd->cache_capacity || fd->cache.empty()) {
+    return std::vector<uint8_t>(fd->block_size);
+  }
+  std::vector<uint8_t> buffer = std::move(fd->cache.back().data);
+  fd->cache_index.erase(fd->cache.back().block);
+  fd->cache.pop_back();
+  return buffer;
+}
+
+// Reads |block| (through the cache) and copies |len| bytes starting at |offset| within the block
+// to |dest|. If the prefetch thread is already reading the block, waits for it instead of issuing
+// a second request. Returns 0 on success, negative otherwise.
+static int copy_from_block(fuse_data* fd, uint32_t block, uint32_t offset, uint32_t len,
+                           uint8_t* dest) {
+  std::unique_lock<std::mutex> lock(fd->cache_mu);
+  fd->cache_cv.wait(lock, [&] { return fd->fetching.count(block) == 0; });
+
+  auto it = fd->cache_index.find(block);
+  if (it == fd->cache_index.end()) {
+    fd->fetching.insert(block);
+    std::vector<uint8_t> buffer = take_cache_buffer(fd);
+    lock.unlock();
+    int result = read_block(fd, block, buffer.data());
+    lock.lock();
+    fd->fetching.erase(block);
+    fd->cache_cv.notify_all();
+    if (result != 0) {
+      return result;
+    }
+    fd->cache.push_front({ block, std::move(buffer) });
+    it = fd->cache_index.emplace(block, fd->cache.begin()).first;
+  } else if (it->second != fd->cache.begin()) {
+    fd->cache.splice(fd->cache.begin(), fd->cache, it->second);
+  }
+
+  memcpy(dest, it->second->data.data() + offset, len);
+  return 0;
+}
+
+// Queues the blocks following |block| for prefetching if the kernel appears to read the file
+// sequentially. Random access (e.g. jumping to the zip central directory) drops pending requests.
+// Concurrent requests may complete slightly out of order, so anything within the readahead
+// window of the previous block still counts as sequential.
+static void schedule_readahead(fuse_data* fd, uint32_t block) {
+  std::lock_guard<std::mutex> lock(fd->cache_mu);
+  int64_t distance = static_cast<int64_t>(block) - static_cast<int64_t>(fd->last_block);
+  bool sequential = fd->last_block == static_cast<uint32_t>(-1)
+                        ? block == 0
+                        : distance >= -static_cast<int64_t>(kReadWorkers) &&
+                              distance <= static_cast<int64_t>(fd->readahead) + 1;
+  if (distance > 0 || !sequential) {
+    fd->last_block = block;
+  }
+  fd->prefetch_queue.clear();
+  if (!sequential) {
+    return;
+  }
+
+  for (uint32_t next = block + 1; next <= block + fd->readahead && next < fd->file_blocks; next++) {
+    if (fd->cache_index.count(next) == 0 && fd->fetching.count(next) == 0) {
+      fd->prefetch_queue.push_back(next);
+    }
+  }
+  if (!fd->prefetch_queue.empty()) {
+    fd->cache_cv.notify_all();
+  }
+}
+
+static void prefetch_blocks(fuse_data* fd) {
+  std::unique_lock<std::mutex> lock(fd->cache_mu);
+  while (true) {
+    fd->cache_cv.wait(lock, [&] { return fd->prefetch_exit || !fd->prefetch_queue.empty(); });
+    if (fd->prefetch_exit) {
+      return;
+    }
+
+    uint32_t block = fd->prefetch_queue.front();
+    fd->prefetch_queue.pop_front();
+    if (fd->cache_index.count(block) != 0 || fd->fetching.count(block) != 0) {
+      continue;
+    }
+
+    fd->fetching.insert(block);
+    std::vector<uint8_t> buffer = take_cache_buffer(fd);
+    lock.unlock();
+    int result = read_block(fd, block, buffer.data());
+    lock.lock();
+    fd->fetching.erase(block);
+    // A failed prefetch is simply dropped; the error resurfaces if the block is actually read.
+    if (result == 0) {
+      fd->cache.push_front({ block, std::move(buffer) });
+      fd->cache_index.emplace(block, fd->cache.begin());
+    }
+    fd->cache_cv.notify_all();
+  }
+}
+
+// Serves a read request, using |reply_data| (block_size bytes) as the storage for the reply.
+static int handle_read(const void* data, fuse_data* fd, const fuse_in_header* hdr,
+                       uint8_t* reply_data) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
   const fuse_read_in* req = static_cast<const fuse_read_in*>(data);
@@ -296,51 +450,65 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
+  struct iovec vec[2];
   vec[0].iov_base = &outhdr;
   vec[0].iov_len = sizeof(outhdr);
 
   uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
+  uint32_t block_offset = offset - (block * fd->block_size);
 
   // Two cases:
   //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
+  //   - the read request is entirely within this block.
   //
   //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
-
-  uint32_t block_offset = offset - (block * fd->block_size);
-
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
-
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
+  //     with max_read=block_size, a read can never span more than two blocks.
+  //
+  // Either way the data is copied out of the block cache into reply_data, so that the cached
+  // blocks may be evicted by other threads while the reply is being written.
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
+  uint32_t first_len = std::min(size, fd->block_size - block_offset);
+  int result = copy_from_block(fd, block, block_offset, first_len, reply_data);
+  if (result != 0) return result;
 
-    result = fetch_block(fd, block + 1);
+  if (first_len < size) {
+    result = copy_from_block(fd, block + 1, 0, size - first_len, reply_data + first_len);
     if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
   }
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
+  schedule_readahead(fd, first_len < size ? block + 1 : block);
+
+  vec[1].iov_base = reply_data;
+  vec[1].iov_len = size;
+
+  if (writev(fd->ffd, vec, 2) == -1) {
     printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
   }
   return NO_STATUS;
 }
 
+static void serve_reads(fuse_data* fd) {
+  std::vector<uint8_t> reply_data(fd->block_size);
+  std::unique_lock<std::mutex> lock(fd->read_mu);
+  while (true) {
+    fd->read_cv.wait(lock, [&] { return fd->read_exit || !fd->read_queue.empty(); });
+    if (fd->read_exit) {
+      return;
+    }
+
+    ReadRequest request = fd->read_queue.front();
+    fd->read_queue.pop_front();
+    lock.unlock();
+
+    int result = handle_read(&request.in, fd, &request.hdr, reply_data.data());
+    if (result != NO_STATUS) {
+      fuse_reply_error(fd, request.hdr.unique, result);
+    }
+
+    lock.lock();
+  }
+}
+
 int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point) {
   // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
   // previous abnormal exit.)
@@ -377,19 +545,9 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
-  }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
-  }
+  fd.cache_capacity = std::max<size_t>(2, kBlockCacheBytes / block_size);
+  fd.readahead = std::min(kMaxReadaheadBlocks, fd.cache_capacity / 2);
+  fd.last_block = -1;
 
   fd.ffd.reset(open("/dev/fuse", O_RDWR));
   if (fd.ffd == -1) {
@@ -411,6 +569,11 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     }
   }
 
+  fd.prefetch_thread = std::thread(prefetch_blocks, &fd);
+  for (size_t i = 0; i < kReadWorkers; i++) {
+    fd.read_workers.emplace_back(serve_reads, &fd);
+  }
+
   uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
   for (;;) {
     ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
@@ -450,9 +613,19 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
         result = handle_open(data, &fd, hdr);
         break;
 
-      case FUSE_READ:
-        result = handle_read(data, &fd, hdr);
+      case FUSE_READ: {
+        // Older kernels send a shorter fuse_read_in; the missing fields are left zeroed.
+        ReadRequest request = {};
+        request.hdr = *hdr;
+        memcpy(&request.in, data, std::min(sizeof(request.in), len - sizeof(fuse_in_header)));
+        {
+          std::lock_guard<std::mutex> lock(fd.read_mu);
+          fd.read_queue.push_back(request);
+        }
+        fd.read_cv.notify_one();
+        result = NO_STATUS;
         break;
+      }
 
       case FUSE_FLUSH:
         result = handle_flush(data, &fd, hdr);
@@ -473,23 +646,40 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     }
 
     if (result != NO_STATUS) {
-      fuse_out_header outhdr;
-      outhdr.len = sizeof(outhdr);
-      outhdr.error = result;
-      outhdr.unique = hdr->unique;
-      TEMP_FAILURE_RETRY(write(fd.ffd, &outhdr, sizeof(outhdr)));
+      fuse_reply_error(&fd, hdr->unique, result);
     }
   }
 
 done:
+  {
+    std::lock_guard<std::mutex> lock(fd.read_mu);
+    fd.read_exit = true;
+  }
+  fd.read_cv.notify_all();
+  for (auto& worker : fd.read_workers) {
+    worker.join();
+  }
+  // The workers finish the request they're on but leave the rest queued. Those still need a reply,
+  // or whoever issued them stays blocked in read().
+  for (const auto& request : fd.read_queue) {
+    fuse_reply_error(&fd, request.hdr.unique, -EIO);
+  }
+  fd.read_queue.clear();
+
+  if (fd.prefetch_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(fd.cache_mu);
+      fd.prefetch_exit = true;
+      fd.cache_cv.notify_all();
+    }
+    fd.prefetch_thread.join();
+  }
+
   provider->Close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
-
   return result;
 }
@@ -16,6 +16,10 @@
 	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <string>
 #include <map>
 #include <fstream>
@@ -118,8 +122,18 @@ int InfoManager::SaveValues(void) {
 		return -1;
 
 	PartitionManager.Mount_By_Path(File, true);
+	return WriteValues();
+}
+
+int InfoManager::WriteValues(void) {
+	if (File.empty())
+		return -1;
+
 	LOGINFO("InfoManager saving '%s'\n", File.c_str());
-	FILE* out = fopen(File.c_str(), "wb");
+	// Written beside the target and renamed over it, so a crash or power
+	// loss mid-write leaves the previous file intact
+	string tmp_file = File + ".tmp";
+	FILE* out = fopen(tmp_file.c_str(), "wb");
 	if (!out)
 		return -1;
 
@@ -136,7 +150,18 @@ int InfoManager::SaveValues(void) {
 		fwrite(&length, 1, sizeof(unsigned short), out);
 		fwrite(iter->second.c_str(), 1, length, out);
 	}
+	if (fflush(out) != 0 || ferror(out) || fsync(fileno(out)) != 0) {
+		LOGINFO("InfoManager unable to write '%s': %s\n", tmp_file.c_str(), strerror(errno));
+		fclose(out);
+		unlink(tmp_file.c_str());
+		return -1;
+	}
 	fclose(out);
+	if (rename(tmp_file.c_str(), File.c_str()) != 0) {
+		LOGINFO("InfoManager unable to replace '%s': %s\n", File.c_str(), strerror(errno));
+		unlink(tmp_file.c_str());
+		return -1;
+	}
 	tw_set_default_metadata(File.c_str());
 	return 0;
 }
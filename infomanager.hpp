@@ -37,6 +37,7 @@ public:
 	void Clear();
 	int LoadValues();
 	int SaveValues();
+	int WriteValues(); // SaveValues without mounting the file's partition
 
 	// Core get routines
 	int GetValue(const string& varName, string& value);
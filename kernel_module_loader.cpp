@@ -1,28 +1,179 @@
+#include <algorithm>
+#include <android-base/properties.h>
+#include <chrono>
+#include <deque>
+#include <fcntl.h>
+#include <map>
+#include <pthread.h>
+#include <set>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include "kernel_module_loader.hpp"
 #include "common.h"
 
+#define MODULE_LOAD_MAX_THREADS 8
+
 const std::vector<std::string> kernel_modules_requested = TWFunc::split_string(EXPAND(TW_LOAD_VENDOR_MODULES), ' ', true);
 
-bool KernelModuleLoader::Load_Vendor_Modules() {
-	// check /lib/modules (ramdisk vendor_boot)
-	// check /lib/modules/N.N (ramdisk vendor_boot)
-	// check /lib/modules/N.N-gki (ramdisk vendor_boot)
-	// check /vendor/lib/modules (ramdisk)
-	// check /vendor/lib/modules/1.1 (ramdisk prebuilt modules)
-	// check /vendor/lib/modules/N.N (vendor mounted)
-	// check /vendor/lib/modules/N.N-gki (vendor mounted)
-	// check /vendor_dlkm/lib/modules (vendor_dlkm mounted)
-	int modules_loaded = 0;
+// One module of the dependency closure being loaded. Edges point from a
+// module to the modules that need it, and pending counts the deps that
+// still have to be inserted before it can go.
+struct module_node {
+	std::string file;
+	std::string options;
+	std::vector<size_t> dependents;
+	int pending;
+	int result;				// 0, or the errno of the failed insert
+	bool dep_failed;
+	long long msec;
+};
 
-	LOGINFO("Attempting to load modules\n");
+struct module_load_job {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector<module_node> nodes;
+	std::deque<size_t> ready;
+	std::vector<size_t> finished;	// completion order, for the log
+	size_t remaining;
+	size_t busy;
+};
+
+// Kernel module names use '_' whatever the file is called.
+static std::string module_name(const std::string& path) {
+	std::string name = TWFunc::Get_Filename(path);
+	if (android::base::EndsWith(name, ".ko"))
+		name.resize(name.size() - 3);
+	std::replace(name.begin(), name.end(), '-', '_');
+	return name;
+}
+
+// modules.dep lists every (transitive) dependency of a module, and
+// modules.softdep the ones that have to go in first without a symbol
+// dependency. Both are keyed by module name.
+static void module_parse_deps(const std::string& module_dir, std::map<std::string, std::vector<std::string> >& deps,
+		std::map<std::string, std::string>& files) {
+	std::vector<std::string> lines;
+
+	if (TWFunc::read_file(module_dir + "/modules.dep", lines) == 0) {
+		for (auto&& line:lines) {
+			size_t colon = line.find(':');
+			if (colon == std::string::npos)
+				continue;
+			std::string name = module_name(line.substr(0, colon));
+			files[name] = TWFunc::Get_Filename(line.substr(0, colon));
+			for (auto&& dep:android::base::Split(line.substr(colon + 1), " ")) {
+				if (dep.empty())
+					continue;
+				files.insert(std::make_pair(module_name(dep), TWFunc::Get_Filename(dep)));
+				deps[name].push_back(module_name(dep));
+			}
+		}
+	}
+	lines.clear();
+	if (TWFunc::read_file(module_dir + "/modules.softdep", lines) == 0) {
+		for (auto&& line:lines) {
+			std::vector<std::string> args = android::base::Split(android::base::Trim(line), " ");
+			if (args.size() < 3 || args[0] != "softdep")
+				continue;
+			std::string name = module_name(args[1]);
+			bool pre = false;
+			for (size_t i = 2; i < args.size(); i++) {
+				if (args[i] == "pre:" || args[i] == "post:")
+					pre = args[i] == "pre:";
+				else if (pre && !args[i].empty())
+					deps[name].push_back(module_name(args[i]));
+			}
+		}
+	}
+}
+
+// Parameters from modules.options and from name.param=value words on the
+// kernel command line, the same sources libmodprobe uses.
+static void module_parse_options(const std::string& module_dir, std::map<std::string, std::string>& options) {
+	std::vector<std::string> lines;
+	std::string cmdline;
+
+	if (TWFunc::read_file(module_dir + "/modules.options", lines) == 0) {
+		for (auto&& line:lines) {
+			std::vector<std::string> args = android::base::Split(android::base::Trim(line), " ");
+			if (args.size() < 3 || args[0] != "options")
+				continue;
+			std::string& opts = options[module_name(args[1])];
+			for (size_t i = 2; i < args.size(); i++) {
+				if (!opts.empty())
+					opts += " ";
+				opts += args[i];
+			}
+		}
+	}
+	if (TWFunc::read_file("/proc/cmdline", cmdline) == 0) {
+		for (auto&& word:android::base::Split(android::base::Trim(cmdline), " ")) {
+			size_t dot = word.find('.'), equals = word.find('=');
+			if (dot == std::string::npos || equals == std::string::npos || dot > equals)
+				continue;
+			std::string& opts = options[module_name(word.substr(0, dot))];
+			if (!opts.empty())
+				opts += " ";
+			opts += word.substr(dot + 1);
+		}
+	}
+}
+
+static int module_insert(const module_node& node) {
+	int fd = open(node.file.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return errno;
+	int ret = syscall(__NR_finit_module, fd, node.options.c_str(), 0) == 0 ? 0 : errno;
+	close(fd);
+	return ret == EEXIST ? 0 : ret;
+}
+
+static void* module_load_thread(void* cookie) {
+	module_load_job* job = (module_load_job*)cookie;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (job->ready.empty() && job->busy > 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->ready.empty())
+			break; // done, or the rest is stuck behind a dependency loop
+		size_t i = job->ready.front();
+		job->ready.pop_front();
+		job->busy++;
+		module_node& node = job->nodes[i];
+		pthread_mutex_unlock(&job->lock);
+
+		// Independent modules go in at the same time; the kernel only
+		// serializes the final linking step, not the read and relocation.
+		if (!node.dep_failed) {
+			auto start = std::chrono::steady_clock::now();
+			node.result = module_insert(node);
+			node.msec = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		pthread_mutex_lock(&job->lock);
+		job->finished.push_back(i);
+		job->remaining--;
+		job->busy--;
+		for (auto&& dependent:node.dependents) {
+			if (node.result != 0 || node.dep_failed)
+				job->nodes[dependent].dep_failed = true;
+			if (--job->nodes[dependent].pending == 0)
+				job->ready.push_back(dependent);
+		}
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+void KernelModuleLoader::Get_Module_Dirs(std::vector<std::string>& module_dirs, std::vector<std::string>& vendor_module_dirs) {
 	std::string vendor_base_dir(VENDOR_MODULE_DIR);
 	std::string base_dir(VENDOR_BOOT_MODULE_DIR);
-	std::string vendor_dlkm_base_dir(VENDOR_DLKM_MODULE_DIR);
-	std::vector<std::string> module_dirs;
-	std::vector<std::string> vendor_module_dirs;
 
-	TWPartition* ven = PartitionManager.Find_Partition_By_Path("/vendor");
-	TWPartition* ven_dlkm = PartitionManager.Find_Partition_By_Path("/vendor_dlkm");
 	vendor_module_dirs.push_back(VENDOR_MODULE_DIR);
 	vendor_module_dirs.push_back(vendor_base_dir + "/1.1");
 
@@ -35,21 +186,56 @@ bool KernelModuleLoader::Load_Vendor_Modules() {
 
 	std::string rls(uts.release);
 	std::vector<std::string> release = TWFunc::split_string(rls, '.', true);
-	int expected_module_count = kernel_modules_requested.size();
 	module_dirs.push_back(base_dir + "/" + release[0] + "." + release[1]);
 	std::string gki = "/" + release[0] + "." + release[1] + "-gki";
 	module_dirs.push_back(base_dir + gki);
 	vendor_module_dirs.push_back(vendor_base_dir + gki);
+}
+
+bool KernelModuleLoader::Load_Ramdisk_Modules() {
+	// check /lib/modules (ramdisk vendor_boot)
+	// check /lib/modules/N.N (ramdisk vendor_boot)
+	// check /lib/modules/N.N-gki (ramdisk vendor_boot)
+	// check /vendor/lib/modules (ramdisk)
+	// check /vendor/lib/modules/1.1 (ramdisk prebuilt modules)
+	int modules_loaded = 0;
+	int expected_module_count = kernel_modules_requested.size();
+	std::vector<std::string> module_dirs;
+	std::vector<std::string> vendor_module_dirs;
+
+	LOGINFO("Attempting to load modules from ramdisk\n");
+	Get_Module_Dirs(module_dirs, vendor_module_dirs);
 
 	for (auto&& module_dir:module_dirs) {
 		modules_loaded += Try_And_Load_Modules(module_dir, false);
-		if (modules_loaded >= expected_module_count) goto exit;
+		if (modules_loaded >= expected_module_count) return true;
 	}
 
 	for (auto&& module_dir:vendor_module_dirs) {
 		modules_loaded += Try_And_Load_Modules(module_dir, false);
-		if (modules_loaded >= expected_module_count) goto exit;
+		if (modules_loaded >= expected_module_count) return true;
 	}
+	return false;
+}
+
+bool KernelModuleLoader::Load_Vendor_Modules() {
+	// check the ramdisk first, see Load_Ramdisk_Modules
+	// check /vendor/lib/modules/N.N (vendor mounted)
+	// check /vendor/lib/modules/N.N-gki (vendor mounted)
+	// check /vendor_dlkm/lib/modules (vendor_dlkm mounted)
+	int modules_loaded = 0;
+	int expected_module_count = kernel_modules_requested.size();
+
+	LOGINFO("Attempting to load modules\n");
+	std::string vendor_dlkm_base_dir(VENDOR_DLKM_MODULE_DIR);
+	std::vector<std::string> module_dirs;
+	std::vector<std::string> vendor_module_dirs;
+
+	TWPartition* ven = PartitionManager.Find_Partition_By_Path("/vendor");
+	TWPartition* ven_dlkm = PartitionManager.Find_Partition_By_Path("/vendor_dlkm");
+	Get_Module_Dirs(module_dirs, vendor_module_dirs);
+
+	if (Load_Ramdisk_Modules()) goto exit;
 
 	if (ven) {
 		LOGINFO("Checking mounted /vendor\n");
@@ -85,24 +271,31 @@ exit:
 
 int KernelModuleLoader::Try_And_Load_Modules(std::string module_dir, bool vendor_is_mounted) {
 		LOGINFO("Checking directory: %s\n", module_dir.c_str());
-		int modules_loaded = 0;
-		std::string dest_module_dir;
-		dest_module_dir = "/tmp" + module_dir;
-		TWFunc::Recursive_Mkdir(dest_module_dir);
-		Copy_Modules_To_Tmpfs(module_dir);
-		if (!Write_Module_List(dest_module_dir))
+		if (access(module_dir.c_str(), R_OK | X_OK) != 0) {
+			LOGINFO("Unable to open module directory: %s. Skipping\n", module_dir.c_str());
+			return 0;
+		}
+		std::vector<std::string> deduped_modules = Skip_Loaded_Kernel_Modules();
+		if (deduped_modules.size() == 0) {
+			LOGINFO("Requested modules are loaded\n");
 			return kernel_modules_requested.size();
-		if (!vendor_is_mounted && module_dir == "/vendor/lib/modules") {
-			module_dir = "/lib/modules";
 		}
-		LOGINFO("mounting %s on %s\n", dest_module_dir.c_str(), module_dir.c_str());
-		if (mount(dest_module_dir.c_str(), module_dir.c_str(), "", MS_BIND, NULL) == 0) {
-			Modprobe m({module_dir}, "modules.load.twrp", false);
-			m.LoadListedModules(false);
-			modules_loaded = m.GetModuleCount();
-			umount2(module_dir.c_str(), MNT_DETACH);
-			LOGINFO("Modules Loaded: %d\n", modules_loaded);
+		// finit_module only needs an fd, so modules are loaded in place. The
+		// tmpfs copy is kept for files the policy won't let us load from
+		// where they are (e.g. vendor_file on a mounted /vendor).
+		bool denied = false;
+		int modules_loaded = Load_Module_Graph(module_dir, deduped_modules, &denied);
+		if (denied) {
+			std::string dest_module_dir = "/tmp" + module_dir;
+			LOGINFO("Loading from %s was denied, retrying from %s (vendor mounted: %d)\n",
+				module_dir.c_str(), dest_module_dir.c_str(), vendor_is_mounted);
+			TWFunc::Recursive_Mkdir(dest_module_dir);
+			if (Copy_Modules_To_Tmpfs(module_dir)) {
+				deduped_modules = Skip_Loaded_Kernel_Modules();
+				modules_loaded += Load_Module_Graph(dest_module_dir, deduped_modules, NULL);
+			}
 		}
+		LOGINFO("Modules Loaded: %d\n", modules_loaded);
 		return modules_loaded;
 }
 
@@ -127,38 +320,6 @@ std::vector<string> KernelModuleLoader::Skip_Loaded_Kernel_Modules() {
 	return kernel_modules;
 }
 
-bool KernelModuleLoader::Write_Module_List(std::string module_dir) {
-	DIR* d;
-	struct dirent* de;
-	std::vector<std::string> kernel_modules;
-	d = opendir(module_dir.c_str());
-	auto deduped_modules = Skip_Loaded_Kernel_Modules();
-	if (deduped_modules.size() == 0) {
-		LOGINFO("Requested modules are loaded\n");
-		return false;
-	}
-	if (d != nullptr) {
-		while ((de = readdir(d)) != nullptr) {
-			std::string kernel_module = de->d_name;
-			if (de->d_type == DT_REG) {
-				if (android::base::EndsWith(kernel_module, ".ko")) {
-					for (auto&& requested:kernel_modules_requested) {
-						if (kernel_module == requested) {
-							kernel_modules.push_back(kernel_module);
-							continue;
-						}
-					}
-					continue;
-				}
-			}
-		}
-		std::string module_file = module_dir + "/modules.load.twrp";
-		TWFunc::write_to_file(module_file, kernel_modules);
-		closedir(d);
-	}
-	return true;
-}
-
 bool KernelModuleLoader::Copy_Modules_To_Tmpfs(std::string module_dir) {
 	std::string ramdisk_dir = "/tmp" + module_dir;
 	DIR* d;
@@ -171,6 +332,7 @@ bool KernelModuleLoader::Copy_Modules_To_Tmpfs(std::string module_dir) {
 				std::string src =  module_dir + "/" + de->d_name;
 				std::string dest = ramdisk_dir + "/" + de->d_name;
 				if (TWFunc::copy_file(src, dest, 0700, false) != 0) {
+					closedir(d);
 					return false;
 				}
 			}
@@ -182,3 +344,113 @@ bool KernelModuleLoader::Copy_Modules_To_Tmpfs(std::string module_dir) {
 	}
 	return true;
 }
+
+int KernelModuleLoader::Load_Module_Graph(const std::string& module_dir, const std::vector<std::string>& modules, bool* denied) {
+	std::map<std::string, std::vector<std::string> > deps;
+	std::map<std::string, std::string> files, options;
+	std::map<std::string, size_t> index;
+	std::set<std::string> loaded;
+	std::vector<std::string> lines, names;
+	module_load_job job;
+	int modules_loaded = 0;
+
+	module_parse_deps(module_dir, deps, files);
+	module_parse_options(module_dir, options);
+	if (TWFunc::read_file("/proc/modules", lines) == 0) {
+		for (auto&& line:lines)
+			loaded.insert(TWFunc::Split_String(line, " ")[0]);
+	}
+
+	// Only requested modules that ship in this directory are tried, along
+	// with whatever they depend on that isn't in the kernel yet.
+	for (auto&& module:modules) {
+		if (TWFunc::Path_Exists(module_dir + "/" + module))
+			names.push_back(module_name(module));
+	}
+	for (size_t i = 0; i < names.size(); i++) {
+		if (index.count(names[i]))
+			continue;
+		std::map<std::string, std::string>::iterator file = files.find(names[i]);
+		module_node node;
+		node.file = module_dir + "/" + (file != files.end() ? file->second : names[i] + ".ko");
+		node.options = options[names[i]];
+		node.pending = 0;
+		node.result = 0;
+		node.dep_failed = false;
+		node.msec = 0;
+		index[names[i]] = job.nodes.size();
+		job.nodes.push_back(node);
+		for (auto&& dep:deps[names[i]]) {
+			if (!loaded.count(dep))
+				names.push_back(dep);
+		}
+	}
+	if (job.nodes.empty())
+		return 0;
+	for (auto&& entry:index) {
+		std::set<size_t> seen;
+		for (auto&& dep:deps[entry.first]) {
+			std::map<std::string, size_t>::iterator found = index.find(dep);
+			if (found == index.end() || found->second == entry.second || !seen.insert(found->second).second)
+				continue;
+			job.nodes[found->second].dependents.push_back(entry.second);
+			job.nodes[entry.second].pending++;
+		}
+	}
+	for (size_t i = 0; i < job.nodes.size(); i++) {
+		if (job.nodes[i].pending == 0)
+			job.ready.push_back(i);
+	}
+	if (job.ready.empty()) {
+		LOGERR("Dependency loop in %s/modules.dep\n", module_dir.c_str());
+		return 0;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = cpus > 0 ? cpus : 1;
+	if (threads > MODULE_LOAD_MAX_THREADS)
+		threads = MODULE_LOAD_MAX_THREADS;
+	if (threads > job.nodes.size())
+		threads = job.nodes.size();
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	job.remaining = job.nodes.size();
+	job.busy = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<pthread_t> workers;
+	for (size_t i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, module_load_thread, &job) != 0)
+			break;
+		workers.push_back(thread);
+	}
+	module_load_thread(&job);
+	for (auto&& thread:workers)
+		pthread_join(thread, NULL);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+	long long total = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	// Workers don't log, so the timings are reported here in the order the
+	// modules finished.
+	if (job.remaining > 0)
+		LOGERR("Dependency loop in %s/modules.dep\n", module_dir.c_str());
+	for (auto&& i:job.finished) {
+		const module_node& node = job.nodes[i];
+		std::string name = TWFunc::Get_Filename(node.file);
+		if (node.dep_failed) {
+			LOGINFO("Skipped %s, a dependency failed to load\n", name.c_str());
+		} else if (node.result != 0) {
+			LOGINFO("Failed to load %s: %s\n", name.c_str(), strerror(node.result));
+			if (denied && (node.result == EACCES || node.result == EPERM))
+				*denied = true;
+		} else {
+			LOGINFO("Loaded %s in %lld ms\n", name.c_str(), node.msec);
+			modules_loaded++;
+		}
+	}
+	LOGINFO("Loaded %d of %zu modules from %s on %zu threads in %lld ms\n", modules_loaded, job.nodes.size(),
+		module_dir.c_str(), workers.size() + 1, total);
+	return modules_loaded;
+}
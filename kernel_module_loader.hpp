@@ -5,7 +5,6 @@
 #include <string>
 #include <vector>
 #include <android-base/strings.h>
-#include <modprobe/modprobe.h>
 #include <sys/mount.h>
 #include <sys/utsname.h>
 
@@ -25,11 +24,13 @@ class KernelModuleLoader
 {
 public:
     static bool Load_Vendor_Modules(); // Load specific maintainer defined kernel modules in TWRP
+	static bool Load_Ramdisk_Modules(); // Only the ramdisk passes, safe before the fstab is processed; true if all requested modules are in
 
 private:
-	static int Try_And_Load_Modules(std::string module_dir, bool vendor_is_mounted); // Use libmodprobe to attempt loading kernel modules
-	static bool Write_Module_List(std::string module_dir); // Write list of modules to load from TW_LOAD_VENDOR_MODULES
-    static bool Copy_Modules_To_Tmpfs(std::string module_dir); // Copy modules to ramdisk for loading
+	static void Get_Module_Dirs(std::vector<std::string>& module_dirs, std::vector<std::string>& vendor_module_dirs); // Ramdisk and vendor module directories for the running kernel
+	static int Try_And_Load_Modules(std::string module_dir, bool vendor_is_mounted); // Attempt loading requested kernel modules from module_dir
+	static int Load_Module_Graph(const std::string& module_dir, const std::vector<std::string>& modules, bool* denied); // Insert modules and their modules.dep deps in parallel
+    static bool Copy_Modules_To_Tmpfs(std::string module_dir); // Copy modules to ramdisk when they can't be loaded in place
 	static std::vector<string> Skip_Loaded_Kernel_Modules(); // return list of loaded kernel modules already done by init
 };
 
@@ -353,9 +353,10 @@ tar_append_eof(TAR *t)
 int
 tar_append_regfile(TAR *t, const char *realname)
 {
-	char block[T_BLOCKSIZE];
+	char *buf;
 	int filefd;
 	int64_t i, size;
+	size_t len, chunk, done;
 	ssize_t j;
 	int rv = -1;
 
@@ -372,33 +373,45 @@ tar_append_regfile(TAR *t, const char *realname)
 		return -1;
 	}
 
-	size = th_get_size(t);
-	for (i = size; i > T_BLOCKSIZE; i -= T_BLOCKSIZE)
+	buf = (char *)malloc(T_DATA_CHUNKSIZE);
+	if (buf == NULL)
 	{
-		j = read(filefd, &block, T_BLOCKSIZE);
-		if (j != T_BLOCKSIZE)
-		{
-			if (j != -1)
-				errno = EINVAL;
-			goto fail;
-		}
-		if (tar_block_write(t, &block) == -1)
-			goto fail;
+		close(filefd);
+		return -1;
 	}
 
-	if (i > 0)
+	/* copy the file one chunk (a whole number of tar blocks) at a time,
+	   zero-padding the final block */
+	size = th_get_size(t);
+	for (i = size; i > 0; i -= len)
 	{
-		j = read(filefd, &block, i);
-		if (j == -1)
-			goto fail;
-		memset(&(block[i]), 0, T_BLOCKSIZE - i);
-		if (tar_block_write(t, &block) == -1)
+		len = (i > T_DATA_CHUNKSIZE) ? T_DATA_CHUNKSIZE : (size_t)i;
+		for (done = 0; done < len; done += j)
+		{
+			j = read(filefd, buf + done, len - done);
+			if (j == -1 && errno == EINTR)
+			{
+				j = 0;
+				continue;
+			}
+			if (j <= 0)
+			{
+				/* file shrank underneath us */
+				if (j == 0)
+					errno = EINVAL;
+				goto fail;
+			}
+		}
+		chunk = (len + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE;
+		memset(buf + len, 0, chunk - len);
+		if (tar_data_write(t, buf, chunk) == -1)
 			goto fail;
 	}
 
 	/* success! */
 	rv = 0;
 fail:
+	free(buf);
 	close(filefd);
 
 	return rv;
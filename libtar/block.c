@@ -725,3 +725,58 @@ th_write(TAR *t)
 }
 
 
+/* read len bytes of file data from the tarchive.
+   readfunc may be a pipe (pigz, openaes, adb), so short reads are retried
+   until the whole chunk has arrived.  returns len on success, the number
+   of bytes read if EOF was hit early, or -1 on error. */
+ssize_t
+tar_data_read(TAR *t, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t i;
+
+	while (done < len)
+	{
+		i = (*(t->type->readfunc))(t->fd, (char *)buf + done, len - done);
+		if (i == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (i == 0)
+			break;
+		done += i;
+	}
+
+	return done;
+}
+
+
+/* write len bytes of file data to the tarchive, retrying short writes.
+   returns len on success or -1 on error. */
+ssize_t
+tar_data_write(TAR *t, const void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t i;
+
+	while (done < len)
+	{
+		i = tar_raw_write(t, (char *)buf + done, len - done);
+		if (i == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (i == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		done += i;
+	}
+
+	return done;
+}
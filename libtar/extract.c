@@ -45,7 +45,33 @@
 
 #include "android_utils.h"
 
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
+/* write len bytes to fd, retrying short writes */
+static ssize_t
+write_all(int fd, const char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t i;
+
+	while (done < len)
+	{
+		i = write(fd, buf + done, len - done);
+		if (i == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (i == 0)
+		{
+			/* no progress and no error, don't spin on it */
+			errno = EIO;
+			return -1;
+		}
+		done += i;
+	}
+
+	return done;
+}
 
 static int
 tar_set_file_perms(TAR *t, const char *realname)
@@ -210,9 +236,10 @@ int
 tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 {
 	int64_t size, i;
+	size_t len, chunk;
 	ssize_t k;
 	int fdout;
-	char buf[T_BLOCKSIZE];
+	char *buf;
 	const char *filename;
 	char *pn;
 
@@ -249,31 +276,44 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 		return -1;
 	}
 
-	/* extract the file */
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	buf = (char *)malloc(T_DATA_CHUNKSIZE);
+	if (buf == NULL)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		close(fdout);
+		return -1;
+	}
+
+	/* extract the file, one chunk (a whole number of tar blocks) at a time */
+	for (i = size; i > 0; i -= len)
+	{
+		len = (i > T_DATA_CHUNKSIZE) ? T_DATA_CHUNKSIZE : (size_t)i;
+		chunk = (len + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE;
+		k = tar_data_read(t, buf, chunk);
+		if (k != (ssize_t)chunk)
 		{
 			if (k != -1)
 				errno = EINVAL;
+			free(buf);
 			close(fdout);
 			return -1;
 		}
 
-		/* write block to output file */
-		if (write(fdout, buf,
-			  ((i > T_BLOCKSIZE) ? T_BLOCKSIZE : i)) == -1)
+		/* write chunk to output file */
+		if (write_all(fdout, buf, len) == -1)
 		{
+			free(buf);
 			close(fdout);
 			return -1;
 		}
 		else
 		{
-			if (*progress_fd != 0)
-				write(*progress_fd, &progress_size, sizeof(progress_size));
+			/* coalesce progress so the parent is not woken per chunk */
+			t->progress_pending += chunk;
+			if (t->progress_pending >= T_PROGRESS_INTERVAL)
+				tar_flush_progress(t, progress_fd);
 		}
 	}
+	free(buf);
 
 	/* close output file */
 	if (close(fdout) == -1)
@@ -287,13 +327,26 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 }
 
 
+/* report held-back extraction progress */
+void
+tar_flush_progress(TAR *t, const int *progress_fd)
+{
+	if (progress_fd != NULL && *progress_fd != 0
+	    && t->progress_pending > 0)
+		write(*progress_fd, &t->progress_pending,
+		      sizeof(t->progress_pending));
+	t->progress_pending = 0;
+}
+
+
 /* skip regfile */
 int
 tar_skip_regfile(TAR *t)
 {
 	int64_t size, i;
+	size_t chunk;
 	ssize_t k;
-	char buf[T_BLOCKSIZE];
+	char *buf;
 
 	if (!TH_ISREG(t))
 	{
@@ -302,16 +355,28 @@ tar_skip_regfile(TAR *t)
 	}
 
 	size = th_get_size(t);
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	if (size <= 0)
+		return 0;
+
+	buf = (char *)malloc(T_DATA_CHUNKSIZE);
+	if (buf == NULL)
+		return -1;
+
+	/* round up to whole tar blocks */
+	size = (size + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE;
+	for (i = size; i > 0; i -= chunk)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		chunk = (i > T_DATA_CHUNKSIZE) ? T_DATA_CHUNKSIZE : (size_t)i;
+		k = tar_data_read(t, buf, chunk);
+		if (k != (ssize_t)chunk)
 		{
 			if (k != -1)
 				errno = EINVAL;
+			free(buf);
 			return -1;
 		}
 	}
+	free(buf);
 
 	return 0;
 }
@@ -33,6 +33,10 @@ extern "C"
 /* useful constants */
 /* see FIXME note in block.c regarding T_BLOCKSIZE */
 #define T_BLOCKSIZE		512
+/* regular file data is moved in chunks of this size (a multiple of T_BLOCKSIZE) */
+#define T_DATA_CHUNKSIZE	(1024 * 1024)
+/* progress is sent to the parent once at least this many bytes have moved */
+#define T_PROGRESS_INTERVAL	(1024 * 1024)
 #define T_NAMELEN		100
 #define T_PREFIXLEN		155
 #define T_MAXPATHLEN		(T_NAMELEN + T_PREFIXLEN)
@@ -87,6 +91,7 @@ typedef int (*openfunc_t)(const char *, int, ...);
 typedef int (*closefunc_t)(int);
 typedef ssize_t (*readfunc_t)(int, void *, size_t);
 typedef ssize_t (*writefunc_t)(int, const void *, size_t);
+typedef ssize_t (*ctxwritefunc_t)(void *, int, const void *, size_t);
 
 typedef struct
 {
@@ -109,6 +114,14 @@ typedef struct
 
 	/* introduced in libtar 1.2.21 */
 	char *th_pathname;
+
+	/* extracted bytes not yet reported to progress_fd */
+	unsigned long long progress_pending;
+
+	/* per-archive write hook, used instead of type->writefunc when set;
+	   write_ctx is handed back to it on every call */
+	ctxwritefunc_t ctxwritefunc;
+	void *write_ctx;
 }
 TAR;
 
@@ -192,13 +205,21 @@ int tar_append_buffer(TAR *t, void *buf, size_t len);
 /* macros for reading/writing tarchive blocks */
 #define tar_block_read(t, buf) \
 	(*((t)->type->readfunc))((t)->fd, (char *)(buf), T_BLOCKSIZE)
+#define tar_raw_write(t, buf, len) \
+	((t)->ctxwritefunc != NULL \
+	 ? (*((t)->ctxwritefunc))((t)->write_ctx, (t)->fd, (buf), (len)) \
+	 : (*((t)->type->writefunc))((t)->fd, (buf), (len)))
 #define tar_block_write(t, buf) \
-	(*((t)->type->writefunc))((t)->fd, (char *)(buf), T_BLOCKSIZE)
+	tar_raw_write((t), (char *)(buf), T_BLOCKSIZE)
 
 /* read/write a header block */
 int th_read(TAR *t);
 int th_write(TAR *t);
 
+/* read/write len bytes of file data, retrying short transfers */
+ssize_t tar_data_read(TAR *t, void *buf, size_t len);
+ssize_t tar_data_write(TAR *t, const void *buf, size_t len);
+
 
 /***** decode.c ************************************************************/
 
@@ -279,6 +300,8 @@ int tar_extract_fifo(TAR *t, const char *realname);
 
 /* for regfiles, we need to extract the content blocks as well */
 int tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd);
+/* send any progress still held back by tar_extract_regfile() */
+void tar_flush_progress(TAR *t, const int *progress_fd);
 int tar_skip_regfile(TAR *t);
 
 /* extract regfile to buffer */
@@ -82,8 +82,12 @@ tar_extract_all(TAR *t, char *prefix, const int *progress_fd)
 		       "\"%s\")\n", buf);
 #endif
 		if (tar_extract_file(t, buf, prefix, progress_fd) != 0)
+		{
+			tar_flush_progress(t, progress_fd);
 			return -1;
+		}
 	}
+	tar_flush_progress(t, progress_fd);
 
 	return (i == 1 ? 0 : -1);
 }
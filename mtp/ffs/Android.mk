@@ -39,7 +39,8 @@ LOCAL_SRC_FILES = \
     btree.cpp \
     twrpMtp.cpp \
     mtp_MtpDatabase.cpp \
-    node.cpp
+    node.cpp \
+    ../../direnum.cpp
 
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -gt 25; echo $$?),0)
     LOCAL_CFLAGS += -D_FFS_DEVICE
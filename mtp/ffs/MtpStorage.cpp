@@ -19,6 +19,7 @@
 #include "MtpDebug.h"
 #include "MtpStorage.h"
 #include "btree.hpp"
+#include "../../direnum.hpp"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -80,6 +81,8 @@ MtpStorage::~MtpStorage() {
 		// deleting all of the trees and nodes.
 		delete mtpmap[0];
 		mtpmap.clear();
+		nodeIndex.clear();
+		pathCache.clear();
 		if (use_mutex) {
 				use_mutex = false;
 				MTPD("~MtpStorage destroying mutexes\n");
@@ -128,20 +131,21 @@ int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 				MTPE("parent == MTP_PARENT_ROOT, cannot rename root\n");
 				return -1;
 		} else {
-				for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-						Node* node = i->second->findNode(handle);
-						if (node != NULL) {
-				std::string oldName = getNodePath(node);
-								std::string parentdir = oldName.substr(0, oldName.find_last_of('/'));
-								std::string newFullName = parentdir + "/" + newName;
-								MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
-								if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
-										node->rename(newName);
-										return 0;
-								} else {
-										MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
-										return -1;
-								}
+				Node* node = findNode(handle);
+				if (node != NULL) {
+						std::string oldName = getNodePath(node);
+						std::string parentdir = oldName.substr(0, oldName.find_last_of('/'));
+						std::string newFullName = parentdir + "/" + newName;
+						MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
+						if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
+								node->rename(newName);
+								// every path below a renamed dir changes with it
+								if (node->isDir())
+										pathCache.clear();
+								return 0;
+						} else {
+								MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
+								return -1;
 						}
 				}
 		}
@@ -211,34 +215,37 @@ int MtpStorage::createDB() {
 }
 
 Node* MtpStorage::findNode(MtpObjectHandle handle) {
-		for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-				Node* node = i->second->findNode(handle);
-				if (node != NULL) {
-						MTPD("findNode: found node %p for handle %u, name: %s\n", node, handle, node->getName().c_str());
-						if (node->Mtpid() != handle)
-						{
-								MTPE("BUG: entry for handle %u points to node with handle %u\n", handle, node->Mtpid());
-						}
-						return node;
-				}
+		nodeindex::iterator it = nodeIndex.find(handle);
+		if (it != nodeIndex.end()) {
+				MTPD("findNode: found node %p for handle %u, name: %s\n", it->second, handle, it->second->getName().c_str());
+				return it->second;
 		}
 		// Item is not on this storage device
-		MTPD("MtpStorage::findNode: no node found for handle %u on storage %u, searched %u trees\n", handle, mStorageID, mtpmap.size());
+		MTPD("MtpStorage::findNode: no node found for handle %u on storage %u\n", handle, mStorageID);
 		return NULL;
 }
 
 std::string MtpStorage::getNodePath(Node* node) {
-	std::string path;
-		MTPD("getNodePath: node %p, handle %u\n", node, node->Mtpid());
-		while (node)
-		{
-				path = "/" + node->getName() + path;
-				MtpObjectHandle parent = node->getMtpParentId();
-				if (parent == 0)		// root
-						break;
-				node = findNode(parent);
+		MtpObjectHandle handle = node->Mtpid();
+		MTPD("getNodePath: node %p, handle %u\n", node, handle);
+		if (handle == 0)		// root
+				return mtpstorageparent + "/";
+		// Only dirs are cached; a file's path is one append onto its
+		// parent's, which keeps the cache small for 20k-photo folders.
+		if (node->isDir()) {
+				pathcache::iterator it = pathCache.find(handle);
+				if (it != pathCache.end())
+						return it->second;
 		}
-		path = mtpstorageparent + path;
+		std::string path;
+		MtpObjectHandle parent = node->getMtpParentId();
+		Node* parentNode = parent ? findNode(parent) : NULL;
+		if (parentNode)
+				path = getNodePath(parentNode) + "/" + node->getName();
+		else
+				path = mtpstorageparent + "/" + node->getName();
+		if (node->isDir())
+				pathCache[handle] = path;
 		MTPD("getNodePath: path %s\n", path.c_str());
 		return path;
 }
@@ -285,43 +292,67 @@ Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name)
 		else
 				node = new Node(mtpid, parent, name);
 		tree->addEntry(node);
+		nodeIndex[mtpid] = node;
 		return node;
 }
 
+void MtpStorage::forgetNode(Node* node)
+{
+		// Drop a node and everything below it from the lookup tables. The
+		// nodes themselves are freed by the owning tree's deleteNode.
+		MtpObjectHandle handle = node->Mtpid();
+		if (node->isDir()) {
+				Tree* tree = static_cast<Tree*>(node);
+				MtpObjectHandleList children;
+				tree->getmtpids(&children);
+				for (MtpObjectHandleList::iterator it = children.begin(); it != children.end(); ++it) {
+						Node* child = tree->findNode(*it);
+						if (child)
+								forgetNode(child);
+				}
+				for (std::map<int, Tree*>::iterator it = inotifymap.begin(); it != inotifymap.end();) {
+						if (it->second == tree) {
+								MTPD("removing inotify watch %i for handle %u\n", it->first, handle);
+								inotify_rm_watch(inotify_fd, it->first);
+								inotifymap.erase(it++);
+						} else {
+								++it;
+						}
+				}
+				mtpmap.erase(handle);
+				pathCache.erase(handle);
+		}
+		nodeIndex.erase(handle);
+}
+
 int MtpStorage::readDir(const std::string& path, Tree* tree)
 {
-		struct dirent *de;
-		int storageID = getStorageID();
+		std::vector<TWDirEntry> entries;
 		MtpObjectHandle parent = tree->Mtpid();
 
-		DIR *d = opendir(path.c_str());
 		MTPD("reading dir '%s', parent handle %u\n", path.c_str(), parent);
-		if (d == NULL) {
+		// Because exfat-fuse causes issues with dirent, we will use stat
+		// for some things that dirent should be able to do. The entries
+		// come back already lstat'ed, in parallel for big folders.
+		if (TWDirEnum::Read_Dir(path, entries, TWDirEnum::Stat_Lstat) != 0) {
 				MTPE("error opening '%s' -- error: %s\n", path.c_str(), strerror(errno));
 				return -1;
 		}
 		// TODO: for refreshing dirs: capture old entries here
-		while ((de = readdir(d)) != NULL) {
-				// Because exfat-fuse causes issues with dirent, we will use stat
-				// for some things that dirent should be able to do
-				std::string item = path + "/" + de->d_name;
-				struct stat st;
-				if (lstat(item.c_str(), &st)) {
-						MTPE("Error running lstat on '%s'\n", item.c_str());
+		for (size_t i = 0; i < entries.size(); i++) {
+				const TWDirEntry& entry = entries[i];
+				if (entry.err) {
+						MTPE("Error running lstat on '%s'\n", (path + "/" + entry.name).c_str());
 						return -1;
 				}
 				// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
-				if (strcmp(de->d_name, ".") == 0)
-						continue;
-				if (strcmp(de->d_name, "..") == 0)
-						continue;
-				Node* node = addNewNode(st.st_mode & S_IFDIR, tree, de->d_name);
-				node->addProperties(item, storageID);
+				Node* node = addNewNode(entry.st.st_mode & S_IFDIR, tree, entry.name);
+				// reuse the lstat above; the property list is built on demand
+				node->setProperties(entry.st);
 				//if (sendEvents)
 				//		mServer->sendObjectAdded(node->Mtpid());
 				//		sending events here makes simple-mtpfs very slow, and it is probably the wrong thing to do anyway
 		}
-		closedir(d);
 		// TODO: for refreshing dirs: remove entries that no longer exist (with their nodes)
 		tree->setAlreadyRead(true);
 		addInotify(tree);
@@ -435,7 +466,7 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 				if (node == NULL) {
 						node = addNewNode(event->mask & IN_ISDIR, tree, event->name);
 						std::string item = getNodePath(tree) + "/" + event->name;
-						node->addProperties(item, getStorageID());
+						node->addProperties(item);
 						mServer->sendObjectAdded(node->Mtpid());
 				} else {
 						MTPD("inotify_t item already exists.\n");
@@ -451,17 +482,7 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 				}
 				if (node)
 				{
-						if (event->mask & IN_ISDIR) {
-								for (std::map<int, Tree*>::iterator it = inotifymap.begin(); it != inotifymap.end(); ++it) {
-										if (it->second == node) {
-												inotify_rm_watch(inotify_fd, it->first);
-												MTPD("inotify_t removing watch on '%s'\n", getNodePath(it->second).c_str());
-												inotifymap.erase(it->first);
-												break;
-										}
-
-								}
-						}
+						// deleteFile also removes the inotify watches of deleted dirs
 						MtpObjectHandle handle = node->Mtpid();
 						deleteFile(handle);
 						mServer->sendObjectRemoved(handle);
@@ -471,14 +492,15 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 		} else if (event->mask & IN_MODIFY) {
 				MTPD("inotify_t item %s modified.\n", event->name);
 				if (node != NULL) {
-						uint64_t orig_size = node->getProperty(MTP_PROPERTY_OBJECT_SIZE).valueInt;
+						uint64_t orig_size = node->getSize();
 						struct stat st;
 						uint64_t new_size = 0;
-						if (lstat(getNodePath(node).c_str(), &st) == 0)
+						if (lstat(getNodePath(node).c_str(), &st) == 0) {
 								new_size = (uint64_t)st.st_size;
+								node->setProperties(st);
+						}
 						if (orig_size != new_size) {
 								MTPD("size changed from %llu to %llu on mtpid: %u\n", orig_size, new_size, node->Mtpid());
-								node->updateProperty(MTP_PROPERTY_OBJECT_SIZE, new_size, "", MTP_TYPE_UINT64);
 								mServer->sendObjectUpdated(node->Mtpid());
 						}
 				} else {
@@ -519,22 +541,19 @@ void MtpStorage::unlockMutex( __attribute__((unused)) int thread_type) {
 }
 
 int MtpStorage::getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, MtpStorage::PropEntry& pe) {
-		Node *node;
-		for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-				node = i->second->findNode(handle);
-				if (node != NULL) {
-						const Node::mtpProperty& prop = node->getProperty(property);
-						if (prop.property != property) {
-								MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
-								return -1;
-						}
-						pe.datatype = prop.dataType;
-						pe.intvalue = prop.valueInt;
-						pe.strvalue = prop.valueStr;
-						pe.handle = handle;
-						pe.property = property;
-						return 0;
+		Node* node = findNode(handle);
+		if (node != NULL) {
+				Node::mtpProperty prop = node->getProperty(property, mStorageID);
+				if (prop.property != property) {
+						MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
+						return -1;
 				}
+				pe.datatype = prop.dataType;
+				pe.intvalue = prop.valueInt;
+				pe.strvalue = prop.valueStr;
+				pe.handle = handle;
+				pe.property = property;
+				return 0;
 		}
 		// handle not found on this storage
 		return -1;
@@ -546,7 +565,7 @@ void MtpStorage::endSendObject(const char* path, MtpObjectHandle handle, __attri
 		if (!node)
 				return; // just ignore if this is for another storage
 
-		node->addProperties(path, mStorageID);
+		node->addProperties(path);
 		handleCurrentlySending = 0;
 		// TODO: are we supposed to send an event about an upload by the initiator?
 		if (sendEvents)
@@ -661,7 +680,6 @@ int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, u
 }
 
 int MtpStorage::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
-		struct stat st;
 		uint64_t size = 0;
 		MTPD("MtpStorage::getObjectInfo, handle: %u\n", handle);
 		Node* node = findNode(handle);
@@ -674,18 +692,15 @@ int MtpStorage::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
 		MTPD("info.mStorageID: %u\n", info.mStorageID);
 		info.mParent = node->getMtpParentId();
 		MTPD("mParent: %u\n", info.mParent);
-		// TODO: do we want to lstat again here, or read from the node properties?
-		if (lstat(getNodePath(node).c_str(), &st) == 0)
-				size = st.st_size;
+		// readDir, inotify and endSendObject keep the node's stat record
+		// current, so only nodes that were never stat'ed need an lstat here
+		if (!node->hasProperties())
+				node->addProperties(getNodePath(node));
+		size = node->getSize();
 		MTPD("size is: %llu\n", size);
 		info.mCompressedSize = (size > 0xFFFFFFFFLL ? 0xFFFFFFFF : size);
-		info.mDateModified = st.st_mtime;
-		if (S_ISDIR(st.st_mode)) {
-				info.mFormat = MTP_FORMAT_ASSOCIATION;
-		}
-		else {
-				info.mFormat = MTP_FORMAT_UNDEFINED;
-		}
+		info.mDateModified = node->getMtime();
+		info.mFormat = node->getFormat();
 		info.mName = strdup(node->getName().c_str());
 		MTPD("MtpStorage::getObjectInfo found, Exiting getObjectInfo()\n");
 		return 0;
@@ -724,10 +739,9 @@ int MtpStorage::deleteFile(MtpObjectHandle handle) {
 				MTPE("parent tree for handle %u not found\n", parent);
 				return -1;
 		}
-		if (node->isDir()) {
-				MTPD("deleting tree from mtpmap: %u\n", handle);
-				mtpmap.erase(handle);
-		}
+		if (node->isDir())
+				MTPD("deleting tree and its children from mtpmap: %u\n", handle);
+		forgetNode(node);
 
 		MTPD("deleting handle: %u\n", handle);
 		tree->deleteNode(handle);
@@ -746,7 +760,8 @@ void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results
 		{
 				// add all properties
 				MTPD("MtpStorage::queryNodeProperties for all properties\n");
-				std::vector<Node::mtpProperty> mtpprop = node->getMtpProps();
+				std::vector<Node::mtpProperty> mtpprop;
+				node->getMtpProps(mtpprop, storageID);
 				for (size_t i = 0; i < mtpprop.size(); ++i) {
 						pe.property = mtpprop[i].property;
 						pe.datatype = mtpprop[i].dataType;
@@ -791,7 +806,7 @@ void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results
 
 				default:
 				{
-						const Node::mtpProperty& prop = node->getProperty(property);
+						Node::mtpProperty prop = node->getProperty(property, storageID);
 						if (prop.property != property)
 						{
 								MTPD("queryNodeProperties: unknown property %x\n", property);
@@ -17,6 +17,8 @@
 #ifndef _MTP_STORAGE_H
 #define _MTP_STORAGE_H
 
+#include <unordered_map>
+
 #include "MtpObjectInfo.h"
 #include "MtpServer.h"
 #include "MtpStringBuffer.h"
@@ -48,6 +50,10 @@ private:
 	typedef					std::map<int, Tree*> maptree;
 	typedef					maptree::iterator iter;
 	maptree					mtpmap;
+	typedef					std::unordered_map<MtpObjectHandle, Node*> nodeindex;
+	nodeindex				nodeIndex;		   // handle -> node, every node except the root
+	typedef					std::unordered_map<MtpObjectHandle, std::string> pathcache;
+	pathcache				pathCache;		   // tree handle -> full path, dropped on rename
 	std::string				mtpstorageparent;
 	MtpObjectHandle			handleCurrentlySending;
 	int						inotify_fd;
@@ -64,6 +70,7 @@ private:
 	Node*					findNode(MtpObjectHandle handle);
 	std::string				getNodePath(Node* node);
 	Node*					addNewNode(bool isDir, Tree* tree, const std::string& name);
+	void					forgetNode(Node* node);
 	void					queryNodeProperties(std::vector<PropEntry>& results, Node* node, uint32_t property, int groupCode, MtpStorageID storageID);
 	int						addInotify(Tree* tree);
 	void					handleInotifyEvent(struct inotify_event* event);
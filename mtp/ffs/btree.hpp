@@ -20,6 +20,7 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <sys/stat.h>
 #include "MtpTypes.h"
 
 // A directory entry
@@ -27,6 +28,12 @@ class Node {
 	MtpObjectHandle handle;
 	MtpObjectHandle parent;
 	std::string name;	// name only without path
+	// Compact property record filled from a single lstat. The MTP property
+	// list is built from it on demand instead of being stored per node.
+	uint64_t size;
+	time_t mtime;
+	uint16_t format;
+	bool statRead;
 
 public:
 	Node();
@@ -40,10 +47,12 @@ public:
 	MtpObjectHandle getMtpParentId() const;
 	const std::string& getName() const;
 
-	void addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void addProperties(const std::string& path, int storageID);
-	uint64_t getIntProperty(MtpPropertyCode property);
+	void setProperties(const struct stat& st);
+	void addProperties(const std::string& path);
+	bool hasProperties() const { return statRead; }
+	uint64_t getSize() const { return size; }
+	time_t getMtime() const { return mtime; }
+	uint16_t getFormat() const { return format; }
 	struct mtpProperty {
 		MtpPropertyCode property;
 		MtpDataType dataType;
@@ -51,9 +60,11 @@ public:
 		std::string valueStr;
 		mtpProperty() : property(0), dataType(0), valueInt(0) {}
 	};
-	std::vector<mtpProperty>& getMtpProps();
-	std::vector<mtpProperty> mtpProp;
-	const mtpProperty& getProperty(MtpPropertyCode property);
+	void getMtpProps(std::vector<mtpProperty>& props, int storageID) const;
+	mtpProperty getProperty(MtpPropertyCode property, int storageID) const;
+
+private:
+	void fillProperty(mtpProperty& prop, int storageID) const;
 };
 
 // A directory
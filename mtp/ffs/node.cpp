@@ -31,13 +31,41 @@
 #include "MtpDebug.h"
 
 
+// Properties every node reports, in the order they are sent for "all
+// properties". Values come from the node's stat record or are constants.
+static const struct {
+	MtpPropertyCode property;
+	MtpDataType dataType;
+} nodeProperties[] = {
+	{ MTP_PROPERTY_STORAGE_ID, MTP_TYPE_UINT32 },
+	{ MTP_PROPERTY_OBJECT_FORMAT, MTP_TYPE_UINT16 },
+	{ MTP_PROPERTY_PROTECTION_STATUS, MTP_TYPE_UINT16 },
+	{ MTP_PROPERTY_OBJECT_SIZE, MTP_TYPE_UINT64 },
+	{ MTP_PROPERTY_OBJECT_FILE_NAME, MTP_TYPE_STR },
+	{ MTP_PROPERTY_DATE_MODIFIED, MTP_TYPE_UINT64 },
+	{ MTP_PROPERTY_PARENT_OBJECT, MTP_TYPE_UINT32 },
+	{ MTP_PROPERTY_PERSISTENT_UID, MTP_TYPE_UINT128 },
+	{ MTP_PROPERTY_NAME, MTP_TYPE_STR },
+	{ MTP_PROPERTY_DISPLAY_NAME, MTP_TYPE_STR },
+	{ MTP_PROPERTY_DATE_ADDED, MTP_TYPE_UINT64 },
+	{ MTP_PROPERTY_DESCRIPTION, MTP_TYPE_STR },
+	{ MTP_PROPERTY_ARTIST, MTP_TYPE_STR },
+	{ MTP_PROPERTY_ALBUM_NAME, MTP_TYPE_STR },
+	{ MTP_PROPERTY_ALBUM_ARTIST, MTP_TYPE_STR },
+	{ MTP_PROPERTY_TRACK, MTP_TYPE_UINT16 },
+	{ MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_TYPE_UINT64 },
+	{ MTP_PROPERTY_DURATION, MTP_TYPE_UINT32 },
+	{ MTP_PROPERTY_GENRE, MTP_TYPE_STR },
+	{ MTP_PROPERTY_COMPOSER, MTP_TYPE_STR },
+};
+
 Node::Node()
-	: handle(-1), parent(0), name("")
+	: handle(-1), parent(0), name(""), size(0), mtime(0), format(MTP_FORMAT_UNDEFINED), statRead(false)
 {
 }
 
 Node::Node(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name)
-	: handle(handle), parent(parent), name(name)
+	: handle(handle), parent(parent), name(name), size(0), mtime(0), format(MTP_FORMAT_UNDEFINED), statRead(false)
 {
 				MTPD("handle: %d\n", handle);
 				MTPD("parent: %d\n", parent);
@@ -46,101 +74,91 @@ Node::Node(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& na
 
 void Node::rename(const std::string& newName) {
 	name = newName;
-	updateProperty(MTP_PROPERTY_OBJECT_FILE_NAME, 0, name.c_str(), MTP_TYPE_STR);
-	updateProperty(MTP_PROPERTY_NAME, 0, name.c_str(), MTP_TYPE_STR);
-	updateProperty(MTP_PROPERTY_DISPLAY_NAME, 0, name.c_str(), MTP_TYPE_STR);
 }
 
 MtpObjectHandle Node::Mtpid() const { return handle; }
 MtpObjectHandle Node::getMtpParentId() const { return parent; }
 const std::string& Node::getName() const { return name; }
 
-uint64_t Node::getIntProperty(MtpPropertyCode property) {
-	for (unsigned index = 0; index < mtpProp.size(); ++index) {
-		if (mtpProp[index].property == property)
-			return mtpProp[index].valueInt;
-	}
-	MTPE("Node::getIntProperty failed to find property %x, returning -1\n", (unsigned)property);
-	return -1;
+void Node::setProperties(const struct stat& st) {
+	size = st.st_size;
+	mtime = st.st_mtime;
+	format = S_ISDIR(st.st_mode) ? MTP_FORMAT_ASSOCIATION : MTP_FORMAT_UNDEFINED;
+	statRead = true;
 }
 
-const Node::mtpProperty& Node::getProperty(MtpPropertyCode property) {
-	static const mtpProperty dummyProp;
-	for (size_t i = 0; i < mtpProp.size(); ++i) {
-		if (mtpProp[i].property == property)
-			return mtpProp[i];
-	}
-	MTPE("Node::getProperty failed to find property %x, returning dummy property\n", (unsigned)property);
-	return dummyProp;
-}
+void Node::addProperties(const std::string& path) {
+	MTPD("addProperties: handle: %u, filename: '%s'\n", handle, getName().c_str());
+	struct stat st;
 
-void Node::addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType) {
-//	MTPD("adding property: %lld, valueInt: %lld, valueStr: %s, dataType: %d\n", property, valueInt, valueStr.c_str(), dataType);
-	struct mtpProperty prop;
-	prop.property = property;
-	prop.valueInt = valueInt;
-	prop.valueStr = valueStr;
-	prop.dataType = dataType;
-	mtpProp.push_back(prop);
+	if (lstat(path.c_str(), &st) == 0) {
+		setProperties(st);
+	} else {
+		size = 0;
+		format = MTP_FORMAT_UNDEFINED;   // file
+		statRead = true;
+	}
 }
 
-void Node::updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType) {
-	for (unsigned i = 0; i < mtpProp.size(); i++) {
-		if (mtpProp[i].property == property) {
-			mtpProp[i].valueInt = valueInt;
-			mtpProp[i].valueStr = valueStr;
-			mtpProp[i].dataType = dataType;
-			return;
-		}
+void Node::fillProperty(mtpProperty& prop, int storageID) const {
+	switch (prop.property) {
+		case MTP_PROPERTY_STORAGE_ID:
+			prop.valueInt = storageID;
+			break;
+		case MTP_PROPERTY_OBJECT_FORMAT:
+			prop.valueInt = format;
+			break;
+		case MTP_PROPERTY_OBJECT_SIZE:
+			prop.valueInt = size;
+			break;
+		case MTP_PROPERTY_OBJECT_FILE_NAME:
+		case MTP_PROPERTY_NAME:
+		case MTP_PROPERTY_DISPLAY_NAME:
+			prop.valueStr = name;
+			break;
+		case MTP_PROPERTY_DATE_MODIFIED:
+		case MTP_PROPERTY_DATE_ADDED:
+			prop.valueInt = mtime;
+			break;
+		case MTP_PROPERTY_PARENT_OBJECT:
+			prop.valueInt = parent;
+			break;
+		case MTP_PROPERTY_PERSISTENT_UID:
+			// TODO: we can't really support persistent UIDs without a persistent DB.
+			// probably a combination of volume UUID + st_ino would come close.
+			// doesn't help for fs with no native inodes numbers like fat though...
+			// however, Microsoft's own impl (Zune, etc.) does not support persistent UIDs either
+			prop.valueInt = ((uint64_t)storageID << 32) + handle;
+			break;
+		case MTP_PROPERTY_ORIGINAL_RELEASE_DATE:
+			prop.valueInt = 2014;	// TODO: extract year from mtime?
+			break;
+		default:
+			break;
 	}
-	addProperty(property, valueInt, valueStr, dataType);
 }
 
-std::vector<Node::mtpProperty>& Node::getMtpProps() {
-	return mtpProp;
+void Node::getMtpProps(std::vector<mtpProperty>& props, int storageID) const {
+	size_t count = sizeof(nodeProperties) / sizeof(nodeProperties[0]);
+	props.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		props[i] = mtpProperty();
+		props[i].property = nodeProperties[i].property;
+		props[i].dataType = nodeProperties[i].dataType;
+		fillProperty(props[i], storageID);
+	}
 }
 
-void Node::addProperties(const std::string& path, int storageID) {
-	MTPD("addProperties: handle: %u, filename: '%s'\n", handle, getName().c_str());
-	struct stat st;
-	int mFormat = 0;
-	uint64_t puid = ((uint64_t)storageID << 32) + handle;
-	off_t file_size = 0;
-
-	mFormat = MTP_FORMAT_UNDEFINED;   // file
-	if (lstat(path.c_str(), &st) == 0) {
-		file_size = st.st_size;
-		if (S_ISDIR(st.st_mode))
-			mFormat = MTP_FORMAT_ASSOCIATION; // folder
+Node::mtpProperty Node::getProperty(MtpPropertyCode property, int storageID) const {
+	mtpProperty prop;
+	for (size_t i = 0; i < sizeof(nodeProperties) / sizeof(nodeProperties[0]); ++i) {
+		if (nodeProperties[i].property == property) {
+			prop.property = property;
+			prop.dataType = nodeProperties[i].dataType;
+			fillProperty(prop, storageID);
+			return prop;
+		}
 	}
-
-	// TODO: don't store properties with constant values at all, add them at query time instead
-	addProperty(MTP_PROPERTY_STORAGE_ID, storageID, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_OBJECT_FORMAT, mFormat, "", MTP_TYPE_UINT16);
-	addProperty(MTP_PROPERTY_PROTECTION_STATUS, 0, "", MTP_TYPE_UINT16);
-	addProperty(MTP_PROPERTY_OBJECT_SIZE, file_size, "", MTP_TYPE_UINT64);
-	addProperty(MTP_PROPERTY_OBJECT_FILE_NAME, 0, getName().c_str(), MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DATE_MODIFIED, st.st_mtime, "", MTP_TYPE_UINT64);
-	addProperty(MTP_PROPERTY_PARENT_OBJECT, parent, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_PERSISTENT_UID, puid, "", MTP_TYPE_UINT128);
-		// TODO: we can't really support persistent UIDs without a persistent DB.
-		// probably a combination of volume UUID + st_ino would come close.
-		// doesn't help for fs with no native inodes numbers like fat though...
-		// however, Microsoft's own impl (Zune, etc.) does not support persistent UIDs either
-	addProperty(MTP_PROPERTY_NAME, 0, getName().c_str(), MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DISPLAY_NAME, 0, getName().c_str(), MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DATE_ADDED, st.st_mtime, "", MTP_TYPE_UINT64);
-	addProperty(MTP_PROPERTY_DESCRIPTION, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ARTIST, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ALBUM_NAME, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ALBUM_ARTIST, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_TRACK, 0, "", MTP_TYPE_UINT16);
-	addProperty(MTP_PROPERTY_ORIGINAL_RELEASE_DATE, 2014, "", MTP_TYPE_UINT64);	// TODO: extract year from st.st_mtime?
-	addProperty(MTP_PROPERTY_DURATION, 0, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_GENRE, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_COMPOSER, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ARTIST, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ALBUM_NAME, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DURATION, 0, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_DESCRIPTION, 0, "", MTP_TYPE_STR);
+	MTPE("Node::getProperty failed to find property %x, returning dummy property\n", (unsigned)property);
+	return prop;
 }
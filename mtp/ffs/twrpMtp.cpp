@@ -33,6 +33,83 @@
 #include "MtpDebug.h"
 
 #ifdef TWRPMTP
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <vector>
+#include "MtpObjectInfo.h"
+#include "MtpStorage.h"
+
+#define BENCH_DIRS			5
+#define BENCH_FILES_PER_DIR	20000		// 100k entries in DCIM-sized folders
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Walks the storage the way a host browsing it does: GetObjectHandles for
+// a folder followed by GetObjectInfo for every handle in it.
+static void bench_walk(MtpStorage* storage, const char* phase) {
+	std::vector<MtpObjectHandle> pending(1, MTP_PARENT_ROOT);
+	double list_secs = 0, info_secs = 0, start;
+	unsigned long handles = 0;
+
+	while (!pending.empty()) {
+		MtpObjectHandle parent = pending.back();
+		pending.pop_back();
+		start = bench_now();
+		MtpObjectHandleList* list = storage->getObjectList(storage->getStorageID(), parent);
+		list_secs += bench_now() - start;
+		start = bench_now();
+		for (MtpObjectHandleList::iterator it = list->begin(); it != list->end(); ++it) {
+			MtpObjectInfo info(*it);
+			if (storage->getObjectInfo(*it, info) == 0 && info.mFormat == MTP_FORMAT_ASSOCIATION)
+				pending.push_back(*it);
+		}
+		info_secs += bench_now() - start;
+		handles += list->size();
+		delete list;
+	}
+	printf("%-6s %8lu handles  GetObjectHandles %8.3f s  GetObjectInfo %8.3f s\n", phase, handles, list_secs, info_secs);
+}
+
+// Populates a synthetic tree under dir and times the first (cold, reads
+// the dirs) and second (cached) walk over it.
+static int benchmark(const std::string& dir) {
+	char path[PATH_MAX];
+	int fd;
+
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		printf("Unable to create '%s'\n", dir.c_str());
+		return 1;
+	}
+	for (int d = 0; d < BENCH_DIRS; d++) {
+		snprintf(path, sizeof(path), "%s/DIR%d", dir.c_str(), d);
+		mkdir(path, 0755);
+		for (int f = 0; f < BENCH_FILES_PER_DIR; f++) {
+			snprintf(path, sizeof(path), "%s/DIR%d/IMG_%05d.jpg", dir.c_str(), d, f);
+			fd = open(path, O_WRONLY | O_CREAT, 0644);
+			if (fd < 0) {
+				printf("Unable to create '%s'\n", path);
+				return 1;
+			}
+			close(fd);
+		}
+	}
+
+	MtpStorage* storage = new MtpStorage(1, dir.c_str(), "benchmark", false, 0, NULL);
+	storage->createDB();
+	storage->lockMutex(0);
+	bench_walk(storage, "cold");
+	bench_walk(storage, "warm");
+	storage->unlockMutex(0);
+	delete storage;
+	return 0;
+}
+
 static void usage(std::string prg) {
 	printf("Usage: %s <OPTIONS>\n", prg.c_str());
 	printf("Options:\n");
@@ -40,6 +117,7 @@ static void usage(std::string prg) {
 	printf("\t-s1, --storage1 /path/to/dir\t\tDestination to first storage directory\n");
 	printf("\t-s2, --storage2 /path/to/dir\t\tDestination to first storage directory\n");
 	printf("\t-sN, --storageN /path/to/dir\t\tDestination to first storage directory\n");
+	printf("\t-b, --benchmark /path/to/dir\t\tTime object handle and info lookups over 100k entries created in dir\n");
 }
 
 int main(int argc, char* argv[]) {
@@ -56,6 +134,9 @@ int main(int argc, char* argv[]) {
 		if ((arg == "-h") || (arg == "--help")) {
 			usage(argv[0]);
 		}
+		else if (((arg == "-b") || (arg == "--benchmark")) && i + 1 < argc) {
+			return benchmark(argv[++i]);
+		}
 		else {
 			storages.push_back(arg);
 		}
@@ -14,70 +14,179 @@
 	GNU General Public License <http://www.gnu.org/licenses/>.
 */
 
-#include <iostream>
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
 #include <openssl/evp.h>
-#include <openssl/ssl.h>
-#define _FILE_OFFSET_BITS 64
-//extern "C" __int64 __cdecl _ftelli64(FILE*);
 
 using namespace std;
-typedef std::basic_string<unsigned char> u_string;
 
-int decrypt(unsigned char* ciphertext, int ciphertext_len, unsigned char* key,
-	unsigned char* iv, unsigned char* plaintext)
+// An .ozip is a 0x1050 byte header followed by the zip, in which the
+// first 16 bytes of every 16400 byte chunk are AES-128-ECB encrypted and
+// the remaining 16384 are plain.
+#define OZIP_MAGIC			"OPPOENCRYPT!"
+#define OZIP_HEADER_SIZE	4176
+#define OZIP_HEAD_SIZE		16
+#define OZIP_PLAIN_SIZE		16384
+#define OZIP_CHUNK_SIZE		(OZIP_HEAD_SIZE + OZIP_PLAIN_SIZE)
+#define OZIP_WINDOW_CHUNKS	4096	// chunks mapped and decrypted at a time, ~64MB
+#define OZIP_COPY_SIZE		(1024 * 1024)
+
+static bool parse_key(const char* hex, unsigned char key[16])
 {
-	EVP_CIPHER_CTX* ctx;
-	int len;
-	int plaintext_len;
-	ctx = EVP_CIPHER_CTX_new();
-	EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, iv);
-	EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len);
-	plaintext_len = len;
-	EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
-	plaintext_len += len;
-	EVP_CIPHER_CTX_free(ctx);
-	return plaintext_len;
+	if (strlen(hex) != 32)
+		return false;
+	for (int i = 0; i < 16; i++) {
+		char byte[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+		char* end;
+		key[i] = (unsigned char)strtol(byte, &end, 16);
+		if (*end != 0)
+			return false;
+	}
+	return true;
 }
 
-std::string hexToASCII(string hex)
+// One key schedule for the whole file; ECB blocks are independent, so a
+// whole window of heads goes through a single EVP call.
+static EVP_CIPHER_CTX* init_cipher(const unsigned char key[16])
 {
-	int len = hex.length();
-	std::string newString;
-	for (int i = 0; i < len; i += 2)
-	{
-		string byte = hex.substr(i, 2);
-		char chr = (char)(int)strtol(byte.c_str(), nullptr, 16);
-		newString.push_back(chr);
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL)
+		return NULL;
+	if (EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1) {
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
 	}
-	return newString;
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+	return ctx;
 }
 
-bool testkey(const char* keyf, const char* path) {
-	u_string key = (unsigned char*)(hexToASCII(keyf)).c_str();
-	int data[17];
-	FILE* fps = fopen(path, "rb");
-	fseek(fps, 4176, SEEK_SET);
-	fread(data, sizeof(char), 16, fps);
-	fclose(fps);
-	u_string udata = (unsigned char*)data;
-	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-	EVP_CIPHER_CTX_init(ctx);
-	EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key.c_str(), NULL);
-	EVP_CIPHER_CTX_set_padding(ctx, false);
-	unsigned char buffer[1024], * pointer = buffer;
-	int outlen;
-	EVP_DecryptUpdate(ctx, pointer, &outlen, udata.c_str(), udata.length());
-	pointer += outlen;
-	EVP_DecryptFinal_ex(ctx, pointer, &outlen);
-	pointer += outlen;
-	EVP_CIPHER_CTX_free(ctx);
-	u_string test= u_string(buffer, pointer - buffer);
-	u_string checktest = test.substr(0, 4);
-	if (checktest == ((unsigned char*) "\x50\x4B\x03\x04") || checktest == ((unsigned char*) "\x41\x4E\x44\x52")) {
-		return true;
+static bool decrypt_heads(EVP_CIPHER_CTX* ctx, unsigned char* data, size_t len)
+{
+	int outlen = 0;
+	return EVP_DecryptUpdate(ctx, data, &outlen, data, len) == 1 && (size_t)outlen == len;
+}
+
+static bool testkey(EVP_CIPHER_CTX* ctx, int fd)
+{
+	unsigned char head[OZIP_HEAD_SIZE];
+	if (pread(fd, head, sizeof(head), OZIP_HEADER_SIZE) != (ssize_t)sizeof(head) || !decrypt_heads(ctx, head, sizeof(head)))
+		return false;
+	return memcmp(head, "\x50\x4B\x03\x04", 4) == 0 || memcmp(head, "\x41\x4E\x44\x52", 4) == 0;
+}
+
+static ssize_t copy_range(int in_fd, off_t* in_off, int out_fd, off_t* out_off, size_t len)
+{
+#ifdef __NR_copy_file_range
+	loff_t in_pos = *in_off, out_pos = *out_off;
+	ssize_t ret = syscall(__NR_copy_file_range, in_fd, &in_pos, out_fd, &out_pos, len, 0);
+	if (ret > 0) {
+		*in_off = in_pos;
+		*out_off = out_pos;
+	}
+	return ret;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static bool write_all(int fd, const unsigned char* data, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t w = pwrite(fd, data, len, off);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += w;
+		len -= w;
+		off += w;
+	}
+	return true;
+}
+
+// Copies the zip body in kernel, then overwrites the chunk heads with
+// their decrypted form one mapped window at a time.
+static bool decrypt_file(EVP_CIPHER_CTX* ctx, int in_fd, int out_fd, off_t total)
+{
+	off_t in_off = OZIP_HEADER_SIZE, out_off = 0;
+	bool kernel_copy = true;
+	long page = sysconf(_SC_PAGESIZE);
+	vector<unsigned char> heads;
+
+	while (kernel_copy && in_off < total) {
+		ssize_t ret = copy_range(in_fd, &in_off, out_fd, &out_off, total - in_off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret == 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)) {
+				printf("Unable to copy .ozip data: %s\n", ret == 0 ? "unexpected end of file" : strerror(errno));
+				return false;
+			}
+			// Old kernel or unsupported pair of filesystems, copy from the mapping below
+			kernel_copy = false;
+		}
 	}
-	return false;
+
+	heads.resize((size_t)OZIP_WINDOW_CHUNKS * OZIP_HEAD_SIZE);
+	for (off_t start = OZIP_HEADER_SIZE; start < total; start += (off_t)OZIP_WINDOW_CHUNKS * OZIP_CHUNK_SIZE) {
+		off_t end = start + (off_t)OZIP_WINDOW_CHUNKS * OZIP_CHUNK_SIZE;
+		if (end > total)
+			end = total;
+		off_t map_start = start - start % page;
+		size_t map_len = end - map_start;
+		void* map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, in_fd, map_start);
+		if (map == MAP_FAILED) {
+			printf("Unable to map .ozip: %s\n", strerror(errno));
+			return false;
+		}
+		madvise(map, map_len, MADV_SEQUENTIAL);
+		const unsigned char* window = (const unsigned char*)map + (start - map_start);
+
+		if (!kernel_copy && (off_t)out_off < end - OZIP_HEADER_SIZE) {
+			// in_off may be part way into this window if copy_file_range gave up late
+			for (off_t off = in_off; off < end; off += OZIP_COPY_SIZE) {
+				size_t len = end - off < OZIP_COPY_SIZE ? end - off : OZIP_COPY_SIZE;
+				if (!write_all(out_fd, window + (off - start), len, off - OZIP_HEADER_SIZE)) {
+					printf("Unable to write decrypted zip: %s\n", strerror(errno));
+					munmap(map, map_len);
+					return false;
+				}
+			}
+			in_off = end;
+			out_off = end - OZIP_HEADER_SIZE;
+		}
+
+		size_t count = 0;
+		for (off_t off = start; off + OZIP_HEAD_SIZE <= end; off += OZIP_CHUNK_SIZE)
+			memcpy(&heads[count++ * OZIP_HEAD_SIZE], window + (off - start), OZIP_HEAD_SIZE);
+		munmap(map, map_len);
+		if (count > 0 && !decrypt_heads(ctx, &heads[0], count * OZIP_HEAD_SIZE)) {
+			printf("Decryption failed\n");
+			return false;
+		}
+		for (size_t i = 0; i < count; i++) {
+			off_t out_pos = start - OZIP_HEADER_SIZE + (off_t)i * OZIP_CHUNK_SIZE;
+			if (!write_all(out_fd, &heads[i * OZIP_HEAD_SIZE], OZIP_HEAD_SIZE, out_pos)) {
+				printf("Unable to write decrypted zip: %s\n", strerror(errno));
+				return false;
+			}
+		}
+	}
+	return true;
 }
 
 int main(int argc, char* argv[])
@@ -88,18 +197,28 @@ int main(int argc, char* argv[])
 		printf("Usage: ozipdecrypt key [*.ozip]\n");
 		return 0;
 	}
-	const char* key = argv[1];
 	const char* path = argv[2];
-	FILE* fp = fopen(path, "rb");
-	char magic[13];
-	fgets(magic, sizeof(magic), fp);
+	unsigned char key[16];
+	if (!parse_key(argv[1], key))
+	{
+		printf("Key is not good!\n");
+		return 1;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("Unable to open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	char magic[sizeof(OZIP_MAGIC) - 1];
+	ssize_t magic_len = pread(fd, magic, sizeof(magic), 0);
 	string temp(path);
 	temp = (temp.substr(0, temp.size() - 5)).append(".zip");
 	const char* destpath= temp.c_str();
-	if (strcmp(magic, "OPPOENCRYPT!") != 0)
+	if (magic_len != (ssize_t)sizeof(magic) || memcmp(magic, OZIP_MAGIC, sizeof(magic)) != 0)
 	{
 		printf("This is not an .ozip file!\n");
-		fclose(fp);
+		close(fd);
 		int rencheck = rename(path, destpath);
 		if (rencheck == 0) {
 			printf("Renamed .ozip file in .zip file\n");
@@ -110,43 +229,46 @@ int main(int argc, char* argv[])
 		}
 		return 0;
 	}
-	if (testkey(key, path) == false)
+	EVP_CIPHER_CTX* ctx = init_cipher(key);
+	if (ctx == NULL || testkey(ctx, fd) == false)
 	{
 		printf("Key is not good!\n");
-		fclose(fp);
-		return 0;
+		if (ctx)
+			EVP_CIPHER_CTX_free(ctx);
+		close(fd);
+		return 1;
 	}
 	else {
 		printf("Key is good!\n");
 	}
-	FILE* fp2 = fopen(destpath, "wb");
-	fseek(fp, 0L, SEEK_END);
-	unsigned long int sizetot = ftello(fp);
-	fseek(fp, 4176, SEEK_SET);
-	int bdata[16384];
-	unsigned long int sizeseek;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		printf("Unable to stat %s: %s\n", path, strerror(errno));
+		EVP_CIPHER_CTX_free(ctx);
+		close(fd);
+		return 1;
+	}
+	int fd2 = open(destpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd2 < 0)
+	{
+		printf("Unable to create %s: %s\n", destpath, strerror(errno));
+		EVP_CIPHER_CTX_free(ctx);
+		close(fd);
+		return 1;
+	}
 	printf("Decrypting...\n");
-	while (true)
+	bool ok = decrypt_file(ctx, fd, fd2, st.st_size);
+	EVP_CIPHER_CTX_free(ctx);
+	close(fd);
+	if (close(fd2) != 0)
+		ok = false;
+	if (!ok)
 	{
-		unsigned char data[17];
-		fread(data, sizeof(char), 16, fp);
-		decrypt(data, sizeof(data), (unsigned char*)(hexToASCII(key)).c_str(), NULL, data);
-		fwrite(data, sizeof(char), 16, fp2);
-		sizeseek = ftello(fp);
-		if ((sizetot - sizeseek) <= 16384) {
-			fread(bdata, sizeof(char), (sizetot - sizeseek), fp);
-			fwrite(bdata, sizeof(char), (sizetot - sizeseek), fp2);
-			break;
-		}
-		else
-		{
-			fread(bdata, sizeof(char), 16384, fp);
-			fwrite(bdata, sizeof(char), 16384, fp2);
-		}
+		// Don't leave a half written zip behind for the installer to pick up
+		unlink(destpath);
+		return 1;
 	}
 	printf("File succesfully decrypted, saved in %s\n", destpath);
-	fclose(fp2);
-	fclose(fp);
 	return 0;
 }
-
@@ -31,6 +31,9 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <pthread.h>
 #include <iostream>
 #include <libgen.h>
 #include <pwd.h>
@@ -48,6 +51,7 @@
 #include "twrp-functions.hpp"
 #include "twrpTar.hpp"
 #include "exclude.hpp"
+#include "direnum.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
 #include "gui/gui.hpp"
@@ -247,6 +251,8 @@ TWPartition::TWPartition() {
 	Alternate_Block_Device = "";
 	Removable = false;
 	Is_Present = false;
+	Mounted_Cache = false;
+	Mounted_Cache_Generation = 0;
 	Length = 0;
 	Size = 0;
 	Used = 0;
@@ -1558,24 +1564,61 @@ bool TWPartition::Find_Partition_Size(void) {
 	return false;
 }
 
+// The kernel flags a /proc/self/mountinfo fd with POLLPRI whenever the
+// mount table of our namespace changes, and poll re-arms it. So one
+// non-blocking poll tells every partition whether its cached Is_Mounted
+// answer can still be used.
+static pthread_mutex_t mount_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mount_table_fd = -2;
+static unsigned mount_table_generation = 1;
+
+unsigned TWPartition::Mount_Table_Generation() {
+	pthread_mutex_lock(&mount_table_lock);
+	if (mount_table_fd == -2)
+		mount_table_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+	if (mount_table_fd < 0) {
+		mount_table_generation++; // no notifications, never trust the cache
+	} else {
+		struct pollfd pfd = { mount_table_fd, POLLPRI, 0 };
+		if (poll(&pfd, 1, 0) != 0)
+			mount_table_generation++;
+	}
+	unsigned generation = mount_table_generation;
+	pthread_mutex_unlock(&mount_table_lock);
+	return generation;
+}
+
 bool TWPartition::Is_Mounted(void) {
 	if (!Can_Be_Mounted)
 		return false;
 
+	unsigned generation = Mount_Table_Generation();
+	pthread_mutex_lock(&mount_table_lock);
+	if (Mounted_Cache_Generation == generation) {
+		bool mounted = Mounted_Cache;
+		pthread_mutex_unlock(&mount_table_lock);
+		return mounted;
+	}
+	pthread_mutex_unlock(&mount_table_lock);
+
 	struct stat st1, st2;
 	string test_path;
+	bool ret = false;
 
 	// Check to see if the mount point directory exists
 	test_path = Mount_Point + "/.";
-	if (stat(test_path.c_str(), &st1) != 0)  return false;
-
-	// Check to see if the directory above the mount point exists
-	test_path = Mount_Point + "/../.";
-	if (stat(test_path.c_str(), &st2) != 0)  return false;
-
-	// Compare the device IDs -- if they match then we're (probably) using tmpfs instead of an actual device
-	int ret = (st1.st_dev != st2.st_dev) ? true : false;
-
+	if (stat(test_path.c_str(), &st1) == 0) {
+		// Check to see if the directory above the mount point exists
+		test_path = Mount_Point + "/../.";
+		// Compare the device IDs -- if they match then we're (probably) using tmpfs instead of an actual device
+		if (stat(test_path.c_str(), &st2) == 0)
+			ret = st1.st_dev != st2.st_dev;
+	}
+
+	pthread_mutex_lock(&mount_table_lock);
+	Mounted_Cache = ret;
+	Mounted_Cache_Generation = generation;
+	pthread_mutex_unlock(&mount_table_lock);
 	return ret;
 }
 
@@ -1773,6 +1816,11 @@ bool TWPartition::UnMount(bool Display_Error) {
 				LOGINFO("Unable to unmount '%s'\n", Mount_Point.c_str());
 			return false;
 		} else {
+			// Whatever was written while mounted is now out of sight of
+			// the prop cache's mtime check
+			TWFunc::Invalidate_Property_Cache(Mount_Point);
+			if (!Symlink_Mount_Point.empty())
+				TWFunc::Invalidate_Property_Cache(Symlink_Mount_Point);
 			return true;
 		}
 	} else {
@@ -1809,6 +1857,8 @@ bool TWPartition::Wipe(string New_File_System) {
 	bool wiped = false, update_crypt = false, recreate_media = true;
 	int check;
 
+	TWFunc::Invalidate_Property_Cache(Mount_Point);
+
 	if (!Can_Be_Wiped) {
 		gui_msg(Msg(msg::kError, "cannot_wipe=Partition {1} cannot be wiped.")(Display_Name));
 		return false;
@@ -2130,6 +2180,7 @@ bool TWPartition::Restore(PartitionSettings *part_settings) {
 	}
 	string Restore_File_System = Get_Restore_File_System(part_settings);
 
+	TWFunc::Invalidate_Property_Cache(Mount_Point);
 	if (Is_File_System(Restore_File_System))
 		return Restore_Tar(part_settings);
 	else if (Is_Image(Restore_File_System))
@@ -2695,39 +2746,32 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 }
 
 bool TWPartition::Wipe_Data_Without_Wiping_Media_Func(const string& parent __unused) {
-	string dir;
-
-	DIR* d;
-	d = opendir(parent.c_str());
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)	 continue;
-
-			dir = parent;
-			dir.append(de->d_name);
-			if (wipe_exclusions.check_skip_dirs(dir)) {
-				LOGINFO("skipped '%s'\n", dir.c_str());
-				continue;
-			}
-			if (de->d_type == DT_DIR) {
-				dir.append("/");
-				if (!Wipe_Data_Without_Wiping_Media_Func(dir)) {
-					closedir(d);
-					return false;
-				}
-				rmdir(dir.c_str());
-			} else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_FIFO || de->d_type == DT_SOCK) {
-				if (unlink(dir.c_str()) != 0)
-					LOGINFO("Unable to unlink '%s': %s\n", dir.c_str(), strerror(errno));
-			}
-		}
-		closedir(d);
-
+	string root = TWFunc::Remove_Trailing_Slashes(parent);
+	string error_path;
+	bool error_is_dir = false;
+
+	// Entries matching wipe_exclusions are left in place along with the
+	// directories above them; everything else is removed in parallel.
+	TWDirEnum::Remove_Filter skip = [this](const string& path) {
+		if (!wipe_exclusions.check_skip_dirs(path))
+			return false;
+		LOGINFO("skipped '%s'\n", path.c_str());
+		return true;
+	};
+	int ret = TWDirEnum::Remove_Tree(root, false, skip, TWFunc::Show_Remove_Progress, &error_path, &error_is_dir);
+	int err = errno;
+	DataManager::SetValue("tw_file_progress", "");
+	if (ret == 0)
 		return true;
+	// Remove_Tree reports a directory failure ahead of any file one. As
+	// before, a file that can't be unlinked is only logged, but a
+	// directory that can't be opened or removed fails the wipe.
+	if (error_is_dir) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(error_path == root ? Mount_Point : error_path)(strerror(err)));
+		return false;
 	}
-	gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Mount_Point)(strerror(errno)));
-	return false;
+	LOGINFO("Unable to remove '%s': %s\n", error_path.c_str(), strerror(err));
+	return true;
 }
 
 void TWPartition::Wipe_Crypto_Key() {
@@ -2789,6 +2833,7 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 	}
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, tar.use_compression);
+	tar.write_buffer_size = DataManager::GetIntValue(TW_TAR_BUFFER_SIZE_VAR) * 1024;
 
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (Can_Encrypt_Backup) {
@@ -2911,14 +2956,8 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 
 	LOGINFO("Reading '%s', writing '%s'\n", srcfn.c_str(), destfn.c_str());
 
-	if (part_settings->adbbackup) {
-		RW_Block_Size = MAX_ADB_READ;
-		bs = MAX_ADB_READ;
-	}
-	else {
-		RW_Block_Size = 1048576LLU; // 1MB
-		bs = (ssize_t)(RW_Block_Size);
-	}
+	RW_Block_Size = 1048576LLU; // 1MB
+	bs = (ssize_t)(RW_Block_Size);
 
 	buffer = malloc((size_t)bs);
 	if (!buffer) {
@@ -2932,9 +2971,13 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 	while (Remain > 0) {
 		if (Remain < RW_Block_Size)
 			bs = (ssize_t)(Remain);
-		if (read(src_fd, buffer, bs) != bs) {
-			LOGINFO("Error reading source fd (%s)\n", strerror(errno));
-			goto exit;
+		// adb fifos hand back whatever bu has written so far
+		for (ssize_t done = 0, r; done < bs; done += r) {
+			r = read(src_fd, (char*)buffer + done, bs - done);
+			if (r <= 0) {
+				LOGINFO("Error reading source fd (%s)\n", r < 0 ? strerror(errno) : "unexpected end of file");
+				goto exit;
+			}
 		}
 		if (write(dest_fd, buffer, bs) != bs) {
 			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
@@ -3377,6 +3420,7 @@ bool TWPartition::Flash_Image(PartitionSettings *part_settings) {
 	string Restore_File_System, full_filename;
 
 	full_filename = part_settings->Backup_Folder + "/" + Backup_FileName;
+	TWFunc::Invalidate_Property_Cache(Mount_Point);
 
 	LOGINFO("Image filename is: %s\n", Backup_FileName.c_str());
 
@@ -3401,7 +3445,7 @@ bool TWPartition::Flash_Image(PartitionSettings *part_settings) {
 		if (Backup_Method == BM_DD) {
 			if (!part_settings->adbbackup) {
 				if (Is_Sparse_Image(full_filename)) {
-					return Flash_Sparse_Image(full_filename);
+					return Flash_Sparse_Image(full_filename, part_settings->progress);
 				}
 			}
 			return Raw_Read_Write(part_settings);
@@ -3433,17 +3477,194 @@ bool TWPartition::Is_Sparse_Image(const string& Filename) {
 	return false;
 }
 
-bool TWPartition::Flash_Sparse_Image(const string& Filename) {
-	string Command;
+#define SPARSE_IO_SIZE (4 * 1024 * 1024)
 
-	gui_msg(Msg("flashing=Flashing {1}...")(Display_Name));
+static bool Sparse_Read(int fd, void* buf, size_t len) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t r = read(fd, (char*)buf + done, len - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		done += r;
+	}
+	return true;
+}
 
-	Command = "simg2img '" + Filename + "' '" + Actual_Block_Device + "'";
-	LOGINFO("Flash command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+static bool Sparse_Write(int fd, const void* buf, size_t len, off64_t off) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t w = pwrite64(fd, (const char*)buf + done, len - done, off + done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		done += w;
+	}
 	return true;
 }
 
+// Writes Len bytes of the fill pattern already in Buffer starting at Off
+static bool Sparse_Fill(int fd, const void* buffer, unsigned long long off, unsigned long long len) {
+	while (len > 0) {
+		size_t bs = len < SPARSE_IO_SIZE ? (size_t)len : SPARSE_IO_SIZE;
+		if (!Sparse_Write(fd, buffer, bs, off))
+			return false;
+		off += bs;
+		len -= bs;
+	}
+	return true;
+}
+
+bool TWPartition::Flash_Sparse_Image(const string& Filename, ProgressTracking *progress) {
+	sparse_header_t header;
+	chunk_header_t chunk;
+	unsigned long long dev_size = 0, image_size, out_off = 0, in_off;
+	uint32_t fill = 0, buffer_fill = 0;
+	int src_fd = -1, dest_fd = -1;
+	void* buffer = NULL;
+	bool buffer_filled = false, ret = false;
+
+	gui_msg(Msg("flashing=Flashing {1}...")(Display_Name));
+
+	src_fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	if (!Sparse_Read(src_fd, &header, sizeof(header)) || header.magic != SPARSE_HEADER_MAGIC || header.major_version != 1 ||
+			header.file_hdr_sz < sizeof(header) || header.chunk_hdr_sz < sizeof(chunk) || header.blk_sz == 0 || header.blk_sz % 512) {
+		LOGERR("'%s' is not a valid sparse image\n", Filename.c_str());
+		goto exit;
+	}
+	image_size = (unsigned long long)header.total_blks * header.blk_sz;
+	in_off = header.file_hdr_sz;
+	if (lseek64(src_fd, in_off, SEEK_SET) < 0) {
+		LOGERR("'%s' is not a valid sparse image\n", Filename.c_str());
+		goto exit;
+	}
+
+	dest_fd = open(Actual_Block_Device.c_str(), O_WRONLY | O_LARGEFILE | O_CLOEXEC);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Actual_Block_Device)(strerror(errno)));
+		goto exit;
+	}
+	if (ioctl(dest_fd, BLKGETSIZE64, &dev_size) == 0 && image_size > dev_size) {
+		LOGINFO("Unpacked size (%llu bytes) of '%s' is larger than '%s' (%llu bytes)\n",
+			image_size, Filename.c_str(), Actual_Block_Device.c_str(), dev_size);
+		gui_err("img_size_err=Size of image is larger than target device");
+		goto exit;
+	}
+	if (posix_memalign(&buffer, 4096, SPARSE_IO_SIZE) != 0) {
+		buffer = NULL;
+		LOGINFO("Flash_Sparse_Image failed to allocate buffer\n");
+		goto exit;
+	}
+	LOGINFO("Writing sparse image '%s' (%u chunks, %llu bytes) to '%s'\n", Filename.c_str(), header.total_chunks, image_size, Actual_Block_Device.c_str());
+
+	// Progress follows the sparse file, which is what the caller sized the bar by
+	if (progress)
+		progress->SetPartitionSize(TWFunc::Get_File_Size(Filename));
+
+	for (uint32_t i = 0; i < header.total_chunks; i++) {
+		if (!Sparse_Read(src_fd, &chunk, sizeof(chunk)) ||
+				(header.chunk_hdr_sz > sizeof(chunk) && lseek64(src_fd, header.chunk_hdr_sz - sizeof(chunk), SEEK_CUR) < 0)) {
+			LOGERR("Unexpected end of sparse image '%s'\n", Filename.c_str());
+			goto exit;
+		}
+		unsigned long long len = (unsigned long long)chunk.chunk_sz * header.blk_sz;
+		unsigned long long data_size = chunk.total_sz >= header.chunk_hdr_sz ? chunk.total_sz - header.chunk_hdr_sz : ~0ULL;
+		bool valid = out_off + len <= image_size;
+
+		switch (chunk.chunk_type) {
+			case CHUNK_TYPE_RAW:
+				if (!valid || data_size != len) {
+					valid = false;
+					break;
+				}
+				for (unsigned long long done = 0; done < len; ) {
+					size_t bs = len - done < SPARSE_IO_SIZE ? (size_t)(len - done) : SPARSE_IO_SIZE;
+					if (!Sparse_Read(src_fd, buffer, bs)) {
+						LOGERR("Unexpected end of sparse image '%s'\n", Filename.c_str());
+						goto exit;
+					}
+					if (!Sparse_Write(dest_fd, buffer, bs, out_off + done)) {
+						LOGERR("Error writing '%s' (%s)\n", Actual_Block_Device.c_str(), strerror(errno));
+						goto exit;
+					}
+					done += bs;
+					if (progress)
+						progress->UpdateSize(in_off + header.chunk_hdr_sz + done);
+				}
+				break;
+			case CHUNK_TYPE_FILL:
+				if (!valid || data_size != sizeof(fill) || !Sparse_Read(src_fd, &fill, sizeof(fill))) {
+					valid = false;
+					break;
+				}
+				if (fill == 0) {
+					// Let the device zero the range, fall back to writing zeroes
+					uint64_t range[2] = { out_off, len };
+					if (ioctl(dest_fd, BLKZEROOUT, range) == 0)
+						break;
+				}
+				if (!buffer_filled || buffer_fill != fill) {
+					for (size_t j = 0; j < SPARSE_IO_SIZE / sizeof(fill); j++)
+						((uint32_t*)buffer)[j] = fill;
+					buffer_fill = fill;
+					buffer_filled = true;
+				}
+				if (!Sparse_Fill(dest_fd, buffer, out_off, len)) {
+					LOGERR("Error writing '%s' (%s)\n", Actual_Block_Device.c_str(), strerror(errno));
+					goto exit;
+				}
+				break;
+			case CHUNK_TYPE_DONT_CARE: {
+				if (!valid || data_size != 0) {
+					valid = false;
+					break;
+				}
+				// Contents are undefined; discarding is a hint, so failure just leaves the old data
+				uint64_t range[2] = { out_off, len };
+				if (len > 0)
+					ioctl(dest_fd, BLKDISCARD, range);
+				break;
+			}
+			case CHUNK_TYPE_CRC32:
+				if (data_size != sizeof(uint32_t) || lseek64(src_fd, sizeof(uint32_t), SEEK_CUR) < 0)
+					valid = false;
+				len = 0;
+				break;
+			default:
+				valid = false;
+				break;
+		}
+		if (!valid) {
+			LOGERR("Invalid chunk %u (type 0x%x) in sparse image '%s'\n", i, chunk.chunk_type, Filename.c_str());
+			goto exit;
+		}
+		out_off += len;
+		in_off += chunk.total_sz;
+		if (progress)
+			progress->UpdateSize(in_off);
+		if (PartitionManager.Check_Backup_Cancel() != 0)
+			goto exit;
+	}
+	if (fsync(dest_fd) != 0) {
+		LOGERR("Error writing '%s' (%s)\n", Actual_Block_Device.c_str(), strerror(errno));
+		goto exit;
+	}
+	if (progress)
+		progress->UpdateDisplayDetails(true);
+	ret = true;
+exit:
+	if (src_fd >= 0)
+		close(src_fd);
+	if (dest_fd >= 0)
+		close(dest_fd);
+	free(buffer);
+	return ret;
+}
+
 bool TWPartition::Flash_Image_FI(const string& Filename, ProgressTracking *progress) {
 	string Command;
 	unsigned long long file_size;
@@ -129,6 +129,8 @@ TWPartitionManager::TWPartitionManager(void) {
 	mtp_write_fd = -1;
 	uevent_pfd.fd = -1;
 	stop_backup.set_value(0);
+	pthread_mutex_init(&index_lock, NULL);
+	index_dirty = true;
 #ifdef AB_OTA_UPDATER
 	char slot_suffix[PROPERTY_VALUE_MAX];
 	property_get("ro.boot.slot_suffix", slot_suffix, "error");
@@ -240,9 +242,10 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error,
 			fstab_line[line_size] = '\n';
 
 		TWPartition* partition = new TWPartition();
-		if (partition->Process_Fstab_Line(fstab_line, Display_Error, &twrp_flags))
+		if (partition->Process_Fstab_Line(fstab_line, Display_Error, &twrp_flags)) {
 			Partitions.push_back(partition);
-		else
+			Invalidate_Partition_Index();
+		} else
 			delete partition;
 
 		memset(fstab_line, 0, sizeof(fstab_line));
@@ -255,9 +258,10 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error,
 		for (std::map<string, Flags_Map>::iterator mapit=twrp_flags.begin(); mapit!=twrp_flags.end(); mapit++) {
 			if (Find_Partition_By_Path(mapit->first) == NULL) {
 				TWPartition* partition = new TWPartition();
-				if (partition->Process_Fstab_Line(mapit->second.fstab_line, Display_Error, NULL))
+				if (partition->Process_Fstab_Line(mapit->second.fstab_line, Display_Error, NULL)) {
 					Partitions.push_back(partition);
-				else
+					Invalidate_Partition_Index();
+				} else
 					delete partition;
 			}
 			if (mapit->second.fstab_line)
@@ -300,8 +304,10 @@ void TWPartitionManager::Setup_Fstab_Partitions(bool Display_Error) {
 			else
 				(*iter)->Has_Android_Secure = false;
 
-			if ((*iter)->Is_Super && !Prepare_Super_Volume(*iter))
+			if ((*iter)->Is_Super && !Prepare_Super_Volume(*iter)) {
 				Partitions.erase(iter--);
+				Invalidate_Partition_Index();
+			}
 		}
 
 		Unlock_Block_Partitions();
@@ -756,21 +762,73 @@ TWPartition* TWPartitionManager::Find_Partition_By_Path(const string& Path) {
 
 	if (Local_Path == "/system")
 		Local_Path = Get_Android_Root_Path();
-	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path))
-			return (*iter);
-	}
-	return NULL;
+	return Find_Indexed_Partition(Local_Path, false);
 }
 
 TWPartition* TWPartitionManager::Find_Partition_By_Block_Device(const string& Block_Device) {
-	std::vector<TWPartition*>::iterator iter;
+	return Find_Indexed_Partition(Block_Device, true);
+}
 
+void TWPartitionManager::Invalidate_Partition_Index() {
+	pthread_mutex_lock(&index_lock);
+	index_dirty = true;
+	pthread_mutex_unlock(&index_lock);
+}
+
+// Called with index_lock held. Keys map to the first partition that has
+// them, which is what the old linear scans returned.
+void TWPartitionManager::Rebuild_Partition_Index() {
+	path_index.clear();
+	block_index.clear();
+	for (size_t i = 0; i < Partitions.size(); i++) {
+		TWPartition* Part = Partitions[i];
+		path_index.emplace(Part->Mount_Point, i);
+		if (!Part->Symlink_Mount_Point.empty())
+			path_index.emplace(Part->Symlink_Mount_Point, i);
+		block_index.emplace(Part->Primary_Block_Device, i);
+		if (!Part->Actual_Block_Device.empty())
+			block_index.emplace(Part->Actual_Block_Device, i);
+	}
+	index_dirty = false;
+}
+
+TWPartition* TWPartitionManager::Find_Indexed_Partition(const string& Key, bool By_Block_Device) {
+	std::vector<TWPartition*>::iterator iter;
+	TWPartition* found = NULL;
+
+	pthread_mutex_lock(&index_lock);
+	if (index_dirty)
+		Rebuild_Partition_Index();
+	std::unordered_map<string, size_t>& lookup = By_Block_Device ? block_index : path_index;
+	std::unordered_map<string, size_t>::iterator hit = lookup.find(Key);
+	if (hit != lookup.end() && hit->second < Partitions.size()) {
+		// Members are public and get reassigned in places, so make sure
+		// the entry still holds before trusting it
+		TWPartition* Part = Partitions[hit->second];
+		if (By_Block_Device ? (Part->Primary_Block_Device == Key || (!Part->Actual_Block_Device.empty() && Part->Actual_Block_Device == Key))
+				: (Part->Mount_Point == Key || (!Part->Symlink_Mount_Point.empty() && Part->Symlink_Mount_Point == Key)))
+			found = Part;
+	}
+	pthread_mutex_unlock(&index_lock);
+	if (found)
+		return found;
+
+	// Not indexed or stale: fall back to the scan, and rebuild next time if
+	// it finds something the index missed
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Primary_Block_Device == Block_Device || (!(*iter)->Actual_Block_Device.empty() && (*iter)->Actual_Block_Device == Block_Device))
-			return (*iter);
+		if (By_Block_Device) {
+			if ((*iter)->Primary_Block_Device == Key || (!(*iter)->Actual_Block_Device.empty() && (*iter)->Actual_Block_Device == Key))
+				found = *iter;
+		} else {
+			if ((*iter)->Mount_Point == Key || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Key))
+				found = *iter;
+		}
+		if (found) {
+			Invalidate_Partition_Index();
+			break;
+		}
 	}
-	return NULL;
+	return found;
 }
 
 int TWPartitionManager::Check_Backup_Name(const std::string& Backup_Name, bool Display_Error, bool Must_Be_Unique) {
@@ -3355,6 +3413,7 @@ void TWPartitionManager::Remove_Partition_By_Path(string Path) {
 		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
 			LOGINFO("Found and erasing '%s' from partition list\n", Local_Path.c_str());
 			Partitions.erase(iter);
+			Invalidate_Partition_Index();
 			return;
 		}
 	}
@@ -3430,6 +3489,7 @@ void TWPartitionManager::Remove_Uevent_Devices(const string& Mount_Point) {
 			(*iter)->UnMount(false);
 			rmdir((*iter)->Mount_Point.c_str());
 			iter = Partitions.erase(iter);
+			Invalidate_Partition_Index();
 			delete part;
 		} else {
 			iter++;
@@ -3568,6 +3628,7 @@ void TWPartitionManager::close_uevent() {
 
 void TWPartitionManager::Add_Partition(TWPartition* Part) {
 	Partitions.push_back(Part);
+	Invalidate_Partition_Index();
 }
 
 void TWPartitionManager::Coldboot_Scan(std::vector<string> *sysfs_entries, const string& Path, int depth) {
@@ -4380,6 +4441,7 @@ bool TWPartitionManager::Prepare_All_Super_Volumes() {
 			if (!Prepare_Super_Volume(*iter)) {
 				status = false;
 				Partitions.erase(iter--);
+				Invalidate_Partition_Index();
 			}
 			PartitionManager.Output_Partition(*iter);
 		}
@@ -4535,6 +4597,7 @@ bool TWPartitionManager::Unmap_Super_Devices() {
 				destroyed = DestroyLogicalPartition(cow_partition);
 			}
 			iter = Partitions.erase(iter);
+			Invalidate_Partition_Index();
 			delete part;
 			if (!destroyed) {
 				return false;
@@ -23,8 +23,10 @@
 #define __TWRP_Partition_Manager
 
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
+#include <pthread.h>
 #include <sys/poll.h>
 #include "exclude.hpp"
 #include "tw_atomic.hpp"
@@ -246,7 +248,7 @@ private:
 	void Recreate_AndSec_Folder(void);                                        // Recreates the .android_secure folder
 	bool Mount_Storage_Retry(bool Display_Error);                             // Tries multiple times with a half second delay to mount a device in case storage is slow to mount
 	bool Is_Sparse_Image(const string& Filename);                             // Determines if a file is in sparse image format
-	bool Flash_Sparse_Image(const string& Filename);                          // Flashes a sparse image using simg2img
+	bool Flash_Sparse_Image(const string& Filename, ProgressTracking *progress); // Unpacks a sparse image onto the block device, discarding don't-care and zeroing zero-fill chunks
 	bool Flash_Image_FI(const string& Filename, ProgressTracking *progress);  // Flashes an image to the partition using flash_image for mtd nand
 	void ExcludeAll(const string& path);                                      // Adds an exclusion for path to both the backup and wipe exclusion lists
 	void Fox_Add_Backup_Exclusions(void);					  // Excludes "troublesome" directories from backups, to avoid predictable "error 255" problems
@@ -318,6 +320,10 @@ private:
 
 	std::vector<partition_fs_flags_struct> fs_flags;                          // This vector stores mount flags and options for different file systems for the same partition
 	bool Is_Super;								  // States whether partition should be loaded from the super partition
+	bool Mounted_Cache;                                                       // Result of the last Is_Mounted check
+	unsigned Mounted_Cache_Generation;                                        // Mount table generation Mounted_Cache was taken at
+
+	static unsigned Mount_Table_Generation();                                 // Changes whenever the mount table has changed since the last call
 
 friend class TWPartitionManager;
 friend class DataManager;
@@ -353,6 +359,7 @@ public:
 	int Mount_Settings_Storage(bool Display_Error);                           // Mounts the settings file storage location (usually internal)
 	TWPartition* Find_Partition_By_Path(const string& Path);                  // Returns a pointer to a partition based on path
 	TWPartition* Find_Partition_By_Block_Device(const string& Block_Device);  // Returns a pointer to a partition based on block device
+	void Invalidate_Partition_Index();                                        // Call after adding or removing partitions or changing their mount points or block devices
 	int Check_Backup_Name(const std::string& Backup_Name, bool Display_Error, bool Must_Be_Unique); // Checks the current backup name to ensure that it is valid and optionally that a backup with that name doesn't already exist
 	int Run_Backup(bool adbbackup);                                           // Initiates a backup in the current storage
 	int Run_OTA_Survival_Backup(bool adbbackup);                              // Create backup for OTA survival in the internal storage
@@ -451,6 +458,8 @@ private:
 	TWPartition* Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID);   // Returns a pointer to a partition based on MTP Storage ID
 	bool Add_Remove_MTP_Storage(TWPartition* Part, int message_type);         // Adds or removes an MTP Storage partition
 	TWPartition* Find_Next_Storage(string Path, bool Exclude_Data_Media);
+	TWPartition* Find_Indexed_Partition(const string& Key, bool By_Block_Device); // Hash lookup behind Find_Partition_By_Path and Find_Partition_By_Block_Device
+	void Rebuild_Partition_Index();                                           // Rebuilds the mount point and block device indexes from Partitions
 	int Open_Lun_File(string Partition_Path, string Lun_File);
 	void Post_Decrypt(const string& Block_Device);                            // Completes various post-decrypt tasks
 	void Coldboot_Scan(std::vector<string> *sysfs_entries, const string& Path, int depth); // Scans subfolders to find matches to the paths stored in sysfs_entries so we can trigger the uevent system to "re-add" devices
@@ -468,6 +477,10 @@ private:
 
 private:
 	std::vector<TWPartition*> Partitions;                                     // Vector list of all partitions
+	pthread_mutex_t index_lock;                                               // Guards the indexes below
+	bool index_dirty;                                                         // Indexes need a rebuild before the next lookup
+	std::unordered_map<string, size_t> path_index;                            // Mount point and symlink mount point to first matching position in Partitions
+	std::unordered_map<string, size_t> block_index;                           // Primary and actual block device to first matching position in Partitions
 	string Active_Slot_Display;                                               // Current Active Slot (A or B) for display purposes
 	std::vector<users_struct> Users_List;                                     // List of FBE users
 	std::vector<std::string> Super_Partition_List;                            // Display value for super partitions
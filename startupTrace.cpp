@@ -0,0 +1,96 @@
+/*
+	Copyright 2026 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "startupTrace.hpp"
+#include "twcommon.h"
+
+struct startup_event {
+	std::string name;
+	int64_t start;
+	int64_t end;
+	pid_t tid;
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<startup_event> trace_events;
+
+int64_t startupTrace::Now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void startupTrace::Add(const std::string& Name, int64_t Start, int64_t End) {
+	startup_event event;
+	event.name = Name;
+	event.start = Start;
+	event.end = End;
+	event.tid = syscall(__NR_gettid);
+	pthread_mutex_lock(&trace_lock);
+	trace_events.push_back(event);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static std::string startup_json_escape(const std::string& in) {
+	std::string out;
+	for (size_t i = 0; i < in.size(); i++) {
+		if (in[i] == '"' || in[i] == '\\')
+			out += '\\';
+		if ((unsigned char)in[i] >= 0x20)
+			out += in[i];
+	}
+	return out;
+}
+
+bool startupTrace::Write(const std::string& Path) {
+	std::string tmp = Path + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "we");
+	if (fp == NULL) {
+		LOGINFO("Unable to write boot trace '%s': %s\n", tmp.c_str(), strerror(errno));
+		return false;
+	}
+	pid_t pid = getpid();
+	pthread_mutex_lock(&trace_lock);
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (size_t i = 0; i < trace_events.size(); i++) {
+		const startup_event& event = trace_events[i];
+		fprintf(fp, "{\"name\":\"%s\",\"cat\":\"startup\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d}%s\n",
+			startup_json_escape(event.name).c_str(), (long long)event.start, (long long)(event.end - event.start),
+			pid, event.tid, i + 1 < trace_events.size() ? "," : "");
+		LOGINFO("Startup: %s took %lld ms\n", event.name.c_str(), (long long)(event.end - event.start) / 1000);
+	}
+	fprintf(fp, "]}\n");
+	size_t count = trace_events.size();
+	pthread_mutex_unlock(&trace_lock);
+	if (fclose(fp) != 0 || rename(tmp.c_str(), Path.c_str()) != 0) {
+		LOGINFO("Unable to write boot trace '%s': %s\n", Path.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return false;
+	}
+	LOGINFO("Boot trace with %zu spans written to '%s'\n", count, Path.c_str());
+	return true;
+}
@@ -0,0 +1,48 @@
+/*
+	Copyright 2026 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STARTUPTRACE_HPP
+#define STARTUPTRACE_HPP
+
+#include <stdint.h>
+#include <string>
+
+#define STARTUP_TRACE_FILE "/tmp/recovery_boot_trace.json"
+
+// Boot timeline. Every span is a complete event in Chrome trace format,
+// timed against CLOCK_BOOTTIME so it lines up with the kernel log; load
+// the file in chrome://tracing or Perfetto.
+class startupTrace {
+public:
+	static int64_t Now(); // microseconds since boot
+	static void Add(const std::string& Name, int64_t Start, int64_t End);
+	static bool Write(const std::string& Path);
+};
+
+// Records the lifetime of a scope as one span.
+class startupSpan {
+public:
+	explicit startupSpan(const std::string& Name) : name(Name), start(startupTrace::Now()) {}
+	~startupSpan() { startupTrace::Add(name, start, startupTrace::Now()); }
+
+private:
+	std::string name;
+	int64_t start;
+};
+
+#endif // STARTUPTRACE_HPP
@@ -16,98 +16,166 @@
 	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "libtar/libtar.h"
 #include "twcommon.h"
+#include "tarWrite.h"
 
-int flush = 0, eot_count = -1;
-unsigned char *write_buffer;
-unsigned buffer_size = 4096;
-unsigned buffer_loc = 0;
-int buffer_status = 0;
-int prog_pipe = -1;
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
-
-void reinit_libtar_buffer(void) {
-	flush = 0;
-	eot_count = -1;
-	buffer_loc = 0;
-	buffer_status = 1;
-}
+/* Every open archive carries its own write state on its TAR handle, so
+   several threads can each buffer writes to their own archive, and an fd
+   number reused by another archive can't pick up stale state.
+*/
+struct libtar_buffer {
+	unsigned char *data;               // NULL for unbuffered archives
+	unsigned size;
+	unsigned loc;
+	int eot_count;
+	int prog_pipe;
+	unsigned long long prog_pending;   // bytes written but not yet reported
+};
+
+static ssize_t write_libtar_buffer(void *ctx, int fd, const void *buffer, size_t size);
+static ssize_t write_libtar_no_buffer(void *ctx, int fd, const void *buffer, size_t size);
+
+static int add_libtar_buffer(TAR *t, unsigned size, int pipe_fd) {
+	struct libtar_buffer *buf = (struct libtar_buffer*) calloc(1, sizeof(*buf));
 
-void init_libtar_buffer(unsigned new_buff_size, int pipe_fd) {
-	if (new_buff_size != 0)
-		buffer_size = new_buff_size;
+	if (buf == NULL)
+		return -1;
+	if (size != 0) {
+		buf->data = (unsigned char*) malloc(size);
+		if (buf->data == NULL) {
+			free(buf);
+			return -1;
+		}
+	}
+	buf->size = size;
+	buf->eot_count = -1;
+	buf->prog_pipe = pipe_fd;
 
-	reinit_libtar_buffer();
-	write_buffer = (unsigned char*) malloc(sizeof(char *) * buffer_size);
-	prog_pipe = pipe_fd;
+	t->write_ctx = buf;
+	t->ctxwritefunc = size != 0 ? write_libtar_buffer : write_libtar_no_buffer;
+	return 0;
 }
 
-void free_libtar_buffer(void) {
-	if (buffer_status > 0)
-		free(write_buffer);
-	buffer_status = 0;
-	prog_pipe = -1;
+static void flush_libtar_progress(struct libtar_buffer *buf) {
+	if (buf->prog_pending > 0 && buf->prog_pipe >= 0)
+		write(buf->prog_pipe, &buf->prog_pending, sizeof(buf->prog_pending));
+	buf->prog_pending = 0;
 }
 
-ssize_t write_libtar_buffer(int fd, const void *buffer, size_t size) {
-	void* ptr;
-
-	if (flush == 0) {
-		ptr = write_buffer + buffer_loc;
-		memcpy(ptr, buffer, size);
-		buffer_loc += size;
-		if (eot_count >= 0 && eot_count < 2)
-			eot_count++;
-			/* At the end of the tar file, libtar will add 2 blank blocks.
-			   Once we have received both EOT blocks, we will immediately
-			   write anything in the buffer to the file.
-			*/
-
-		if (buffer_loc >= buffer_size || eot_count >= 2) {
-			flush = 1;
-		}
-	}
-	if (flush == 1) {
-		flush = 0;
-		if (buffer_loc == 0) {
-			// nothing to write
-			return 0;
-		}
-		if (write(fd, write_buffer, buffer_loc) != (int)buffer_loc) {
+static void report_libtar_progress(struct libtar_buffer *buf, size_t size) {
+	buf->prog_pending += size;
+	if (buf->prog_pending >= T_PROGRESS_INTERVAL)
+		flush_libtar_progress(buf);
+}
+
+static int write_libtar_fully(struct libtar_buffer *buf, int fd, const unsigned char *data, size_t size) {
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < size) {
+		ret = write(fd, data + done, size - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 			LOGERR("Error writing tar file!\n");
-			buffer_loc = 0;
 			return -1;
-		} else {
-			unsigned long long fs = (unsigned long long)(buffer_loc);
-			write(prog_pipe, &fs, sizeof(fs));
-			buffer_loc = 0;
-			return size;
 		}
-	} else {
-		return size;
+		done += ret;
 	}
-	// Shouldn't ever get here
-	return -1;
+	report_libtar_progress(buf, size);
+	return 0;
+}
+
+static int flush_write_buffer(struct libtar_buffer *buf, int fd) {
+	int ret = 0;
+
+	if (buf->loc > 0)
+		ret = write_libtar_fully(buf, fd, buf->data, buf->loc);
+	buf->loc = 0;
+	return ret;
 }
 
-void flush_libtar_buffer(int fd) {
-	eot_count = 0;
-	if (buffer_status)
-		buffer_status = 2;
+int init_libtar_buffer(TAR *t, unsigned new_buff_size, int pipe_fd) {
+	if (new_buff_size < T_BLOCKSIZE)
+		new_buff_size = TW_TAR_DEFAULT_BUFFER_SIZE;
+	return add_libtar_buffer(t, new_buff_size, pipe_fd);
 }
 
-void init_libtar_no_buffer(int pipe_fd) {
-	buffer_size = T_BLOCKSIZE;
-	prog_pipe = pipe_fd;
-	buffer_status = 0;
+int init_libtar_no_buffer(TAR *t, int pipe_fd) {
+	return add_libtar_buffer(t, 0, pipe_fd);
 }
 
-ssize_t write_libtar_no_buffer(int fd, const void *buffer, size_t size) {
-	write(prog_pipe, &progress_size, sizeof(progress_size));
-	return write(fd, buffer, size);
+void flush_libtar_buffer(TAR *t) {
+	struct libtar_buffer *buf = (struct libtar_buffer*) t->write_ctx;
+
+	if (buf != NULL)
+		buf->eot_count = 0;
+}
+
+int free_libtar_buffer(TAR *t) {
+	struct libtar_buffer *buf = (struct libtar_buffer*) t->write_ctx;
+	int ret = 0;
+
+	if (buf == NULL)
+		return 0;
+	t->ctxwritefunc = NULL;
+	t->write_ctx = NULL;
+
+	if (buf->data != NULL)
+		ret = flush_write_buffer(buf, t->fd);
+	flush_libtar_progress(buf);
+	free(buf->data);
+	free(buf);
+	return ret;
+}
+
+static ssize_t write_libtar_buffer(void *ctx, int fd, const void *buffer, size_t size) {
+	struct libtar_buffer *buf = (struct libtar_buffer*) ctx;
+	const unsigned char *src = (const unsigned char *)buffer;
+	size_t left = size, len;
+
+	if (buf->eot_count >= 0 && buf->eot_count < 2)
+		buf->eot_count++;
+
+	while (left > 0) {
+		if (buf->loc == 0 && left >= buf->size) {
+			// libtar hands us whole data chunks; anything at least as
+			// large as the buffer goes straight out without a copy.
+			if (write_libtar_fully(buf, fd, src, left) < 0)
+				return -1;
+			break;
+		}
+		len = buf->size - buf->loc;
+		if (len > left)
+			len = left;
+		memcpy(buf->data + buf->loc, src, len);
+		buf->loc += len;
+		src += len;
+		left -= len;
+		if (buf->loc >= buf->size && flush_write_buffer(buf, fd) < 0)
+			return -1;
+	}
+
+	/* At the end of the tar file, libtar will add 2 blank blocks.
+	   Once we have received both EOT blocks, we will immediately
+	   write anything in the buffer to the file.
+	*/
+	if (buf->eot_count >= 2 && flush_write_buffer(buf, fd) < 0)
+		return -1;
+	return size;
+}
+
+static ssize_t write_libtar_no_buffer(void *ctx, int fd, const void *buffer, size_t size) {
+	struct libtar_buffer *buf = (struct libtar_buffer*) ctx;
+	ssize_t ret = write(fd, buffer, size);
+
+	if (ret > 0)
+		report_libtar_progress(buf, ret);
+	return ret;
 }
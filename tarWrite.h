@@ -19,13 +19,18 @@
 #ifndef _TARWRITE_HEADER
 #define _TARWRITE_HEADER
 
-void reinit_libtar_buffer();
-void init_libtar_buffer(unsigned new_buff_size, int pipe_fd);
-void free_libtar_buffer();
-writefunc_t write_libtar_buffer(int fd, const void *buffer, size_t size);
-void flush_libtar_buffer(int fd);
-
-void init_libtar_no_buffer(int pipe_fd);
-writefunc_t write_libtar_no_buffer(int fd, const void *buffer, size_t size);
+#include "libtar/libtar.h"
+
+// Write buffer used when the caller doesn't ask for a specific size
+#define TW_TAR_DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+// Write state lives on the TAR handle, so several threads can each write
+// their own archive. Attach it after tar_open()/tar_fdopen() and free it
+// before tar_close(); until then writes go through the tartype's
+// writefunc.
+int init_libtar_buffer(TAR *t, unsigned new_buff_size, int pipe_fd);
+int init_libtar_no_buffer(TAR *t, int pipe_fd);
+void flush_libtar_buffer(TAR *t);
+int free_libtar_buffer(TAR *t);
 
 #endif  // _TARWRITE_HEADER
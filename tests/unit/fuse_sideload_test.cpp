@@ -14,14 +14,21 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "fuse_provider.h"
@@ -58,6 +65,45 @@ TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_too_many_blocks)));
 }
 
+// Forks a child serving |provider| at |mount_point| and waits for the package to show up.
+static void StartFuseSideload(std::unique_ptr<FuseDataProvider>&& provider,
+                              const std::string& mount_point, pid_t* pid) {
+  *pid = fork();
+  if (*pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point.c_str()));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = mount_point + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  int status;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    ASSERT_NE(-1, waitpid(*pid, &status, WNOHANG));
+
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+}
+
+static void StopFuseSideload(const std::string& mount_point, pid_t pid) {
+  std::string exit_flag = mount_point + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+
+  int status;
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(0, WEXITSTATUS(status));
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+}
+
 TEST(SideloadTest, run_fuse_sideload) {
   const std::vector<std::string> blocks = {
     std::string(2048, 'a') + std::string(2048, 'b'),
@@ -110,3 +156,93 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload_random_access) {
+  // More blocks than fit in the block cache, with a partial last block.
+  std::string content;
+  for (size_t i = 0; i < 3000; i++) {
+    content += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  content += "tail";
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, &pid));
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, fd);
+
+  // Jump to the end first (as for a zip central directory), then read unaligned ranges spanning
+  // two blocks in a scattered order, then re-read the beginning after it has been evicted.
+  std::vector<std::pair<off_t, size_t>> reads = { { content.size() - 4100, 4100 } };
+  for (size_t i = 0; i < 200; i++) {
+    reads.emplace_back((i * 7919 % 2999) * 4096 + 1000, 4096);
+  }
+  reads.emplace_back(0, 4096);
+
+  for (const auto& [offset, size] : reads) {
+    std::string buffer(size, '\0');
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), size, offset));
+    ASSERT_EQ(content.substr(offset, size), buffer) << "offset " << offset;
+  }
+  fd.reset();
+
+  StopFuseSideload(mount_point.path, pid);
+}
+
+// A file-backed provider that adds a fixed delay to every fetch, to mimic the round trip to the
+// adb host.
+class FuseDelayedFileDataProvider : public FuseFileDataProvider {
+ public:
+  FuseDelayedFileDataProvider(const std::string& path, uint32_t block_size,
+                              std::chrono::microseconds delay)
+      : FuseFileDataProvider(path, block_size), delay_(delay) {}
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override {
+    std::this_thread::sleep_for(delay_);
+    return FuseFileDataProvider::ReadBlockAlignedData(buffer, fetch_size, start_block);
+  }
+
+ private:
+  std::chrono::microseconds delay_;
+};
+
+// Measures the sideload throughput with the block size used by adb. Doesn't assert on the speed,
+// which depends on the device; the result is recorded in the test output.
+TEST(SideloadTest, run_fuse_sideload_throughput) {
+  static constexpr uint32_t kBlockSize = 65536;
+  static constexpr size_t kFileSize = 64 * 1024 * 1024;
+  std::string content(kFileSize, '\0');
+  for (size_t i = 0; i < kFileSize; i += 4096) {
+    std::fill_n(content.begin() + i, 4096, static_cast<char>(i / 4096));
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto provider = std::make_unique<FuseDelayedFileDataProvider>(temp_file.path, kBlockSize,
+                                                               std::chrono::microseconds(200));
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, &pid));
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  auto start = std::chrono::steady_clock::now();
+  std::string content_via_fuse;
+  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(content, content_via_fuse);
+
+  double mib_per_second = kFileSize / (1024.0 * 1024.0) / elapsed.count();
+  RecordProperty("throughput_mib_per_second", std::to_string(mib_per_second));
+
+  StopFuseSideload(mount_point.path, pid);
+}
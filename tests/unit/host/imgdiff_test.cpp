@@ -383,6 +383,56 @@ TEST(ImgdiffTest, image_mode_simple) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgpatchTest, image_mode_multiple_deflate_chunks) {
+  std::string gzipped_source;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_source"), &gzipped_source));
+  std::string gzipped_target;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_target"), &gzipped_target));
+
+  // Several independent deflate chunks, separated by raw data, so that they are applied in
+  // parallel and the outputs have to be put back in order.
+  std::string src;
+  std::string tgt;
+  for (char c = 'a'; c < 'i'; c++) {
+    src += std::string(100, c) + gzipped_source;
+    tgt += std::string(101, c) + gzipped_target;
+  }
+
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  size_t num_deflate;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate);
+  ASSERT_EQ(8U, num_deflate);
+
+  verify_patched_image(src, patch, tgt);
+
+  // A failing sink stops the patching, and nothing is written after the failure.
+  size_t calls = 0;
+  size_t calls_after_failure = 0;
+  ASSERT_EQ(-1, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                                reinterpret_cast<const unsigned char*>(patch.data()), patch.size(),
+                                [&](const unsigned char* /*data*/, size_t len) -> size_t {
+                                  if (++calls > 3) {
+                                    calls_after_failure++;
+                                    return 0;
+                                  }
+                                  return len;
+                                }));
+  ASSERT_EQ(1U, calls_after_failure);
+}
+
 TEST(ImgdiffTest, image_mode_bad_gzip) {
   // Modify the uncompressed length in the gzip footer.
   const std::vector<char> src_data = { 'a',    'b',    'c',    'd',    'e',    'f',    'g',
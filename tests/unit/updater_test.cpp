@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -620,6 +621,72 @@ TEST_F(UpdaterTest, read_file) {
   expect("", script, kNoCause);
 }
 
+TEST_F(UpdaterTest, range_sha1) {
+  // Spans several hashing chunks, with the ranges out of order.
+  std::string data;
+  for (size_t i = 0; i < 600; i++) {
+    data += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(data, image_file_));
+
+  std::string expected = GetSha1(data.substr(300 * 4096, 300 * 4096) + data.substr(0, 10 * 4096));
+  std::string script = "range_sha1(\""s + image_file_ + "\", \"4,300,600,0,10\")";
+  expect(expected.c_str(), script, kNoCause, &updater_);
+  // A repeated lookup returns the same result.
+  expect(expected.c_str(), script, kNoCause, &updater_);
+
+  // Rewriting the image invalidates the previous result.
+  std::string new_data = data + std::string(4096, 'z');
+  std::fill_n(new_data.begin() + 300 * 4096, 4096, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(new_data, image_file_));
+  expected = GetSha1(new_data.substr(300 * 4096, 300 * 4096) + new_data.substr(0, 10 * 4096));
+  expect(expected.c_str(), script, kNoCause, &updater_);
+
+  // Out-of-bounds ranges fail to read.
+  script = "range_sha1(\""s + image_file_ + "\", \"2,600,1000\")";
+  expect(nullptr, script, kFreadFailure, &updater_);
+}
+
+TEST_F(UpdaterTest, range_sha1_and_verify_after_write_value) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "1",
+    "0",
+    "0",
+    "move " + GetSha1(block1) + " 2,1,2 1 2,0,1",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block3, image_file_));
+  RunBlockImageUpdate(true, entries, image_file_, "t");
+  std::string script = "range_sha1(\""s + image_file_ + "\", \"2,0,2\")";
+  expect(GetSha1(block1 + block3).c_str(), script, kNoCause);
+
+  // Rewrite the image through write_value and put back its mtime. The size and mtime are the
+  // same as before, so only the updater's own bookkeeping can tell that the contents changed.
+  struct stat sb;
+  ASSERT_EQ(0, stat(image_file_.c_str(), &sb));
+  expect("t", "write_value(\"" + block2 + block3 + "\", \"" + image_file_ + "\")", kNoCause);
+  struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+  ASSERT_EQ(0, utimensat(AT_FDCWD, image_file_.c_str(), times, 0));
+
+  expect(GetSha1(block2 + block3).c_str(), script, kNoCause);
+  // Neither the source nor the target of the move match any more, so the verification has to
+  // run again and fail rather than reuse the earlier result.
+  RunBlockImageUpdate(true, entries, image_file_, "");
+}
+
 TEST_F(UpdaterTest, compute_hash_tree_smoke) {
   std::string data;
   for (unsigned char i = 0; i < 128; i++) {
@@ -1142,6 +1209,51 @@ TEST_F(UpdaterTest, last_command_update) {
   ASSERT_EQ(block1 + block2 + block1, updated_contents);
 }
 
+TEST_F(UpdaterTest, stash_in_memory) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block1_hash = GetSha1(block1);
+  std::string block2_hash = GetSha1(block2);
+
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "2",
+    "0",
+    "2",
+    "stash " + block1_hash + " 2,0,1",
+    "stash " + block2_hash + " 2,1,2",
+    "zero 2,1,2",
+    "abort",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  std::string stash_base =
+      std::string(temp_stash_base_.path) + "/" + GetSha1(image_file_) + "/";
+
+  // Only the stash whose source got overwritten is written to disk.
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "");
+  ASSERT_EQ(-1, access((stash_base + block1_hash).c_str(), F_OK));
+  ASSERT_EQ(0, access((stash_base + block2_hash).c_str(), F_OK));
+
+  // With no memory budget, every stash goes to disk.
+  ASSERT_TRUE(android::base::RemoveFileIfExists(last_command_file_));
+  ASSERT_TRUE(android::base::RemoveFileIfExists(stash_base + block2_hash));
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, image_file_));
+  ASSERT_TRUE(android::base::SetProperty("recovery.updater.stash_ram_mb", "0"));
+  RunBlockImageUpdate(false, entries, image_file_, "");
+  ASSERT_TRUE(android::base::SetProperty("recovery.updater.stash_ram_mb", ""));
+  ASSERT_EQ(0, access((stash_base + block1_hash).c_str(), F_OK));
+  ASSERT_EQ(0, access((stash_base + block2_hash).c_str(), F_OK));
+}
+
 TEST_F(UpdaterTest, last_command_update_unresumable) {
   std::string block1(4096, '1');
   std::string block2(4096, '2');
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <atomic>
 #include <string>
 #include <unistd.h>
 #include <vector>
@@ -33,6 +34,7 @@
 #include <sys/reboot.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/vfs.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -47,9 +49,13 @@
 #include <selinux/label.h>
 #include <android-base/properties.h>
 #include <thread>
+#include <unordered_map>
+#include <pthread.h>
 #include <android-base/chrono_utils.h>
 
 #include "twrp-functions.hpp"
+#include "direnum.hpp"
+#include "twrpCrypt.hpp"
 #include "orangefox.hpp"
 #include "abx-functions.hpp"
 #include "twcommon.h"
@@ -598,6 +604,35 @@ Archive_Type TWFunc::Get_File_Type(string fn)
   return UNCOMPRESSED;		// default
 }
 
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+// Classifies the first decrypted bytes of a backup file, see Try_Decrypting_File
+static int Decrypted_File_Type(const string & fn, const uint8_t * data, size_t len)
+{
+  if (len < 2)
+    {
+      LOGINFO("Successfully decrypted '%s' but read length too small.\n",
+	      fn.c_str());
+      return 1;			// Decrypted successfully
+    }
+  if ((data[0] & 0xff) == 0x1f && (data[1] & 0xff) == 0x8b)
+    {
+      LOGINFO("Successfully decrypted '%s' and file is compressed.\n",
+	      fn.c_str());
+      return 3;			// Compressed
+    }
+
+  if (len >= 262 && strncmp((const char *) data + 257, "ustar", 5) == 0)
+    {
+      LOGINFO("Successfully decrypted '%s' and file is tar format.\n",
+	      fn.c_str());
+      return 2;			// Tar
+    }
+  LOGINFO("No errors decrypting '%s' but no known file format.\n",
+	  fn.c_str());
+  return 1;			// Decrypted successfully
+}
+#endif
+
 int TWFunc::Try_Decrypting_File(string fn, string password)
 {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
@@ -606,13 +641,45 @@ int TWFunc::Try_Decrypting_File(string fn, string password)
   FILE *f;
   uint8_t buffer[4096];
   uint8_t *buffer_out = NULL;
-  uint8_t *ptr = NULL;
   size_t read_len = 0, out_len = 0;
-  int firstbyte = 0, secondbyte = 0;
   size_t _j = 0;
   size_t _key_data_len = 0;
+  int ret;
 
-  // mostly kanged from OpenAES oaes.c
+  f = fopen(fn.c_str(), "rb");
+  if (f == NULL)
+    {
+      LOGERR("Failed to open '%s' to try decrypt: %s\n", fn.c_str(),
+	     strerror(errno));
+      return -1;
+    }
+  read_len = fread(buffer, sizeof(uint8_t), 4096, f);
+  fclose(f);
+  if (read_len <= 0)
+    {
+      LOGERR("Read size during try decrypt failed: %s\n", strerror(errno));
+      return -1;
+    }
+
+  if (!twrpCrypt::Is_Legacy(buffer, read_len))
+    {
+      std::vector<unsigned char> head;
+
+      ret = twrpCrypt::Decrypt_Head(fn, password, head);
+      if (ret < 0)
+	{
+	  LOGERR("Unable to read encrypted backup header of '%s'\n", fn.c_str());
+	  return -1;
+	}
+      if (ret == 0)
+	{
+	  LOGERR("Failed to decrypt file '%s'\n", fn.c_str());
+	  return 0;
+	}
+      return Decrypted_File_Type(fn, head.empty() ? NULL : &head[0], head.size());
+    }
+
+  // Legacy openaes archive, mostly kanged from OpenAES oaes.c
   for (_j = 0; _j < 32; _j++)
     _key_data[_j] = _j + 1;
   _key_data_len = password.size();
@@ -633,27 +700,10 @@ int TWFunc::Try_Decrypting_File(string fn, string password)
 
   oaes_key_import_data(ctx, _key_data, _key_data_len);
 
-  f = fopen(fn.c_str(), "rb");
-  if (f == NULL)
-    {
-      LOGERR("Failed to open '%s' to try decrypt: %s\n", fn.c_str(),
-	     strerror(errno));
-      oaes_free(&ctx);
-      return -1;
-    }
-  read_len = fread(buffer, sizeof(uint8_t), 4096, f);
-  if (read_len <= 0)
-    {
-      LOGERR("Read size during try decrypt failed: %s\n", strerror(errno));
-      fclose(f);
-      oaes_free(&ctx);
-      return -1;
-    }
   if (oaes_decrypt(ctx, buffer, read_len, NULL, &out_len) != OAES_RET_SUCCESS)
     {
       LOGERR
 	("Error: Failed to retrieve required buffer size for trying decryption.\n");
-      fclose(f);
       oaes_free(&ctx);
       return -1;
     }
@@ -661,7 +711,6 @@ int TWFunc::Try_Decrypting_File(string fn, string password)
   if (buffer_out == NULL)
     {
       LOGERR("Failed to allocate output buffer for try decrypt.\n");
-      fclose(f);
       oaes_free(&ctx);
       return -1;
     }
@@ -669,47 +718,14 @@ int TWFunc::Try_Decrypting_File(string fn, string password)
       OAES_RET_SUCCESS)
     {
       LOGERR("Failed to decrypt file '%s'\n", fn.c_str());
-      fclose(f);
       free(buffer_out);
       oaes_free(&ctx);
       return 0;
     }
-  fclose(f);
   oaes_free(&ctx);
-  if (out_len < 2)
-    {
-      LOGINFO("Successfully decrypted '%s' but read length too small.\n",
-	      fn.c_str());
-      free(buffer_out);
-      return 1;			// Decrypted successfully
-    }
-  ptr = buffer_out;
-  firstbyte = *ptr & 0xff;
-  ptr++;
-  secondbyte = *ptr & 0xff;
-  if (firstbyte == 0x1f && secondbyte == 0x8b)
-    {
-      LOGINFO("Successfully decrypted '%s' and file is compressed.\n",
-	      fn.c_str());
-      free(buffer_out);
-      return 3;			// Compressed
-    }
-
-  if (out_len >= 262)
-    {
-      ptr = buffer_out + 257;
-      if (strncmp((char *) ptr, "ustar", 5) == 0)
-	{
-	  LOGINFO("Successfully decrypted '%s' and file is tar format.\n",
-		  fn.c_str());
-	  free(buffer_out);
-	  return 2;		// Tar
-	}
-    }
+  ret = Decrypted_File_Type(fn, buffer_out, out_len);
   free(buffer_out);
-  LOGINFO("No errors decrypting '%s' but no known file format.\n",
-	  fn.c_str());
-  return 1;			// Decrypted successfully
+  return ret;
 #else
   LOGERR("Encrypted backup support not included.\n");
   return -1;
@@ -1042,7 +1058,7 @@ void TWFunc::Update_Intent_File(string Intent)
 // reboot: Reboot the system. Return -1 on error, no return on success
 int TWFunc::tw_reboot(RebootCommand command)
 {
-	DataManager::Flush();
+	DataManager::FlushAndWait();
 	Update_Log_File();
 
 	// Always force a sync before we reboot
@@ -1120,62 +1136,43 @@ void TWFunc::check_and_run_script(const char *script_file,
     }
 }
 
-int TWFunc::removeDir(const string path, bool skipParent)
+void TWFunc::Show_Remove_Progress(uint64_t removed)
 {
-  DIR *d = opendir(path.c_str());
-  int r = 0;
-  string new_path;
+  char progress[64];
 
-  if (d == NULL)
-    {
-      gui_msg(Msg
-	      (msg::kError,
-	       "error_opening_strerr=Error opening: '{1}' ({2})") (path)
-	      (strerror(errno)));
-      return -1;
-    }
+  snprintf(progress, sizeof(progress), gui_lookup("files_removed", "%llu files removed").c_str(), (unsigned long long) removed);
+  DataManager::SetValue("tw_file_progress", progress);
+}
 
-  if (d)
+int TWFunc::removeDir(const string path, bool skipParent)
+{
+  static std::atomic<int> active_removes(0);
+  string error_path;
+
+  // Only the outermost removal shows progress, so a removeDir made while
+  // another one is running doesn't clear its count.
+  bool top_level = active_removes++ == 0;
+
+  // Directories are emptied in parallel by a worker pool, with unlinkat
+  // relative to each directory's fd
+  int r = TWDirEnum::Remove_Tree(path, !skipParent, TWDirEnum::Remove_Filter(),
+				 top_level ? Show_Remove_Progress : TWDirEnum::Remove_Progress(),
+				 &error_path);
+  int err = errno;
+  active_removes--;
+  if (top_level)
+    DataManager::SetValue("tw_file_progress", "");
+  if (r != 0)
     {
-      struct dirent *p;
-      while (!r && (p = readdir(d)))
-	{
-	  if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-	    continue;
-	  new_path = path + "/";
-	  new_path.append(p->d_name);
-	  if (p->d_type == DT_DIR)
-	    {
-	      r = removeDir(new_path, true);
-	      if (!r)
-		{
-		  if (p->d_type == DT_DIR)
-		    r = rmdir(new_path.c_str());
-		  else
-		    LOGINFO("Unable to removeDir '%s': %s\n",
-			    new_path.c_str(), strerror(errno));
-		}
-	    }
-	  else if (p->d_type == DT_REG || p->d_type == DT_LNK
-		   || p->d_type == DT_FIFO || p->d_type == DT_SOCK)
-	    {
-	      r = unlink(new_path.c_str());
-	      if (r != 0)
-		{
-		  LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(),
-			  strerror(errno));
-		}
-	    }
-	}
-      closedir(d);
-
-      if (!r)
-	{
-	  if (skipParent)
-	    return 0;
-	  else
-	    r = rmdir(path.c_str());
-	}
+      if (error_path == path)
+	gui_msg(Msg
+		(msg::kError,
+		 "error_opening_strerr=Error opening: '{1}' ({2})") (path)
+		(strerror(err)));
+      else
+	LOGINFO("Unable to removeDir '%s': %s\n", error_path.c_str(),
+		strerror(err));
+      errno = err;
     }
   return r;
 }
@@ -1373,113 +1370,185 @@ string TWFunc::Get_Current_Date()
   return Current_Date;
 }
 
-string TWFunc::System_Property_Get(string Prop_Name) {
-	return System_Property_Get(Prop_Name, PartitionManager, PartitionManager.Get_Android_Root_Path(), "build.prop");
+// Parsed prop files, keyed by path. An entry is reused while the file's
+// identity, size and mtime are unchanged. For a partition that isn't
+// mounted it's reused without mounting only if the partition hasn't been
+// unmounted, wiped, restored or flashed through us since it was read and
+// its block device hasn't seen a single sector written, which also
+// catches scripts that mount it behind our back.
+struct prop_file_index {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	unsigned generation;
+	unsigned epoch;
+	bool stamped;
+	unsigned long long sectors_written;
+	std::unordered_map<string, string> props;
+};
+
+static pthread_mutex_t prop_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<string, prop_file_index> prop_cache;
+static std::unordered_map<string, unsigned> prop_generation;	// per root mount point
+static unsigned prop_epoch;										// bumped for every partition at once
+
+static bool Prop_Index_Current(const prop_file_index& index, const struct stat& st) {
+	return index.dev == st.st_dev && index.ino == st.st_ino && index.size == st.st_size
+		&& index.mtime.tv_sec == st.st_mtim.tv_sec && index.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// Looks Prop_Name up in prop_file, (re)parsing it if it changed. Returns
+// false with errno set if the file can't be read. Called with
+// prop_cache_lock held.
+static bool Prop_Index_Get(const string& prop_file, const string& Prop_Name, string& value) {
+	struct stat st;
+	if (stat(prop_file.c_str(), &st) != 0)
+		return false;
+	std::unordered_map<string, prop_file_index>::iterator it = prop_cache.find(prop_file);
+	if (it == prop_cache.end() || !Prop_Index_Current(it->second, st)) {
+		std::vector<string> lines;
+		if (TWFunc::read_file(prop_file, lines) != 0) {
+			prop_cache.erase(prop_file);
+			return false;
+		}
+		prop_file_index index;
+		index.dev = st.st_dev;
+		index.ino = st.st_ino;
+		index.size = st.st_size;
+		index.mtime = st.st_mtim;
+		index.generation = 0;
+		index.epoch = 0;
+		index.stamped = false;
+		index.sectors_written = 0;
+		index.props.reserve(lines.size());
+		// Same rules as the old line scan: the first line for a name wins,
+		// and a line without '=' is its own name and value.
+		for (size_t i = 0; i < lines.size(); i++) {
+			size_t end_pos = lines[i].find('=');
+			if (end_pos == string::npos)
+				index.props.emplace(lines[i], lines[i]);
+			else
+				index.props.emplace(lines[i].substr(0, end_pos), lines[i].substr(end_pos + 1));
+		}
+		it = prop_cache.insert_or_assign(prop_file, std::move(index)).first;
+	}
+	std::unordered_map<string, string>::const_iterator prop = it->second.props.find(Prop_Name);
+	value = prop != it->second.props.end() ? prop->second : string();
+	return true;
 }
 
-string TWFunc::System_Property_Get(string Prop_Name, TWPartitionManager &PartitionManager, string Mount_Point, string prop_file_name) {
+// Reads the sectors written counter of the block device behind
+// Mount_Point from sysfs.
+static bool Prop_Device_Writes(TWPartitionManager &PartitionManager, const string& Mount_Point, unsigned long long& sectors) {
+	TWPartition* Part = PartitionManager.Find_Partition_By_Path(Mount_Point);
+	struct stat st;
+	if (!Part || Part->Actual_Block_Device.empty() || stat(Part->Actual_Block_Device.c_str(), &st) != 0 || !S_ISBLK(st.st_mode))
+		return false;
+	char stat_path[64];
+	snprintf(stat_path, sizeof(stat_path), "/sys/dev/block/%u:%u/stat", major(st.st_rdev), minor(st.st_rdev));
+	FILE* fp = fopen(stat_path, "r");
+	if (!fp)
+		return false;
+	// Fields are reads, reads merged, sectors read, ms reading, writes,
+	// writes merged, sectors written, ...
+	unsigned long long field[7];
+	bool ret = fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu", &field[0], &field[1], &field[2],
+		&field[3], &field[4], &field[5], &field[6]) == 7;
+	fclose(fp);
+	if (ret)
+		sectors = field[6];
+	return ret;
+}
+
+static string Partition_Property_Get(TWPartitionManager &PartitionManager, const string& Mount_Point, const string& prop_file,
+		const string& prop_file_name, const string& Prop_Name, bool Display_Error) {
+	string root = TWFunc::Get_Root_Path(Mount_Point);
 	bool mount_state = PartitionManager.Is_Mounted_By_Path(Mount_Point);
-	std::vector<string> buildprop;
 	string propvalue;
-	if (!PartitionManager.Mount_By_Path(Mount_Point, true))
+
+	unsigned long long sectors_written = 0;
+	if (!mount_state && Prop_Device_Writes(PartitionManager, Mount_Point, sectors_written)) {
+		pthread_mutex_lock(&prop_cache_lock);
+		std::unordered_map<string, prop_file_index>::const_iterator it = prop_cache.find(prop_file);
+		if (it != prop_cache.end() && it->second.stamped && it->second.sectors_written == sectors_written
+				&& it->second.generation == prop_generation[root] && it->second.epoch == prop_epoch) {
+			std::unordered_map<string, string>::const_iterator prop = it->second.props.find(Prop_Name);
+			if (prop != it->second.props.end())
+				propvalue = prop->second;
+			pthread_mutex_unlock(&prop_cache_lock);
+			return propvalue;
+		}
+		pthread_mutex_unlock(&prop_cache_lock);
+	}
+
+	if (!PartitionManager.Mount_By_Path(Mount_Point, Display_Error))
 		return propvalue;
-	string prop_file = Mount_Point + "/system/" + prop_file_name;
 	if (!TWFunc::Path_Exists(prop_file)) {
 		LOGINFO("Unable to locate file: %s\n", prop_file.c_str());
-		return propvalue;
-	}
-	if (TWFunc::read_file(prop_file, buildprop) != 0) {
-		LOGINFO("Unable to open %s for getting '%s'.\n", prop_file_name.c_str(), Prop_Name.c_str());
-		DataManager::SetValue(TW_BACKUP_NAME, Get_Current_Date());
 		if (!mount_state)
 			PartitionManager.UnMount_By_Path(Mount_Point, false);
 		return propvalue;
 	}
-	int line_count = buildprop.size();
-	int index;
-	size_t start_pos = 0, end_pos;
-	string propname;
-	for (index = 0; index < line_count; index++) {
-		end_pos = buildprop.at(index).find("=", start_pos);
-		propname = buildprop.at(index).substr(start_pos, end_pos);
-		if (propname == Prop_Name) {
-			propvalue = buildprop.at(index).substr(end_pos + 1, buildprop.at(index).size());
-			if (!mount_state)
-				PartitionManager.UnMount_By_Path(Mount_Point, false);
-			return propvalue;
-		}
+	pthread_mutex_lock(&prop_cache_lock);
+	bool found = Prop_Index_Get(prop_file, Prop_Name, propvalue);
+	pthread_mutex_unlock(&prop_cache_lock);
+	if (!found) {
+		LOGINFO("Unable to open %s for getting '%s'.\n", prop_file_name.c_str(), Prop_Name.c_str());
+		DataManager::SetValue(TW_BACKUP_NAME, TWFunc::Get_Current_Date());
 	}
 	if (!mount_state)
 		PartitionManager.UnMount_By_Path(Mount_Point, false);
+
+	// Stamp the entry after our own unmount so that only later changes
+	// to the partition send the next lookup back to the file. A partition
+	// that was mounted when we read it isn't stamped; it can change at any
+	// time and the next unmounted lookup has to read it again.
+	bool stamped = !mount_state && Prop_Device_Writes(PartitionManager, Mount_Point, sectors_written);
+	pthread_mutex_lock(&prop_cache_lock);
+	std::unordered_map<string, prop_file_index>::iterator it = prop_cache.find(prop_file);
+	if (found && it != prop_cache.end()) {
+		it->second.generation = prop_generation[root];
+		it->second.epoch = prop_epoch;
+		it->second.stamped = stamped;
+		it->second.sectors_written = sectors_written;
+	}
+	pthread_mutex_unlock(&prop_cache_lock);
 	return propvalue;
 }
 
+void TWFunc::Invalidate_Property_Cache(const string& Mount_Point) {
+	pthread_mutex_lock(&prop_cache_lock);
+	if (Mount_Point.empty())
+		prop_epoch++;
+	else
+		prop_generation[Get_Root_Path(Mount_Point)]++;
+	pthread_mutex_unlock(&prop_cache_lock);
+}
+
+string TWFunc::System_Property_Get(string Prop_Name) {
+	return System_Property_Get(Prop_Name, PartitionManager, PartitionManager.Get_Android_Root_Path(), "build.prop");
+}
+
+string TWFunc::System_Property_Get(string Prop_Name, TWPartitionManager &PartitionManager, string Mount_Point, string prop_file_name) {
+	return Partition_Property_Get(PartitionManager, Mount_Point, Mount_Point + "/system/" + prop_file_name, prop_file_name, Prop_Name, true);
+}
+
 string TWFunc::Product_Property_Get(string Prop_Name) {
 	return Product_Property_Get(Prop_Name, PartitionManager, "product", "build.prop");
 }
 
 string TWFunc::Product_Property_Get(string Prop_Name, TWPartitionManager &PartitionManager, string Mount_Point, string prop_file_name) {
-	bool mount_state = PartitionManager.Is_Mounted_By_Path(Mount_Point);
-	std::vector<string> buildprop;
-	string propvalue;
-	if (!PartitionManager.Mount_By_Path(Mount_Point, false))
-		return propvalue;
-	string prop_file = Mount_Point + "/etc/" + prop_file_name;
-	if (!TWFunc::Path_Exists(prop_file)) {
-		LOGINFO("Unable to locate file: %s\n", prop_file.c_str());
-		return propvalue;
-	}
-	if (TWFunc::read_file(prop_file, buildprop) != 0) {
-		LOGINFO("Unable to open %s for getting '%s'.\n", prop_file_name.c_str(), Prop_Name.c_str());
-		DataManager::SetValue(TW_BACKUP_NAME, Get_Current_Date());
-		if (!mount_state)
-			PartitionManager.UnMount_By_Path(Mount_Point, false);
-		return propvalue;
-	}
-	int line_count = buildprop.size();
-	int index;
-	size_t start_pos = 0, end_pos;
-	string propname;
-	for (index = 0; index < line_count; index++) {
-		end_pos = buildprop.at(index).find("=", start_pos);
-		propname = buildprop.at(index).substr(start_pos, end_pos);
-		if (propname == Prop_Name) {
-			propvalue = buildprop.at(index).substr(end_pos + 1, buildprop.at(index).size());
-			if (!mount_state)
-				PartitionManager.UnMount_By_Path(Mount_Point, false);
-			return propvalue;
-		}
-	}
-	if (!mount_state)
-		PartitionManager.UnMount_By_Path(Mount_Point, false);
-	return propvalue;
+	return Partition_Property_Get(PartitionManager, Mount_Point, Mount_Point + "/etc/" + prop_file_name, prop_file_name, Prop_Name, false);
 }
 
 string TWFunc::File_Property_Get(string File_Path, string Prop_Name)
 {
-  std::vector < string > buildprop;
   string propvalue;
-  string prop_file = File_Path;
-  if (TWFunc::read_file(prop_file, buildprop) != 0)
-    {
-      return propvalue;
-    }
-  int line_count = buildprop.size();
-  int index;
-  size_t start_pos = 0, end_pos;
-  string propname;
-  for (index = 0; index < line_count; index++)
-    {
-      end_pos = buildprop.at(index).find("=", start_pos);
-      propname = buildprop.at(index).substr(start_pos, end_pos);
-      if (propname == Prop_Name)
-	{
-	  propvalue =
-	    buildprop.at(index).substr(end_pos + 1,
-				       buildprop.at(index).size());
-	  return propvalue;
-	}
-    }
+  pthread_mutex_lock(&prop_cache_lock);
+  if (!Prop_Index_Get(File_Path, Prop_Name, propvalue))
+    propvalue.clear();
+  pthread_mutex_unlock(&prop_cache_lock);
   return propvalue;
 }
 
@@ -27,6 +27,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include "gui/twmsg.h"
 
 #include "cutils/properties.h"
@@ -61,6 +62,7 @@ extern "C" {
 #include "openrecoveryscript.hpp"
 #include "variables.h"
 #include "startupArgs.hpp"
+#include "startupTrace.hpp"
 #include "twrpAdbBuFifo.hpp"
 #ifdef TW_USE_NEW_MINADBD
 // #include "minadbd/minadbd.h"
@@ -115,6 +117,41 @@ static void Decrypt_Page(bool SkipDecryption, bool datamedia) {
 	}
 }
 
+#ifdef TW_LOAD_VENDOR_MODULES
+static pthread_t ramdisk_modules_thread;
+static bool ramdisk_modules_started = false;
+
+static void* Load_Ramdisk_Modules_Thread(void* cookie __unused) {
+	startupSpan span("modules_ramdisk");
+	KernelModuleLoader::Load_Ramdisk_Modules();
+	return NULL;
+}
+
+// Ramdisk modules only need the ramdisk, so they load while the UI starts;
+// touch and display drivers are then usually in before the first page.
+static void Start_Ramdisk_Modules() {
+	ramdisk_modules_started = pthread_create(&ramdisk_modules_thread, NULL, Load_Ramdisk_Modules_Thread, NULL) == 0;
+	if (!ramdisk_modules_started)
+		LOGINFO("Unable to start ramdisk module thread, loading them with the vendor modules\n");
+}
+
+// Called before the fstab is processed, so it sees the same devices as
+// before and Load_Vendor_Modules doesn't race the ramdisk load.
+static void Wait_Ramdisk_Modules() {
+	if (ramdisk_modules_started) {
+		pthread_join(ramdisk_modules_thread, NULL);
+		ramdisk_modules_started = false;
+	}
+}
+#endif
+
+// The boot trace is only written when asked for with
+// "twrp set tw_boot_trace 1"; it is a debugging aid.
+static void Write_Boot_Trace() {
+	if (DataManager::GetIntValue("tw_boot_trace") != 0)
+		startupTrace::Write(STARTUP_TRACE_FILE);
+}
+
 static void process_fastbootd_mode() {
 		LOGINFO("starting fastboot\n");
 
@@ -133,7 +170,10 @@ static void process_fastbootd_mode() {
 		TWPartition* ven = PartitionManager.Find_Partition_By_Path("/vendor");
 		PartitionManager.Setup_Super_Devices();
 		PartitionManager.Prepare_Super_Volume(ven);
-		KernelModuleLoader::Load_Vendor_Modules();
+		{
+			startupSpan span("modules");
+			KernelModuleLoader::Load_Vendor_Modules();
+		}
 		if (android::base::GetBoolProperty("ro.virtual_ab.enabled", false)) {
 			PartitionManager.Unmap_Super_Devices();
 		}
@@ -144,6 +184,7 @@ static void process_fastbootd_mode() {
 		property_set("ro.boot.verifiedbootstate", "orange");
 		TWFunc::RunFoxScript("/system/bin/runatboot.sh", "");
 		TWFunc::RunFoxScript("/system/bin/postrecoveryboot.sh", "");
+		Write_Boot_Trace();
 		if (gui_startPage("fastboot", 1, 1) != 0) {
 			LOGERR("Failed to start fastbootd page.\n");
 		}
@@ -177,20 +218,28 @@ static void process_recovery_mode(twrpAdbBuFifo* adb_bu_fifo, bool skip_decrypti
 		fstab_filename = "/etc/recovery.fstab";
 	}
 	printf("=> Processing %s\n", fstab_filename.c_str());
-	if (!PartitionManager.Process_Fstab(fstab_filename, 1, true)) {
-		LOGERR("Failing out of recovery due to problem with fstab.\n");
-		return;
-	}
+	{
+		startupSpan span("fstab");
+		if (!PartitionManager.Process_Fstab(fstab_filename, 1, true)) {
+			LOGERR("Failing out of recovery due to problem with fstab.\n");
+			return;
+		}
 
-	// Set the props for OrangeFox dynamic partitions
-	PartitionManager.Fox_Set_Dynamic_Partition_Props(); // don't move this from here!
+		// Set the props for OrangeFox dynamic partitions
+		PartitionManager.Fox_Set_Dynamic_Partition_Props(); // don't move this from here!
+	}
 
 #ifdef TW_LOAD_VENDOR_MODULES
-	bool fastboot_mode = cmdline.find("twrpfastboot=1") != std::string::npos;
-	if (fastboot_mode)
-		KernelModuleLoader::Load_Vendor_Modules();
-	else
-		KernelModuleLoader::Load_Vendor_Modules();
+	{
+		// Mostly a no-op by now: the ramdisk modules went in while the
+		// UI was starting, this picks up the ones on /vendor.
+		startupSpan span("modules");
+		bool fastboot_mode = cmdline.find("twrpfastboot=1") != std::string::npos;
+		if (fastboot_mode)
+			KernelModuleLoader::Load_Vendor_Modules();
+		else
+			KernelModuleLoader::Load_Vendor_Modules();
+	}
 #endif
 
 // We are doing this here to allow super partition to be set up prior to overriding properties
@@ -252,11 +301,17 @@ static void process_recovery_mode(twrpAdbBuFifo* adb_bu_fifo, bool skip_decrypti
 #ifdef TW_INCLUDE_CRYPTO
 	android::keystore::copySqliteDb();
 #endif
-	Decrypt_Page(skip_decryption, datamedia);
+	{
+		startupSpan span("decrypt_page");
+		Decrypt_Page(skip_decryption, datamedia);
+	}
 
 	// Check for and load custom theme if present
-	TWFunc::check_selinux_support();
-	gui_loadCustomResources();
+	{
+		startupSpan span("custom_resources");
+		TWFunc::check_selinux_support();
+		gui_loadCustomResources();
+	}
 	PartitionManager.Output_Partition_Logging();
 
 	// Fixup the RTC clock on devices which require it
@@ -264,7 +319,10 @@ static void process_recovery_mode(twrpAdbBuFifo* adb_bu_fifo, bool skip_decrypti
 		TWFunc::Fixup_Time_On_Boot();
 
 	TWFunc::Update_Log_File();
-	DataManager::ReadSettingsFile();
+	{
+		startupSpan span("read_settings");
+		DataManager::ReadSettingsFile();
+	}
 
 	// Run any outstanding OpenRecoveryScript
 	std::string cacheDir = TWFunc::get_log_dir();
@@ -272,11 +330,15 @@ static void process_recovery_mode(twrpAdbBuFifo* adb_bu_fifo, bool skip_decrypti
 		cacheDir = "/data/cache";
 	std::string orsFile = cacheDir + "/recovery/openrecoveryscript";
 	if ((DataManager::GetIntValue(TW_IS_ENCRYPTED) == 0 || skip_decryption) && (TWFunc::Path_Exists(SCRIPT_FILE_TMP) || TWFunc::Path_Exists(orsFile))) {
+		startupSpan span("openrecoveryscript");
 		OpenRecoveryScript::Run_OpenRecoveryScript();
 	}
 
   	// call OrangeFox startup code
-  	TWFunc::OrangeFox_Startup();
+	{
+		startupSpan span("orangefox_startup");
+		TWFunc::OrangeFox_Startup();
+	}
   	
 #ifdef OF_ADVANCED_SECURITY
 	LOGINFO("ADB & MTP disabled by maintainer\n");
@@ -468,15 +530,32 @@ int main(int argc, char **argv) {
 	// refresh the specific device codename if we have a generic unified codename
 	TWFunc::Fox_Set_Current_Device_CodeName();
 
+#ifdef TW_LOAD_VENDOR_MODULES
+	Start_Ramdisk_Modules();
+#endif
+
 	// Load default values to set DataManager constants and handle ifdefs
-	DataManager::SetDefaultValues();
+	{
+		startupSpan span("defaults");
+		DataManager::SetDefaultValues();
+	}
 
 	// start the UI
-	printf("Starting the UI...\n");
-	gui_init();
+	{
+		startupSpan span("gui_init");
+		printf("Starting the UI...\n");
+		gui_init();
+	}
 
 	// Load up all the resources
-	gui_loadResources();
+	{
+		startupSpan span("gui_resources");
+		gui_loadResources();
+	}
+
+#ifdef TW_LOAD_VENDOR_MODULES
+	Wait_Ramdisk_Modules();
+#endif
 
 	startupArgs startup;
 	startup.parse(&argc, &argv);
@@ -490,16 +569,23 @@ int main(int argc, char **argv) {
 		reboot();
 		return 0;
 	} else {
+		startupSpan span("recovery_mode");
 		process_recovery_mode(adb_bu_fifo, startup.Should_Skip_Decryption());
 	}
 
 	// Language
-	PageManager::LoadLanguage(DataManager::GetStrValue("tw_language"));
-	GUIConsole::Translate_Now();
+	{
+		startupSpan span("language");
+		PageManager::LoadLanguage(DataManager::GetStrValue("tw_language"));
+		GUIConsole::Translate_Now();
+	}
 
 	// Fox extra setup
   	TWFunc::Setup_Verity_Forced_Encryption();
 
+	// Everything up to the first interactive page
+	Write_Boot_Trace();
+
 	// Launch the main GUI
 	if (Fox_CheckReload_Themes()) {
 		//[f/d] Start UI using reapply_settings page (executed on recovery startup)
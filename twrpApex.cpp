@@ -56,12 +56,13 @@ bool twrpApex::loadApexImages() {
 	return true;
 }
 
-std::string twrpApex::unzipImage(std::string file) {
+bool twrpApex::findPayload(const std::string& file, twrpApexPayload& payload) {
 	ZipArchiveHandle handle;
 	int32_t ret = OpenArchive(file.c_str(), &handle);
 	if (ret != 0) {
 		LOGINFO("unable to open zip archive %s. Reason: %s\n", file.c_str(), strerror(errno));
-		return std::string();
+		CloseArchive(handle);
+		return false;
 	}
 
 	ZipEntry entry;
@@ -70,106 +71,207 @@ std::string twrpApex::unzipImage(std::string file) {
 	if (ret != 0) {
 		LOGERR("unable to find %s in zip\n", APEX_PAYLOAD);
 		CloseArchive(handle);
-		return std::string();
+		return false;
 	}
 
+	payload.apexFile = file;
+	payload.size = entry.uncompressed_length;
+	if (entry.method == kCompressStored)
+		payload.image = copyStoredImage(file, entry.offset, entry.uncompressed_length);
+	else
+		payload.image = unzipImage(file, handle, &entry);
+	CloseArchive(handle);
+	return !payload.image.empty();
+}
+
+std::string twrpApex::unzipImage(std::string file, ZipArchiveHandle handle, ZipEntry* entry) {
 	std::string baseFile = basename(file.c_str());
 	std::string path("/tmp/");
 	path = path + baseFile;
-	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
-	ret = ExtractEntryToFile(handle, &entry, fd);
+	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (fd < 0) {
+		LOGERR("unable to create %s. Reason: %s\n", path.c_str(), strerror(errno));
+		return std::string();
+	}
+	int32_t ret = ExtractEntryToFile(handle, entry, fd);
 	if (ret != 0) {
 		LOGERR("unable to extract %s\n", path.c_str());
 		close(fd);
-		CloseArchive(handle);
 		return std::string();
 	}
 
-	CloseArchive(handle);
 	close(fd);
 	return path;
 }
 
-bool twrpApex::mountApexOnLoopbackDevices(std::vector<std::string> apexFiles) {
-	int fd = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+// A stored payload is a plain byte range of the .apex, so the kernel can
+// copy it without inflating or passing it through a buffer.
+std::string twrpApex::copyStoredImage(const std::string& file, off64_t offset, off64_t size) {
+	std::string path("/tmp/");
+	path = path + basename(file.c_str());
+	int in_fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		LOGERR("unable to open %s. Reason: %s\n", file.c_str(), strerror(errno));
+		return std::string();
+	}
+	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
 	if (fd < 0) {
-		LOGERR("Unable to open %s device. Reason: %s\n", LOOP_CONTROL, strerror(errno));
-		return false;
+		LOGERR("unable to create %s. Reason: %s\n", path.c_str(), strerror(errno));
+		close(in_fd);
+		return std::string();
 	}
+	while (size > 0) {
+		ssize_t copied = sendfile64(fd, in_fd, &offset, size);
+		if (copied <= 0) {
+			LOGERR("unable to copy %s. Reason: %s\n", path.c_str(), copied < 0 ? strerror(errno) : "unexpected end of file");
+			close(in_fd);
+			close(fd);
+			unlink(path.c_str());
+			return std::string();
+		}
+		size -= copied;
+	}
+	close(in_fd);
+	close(fd);
+	return path;
+}
+
+void* twrpApex::mountApexThread(void* cookie) {
+	twrpApex* apex = (twrpApex*)cookie;
 
-	size_t device_no = 0;
-	for (auto&& apexFile:apexFiles) {
-		int num = ioctl(fd, LOOP_CTL_GET_FREE);
-		std::string loop_device = LOOP_BLOCK_DEVICE_DIR;
-		loop_device = loop_device + "loop" + std::to_string(num);
-		if (!TWFunc::Path_Exists(loop_device)) {
-			int ret = mknod(loop_device.c_str(), S_IFBLK | S_IRUSR | S_IWUSR , makedev(7, device_no));
-			if (ret != 0) {
-				LOGERR("Unable to create loop device: %s\n", loop_device.c_str());
-				return false;
-			}
+	for (;;) {
+		pthread_mutex_lock(&apex->queue_lock);
+		if (apex->queue.empty() || apex->failed) {
+			pthread_mutex_unlock(&apex->queue_lock);
+			break;
 		}
-		std::string fileToMount = unzipImage(apexFile);
-		if (fileToMount.empty()) {
+		std::string apexFile = apex->queue.back();
+		apex->queue.pop_back();
+		pthread_mutex_unlock(&apex->queue_lock);
+
+		twrpApexPayload payload;
+		if (!apex->findPayload(apexFile, payload)) {
 			LOGINFO("Skipping non-existent apex file: %s\n", apexFile.c_str());
 			continue;
 		}
-		bool load_result = loadApexImage(fileToMount, device_no);
-		if (!load_result) {
-			return false;
+		if (!apex->loadApexImage(payload)) {
+			pthread_mutex_lock(&apex->queue_lock);
+			apex->failed = true;
+			pthread_mutex_unlock(&apex->queue_lock);
 		}
-		device_no++;
 	}
-	return true;
+	return NULL;
+}
+
+bool twrpApex::mountApexOnLoopbackDevices(std::vector<std::string> apexFiles) {
+	loop_control_fd = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+	if (loop_control_fd < 0) {
+		LOGERR("Unable to open %s device. Reason: %s\n", LOOP_CONTROL, strerror(errno));
+		return false;
+	}
+
+	// Each apex is found, attached and mounted on its own worker; only
+	// picking a free loop device is serialized.
+	pthread_mutex_init(&loop_lock, NULL);
+	pthread_mutex_init(&queue_lock, NULL);
+	queue.assign(apexFiles.rbegin(), apexFiles.rend());
+	failed = false;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = cpus > 0 ? cpus : 1;
+	if (threads > APEX_MAX_THREADS)
+		threads = APEX_MAX_THREADS;
+	if (threads > apexFiles.size())
+		threads = apexFiles.size();
+	std::vector<pthread_t> workers;
+	for (size_t i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, mountApexThread, this) != 0)
+			break;
+		workers.push_back(thread);
+	}
+	mountApexThread(this);
+	for (auto&& thread:workers)
+		pthread_join(thread, NULL);
+
+	pthread_mutex_destroy(&queue_lock);
+	pthread_mutex_destroy(&loop_lock);
+	close(loop_control_fd);
+	loop_control_fd = -1;
+	return !failed;
 }
 
-bool twrpApex::loadApexImage(std::string fileToMount, size_t loop_device_number) {
+bool twrpApex::loadApexImage(const twrpApexPayload& payload) {
 	struct loop_info64 info;
 
-	int fd = open(fileToMount.c_str(), O_RDONLY | O_CLOEXEC);
+	int fd = open(payload.image.c_str(), O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
-		LOGERR("unable to open apex file: %s. Reason: %s\n", fileToMount.c_str(), strerror(errno));
+		LOGERR("unable to open apex file: %s. Reason: %s\n", payload.image.c_str(), strerror(errno));
 		return false;
 	}
 
-	std::string loop_device = "/dev/block/loop" + std::to_string(loop_device_number);
-	int loop_fd = open(loop_device.c_str(), O_RDONLY);
+	pthread_mutex_lock(&loop_lock);
+	int num = ioctl(loop_control_fd, LOOP_CTL_GET_FREE);
+	if (num < 0) {
+		LOGERR("Unable to find a free loop device. Reason: %s\n", strerror(errno));
+		pthread_mutex_unlock(&loop_lock);
+		close(fd);
+		return false;
+	}
+	std::string loop_device = LOOP_BLOCK_DEVICE_DIR;
+	loop_device = loop_device + "loop" + std::to_string(num);
+	if (!TWFunc::Path_Exists(loop_device)) {
+		int ret = mknod(loop_device.c_str(), S_IFBLK | S_IRUSR | S_IWUSR , makedev(7, num));
+		if (ret != 0) {
+			LOGERR("Unable to create loop device: %s\n", loop_device.c_str());
+			pthread_mutex_unlock(&loop_lock);
+			close(fd);
+			return false;
+		}
+	}
+
+	int loop_fd = open(loop_device.c_str(), O_RDONLY | O_CLOEXEC);
 	if (loop_fd < 0) {
 		LOGERR("unable to open loop device: %s\n", loop_device.c_str());
+		pthread_mutex_unlock(&loop_lock);
 		close(fd);
 		return false;
 	}
 
+	// Once bound, LOOP_CTL_GET_FREE hands the next worker another device.
 	if (ioctl(loop_fd, LOOP_SET_FD, fd) < 0) {
-		LOGERR("failed to mount %s to loop device %s. Reason: %s\n", fileToMount.c_str(), loop_device.c_str(), 
+		LOGERR("failed to mount %s to loop device %s. Reason: %s\n", payload.image.c_str(), loop_device.c_str(), 
 			strerror(errno));
+		pthread_mutex_unlock(&loop_lock);
 		close(fd);
 		close(loop_fd);
 		return false;
 	}
+	pthread_mutex_unlock(&loop_lock);
 
 	close(fd);
 
 	memset(&info, 0, sizeof(struct loop_info64));
 	strlcpy((char*)info.lo_crypt_name, "twrpApex", LO_NAME_SIZE);
-	off_t apex_size = lseek(fd, 0, SEEK_END);
-	info.lo_sizelimit = apex_size;
+	info.lo_sizelimit = payload.size;
 	if (ioctl(loop_fd, LOOP_SET_STATUS64, &info)) {
-		LOGERR("failed to mount loop: %s: %s\n", fileToMount.c_str(), strerror(errno));
+		LOGERR("failed to mount loop: %s: %s\n", payload.image.c_str(), strerror(errno));
+		ioctl(loop_fd, LOOP_CLR_FD, 0);
 		close(loop_fd);
 		return false;
 	}
 	if (ioctl(loop_fd, BLKFLSBUF, 0) == -1) {
 		LOGERR("Unable to flush loop device buffers\n");
+		ioctl(loop_fd, LOOP_CLR_FD, 0);
+		close(loop_fd);
 		return false;
 	}
 	if (ioctl(loop_fd, LOOP_SET_BLOCK_SIZE, 4096) == -1) {
 		LOGINFO("Failed to set DIRECT_IO buffer size\n");
 	}
-	close(loop_fd);
 
 	std::string bind_mount(APEX_BASE);
-	std::string apex_cleaned_mount = fileToMount;
+	std::string apex_cleaned_mount = payload.apexFile;
 	apex_cleaned_mount = std::regex_replace(apex_cleaned_mount, std::regex("\\.apex"), "");
 
 	bind_mount = bind_mount + basename(apex_cleaned_mount.c_str());
@@ -177,15 +279,20 @@ bool twrpApex::loadApexImage(std::string fileToMount, size_t loop_device_number)
 	int ret = mkdir(bind_mount.c_str(), 0666);
 	if (ret != 0) {
 		LOGERR("Unable to create bind mount directory: %s\n", bind_mount.c_str());
+		ioctl(loop_fd, LOOP_CLR_FD, 0);
+		close(loop_fd);
 		return false;
 	}
 
 	ret = mount(loop_device.c_str(), bind_mount.c_str(), "ext4", MS_RDONLY, nullptr);
 	if (ret != 0) {
 		LOGERR("unable to mount loop device %s to %s. Reason: %s\n", loop_device.c_str(), bind_mount.c_str(), strerror(errno));
+		ioctl(loop_fd, LOOP_CLR_FD, 0);
+		close(loop_fd);
 		return false;
 	}
 
+	close(loop_fd);
 	return true;
 }
 
@@ -14,7 +14,9 @@
 #include <linux/loop.h>
 #include <sys/mount.h>
 #include <sys/sysmacros.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <android-base/properties.h>
 
@@ -26,6 +28,15 @@
 #define LOOP_BLOCK_DEVICE_DIR "/dev/block/"
 #define APEX_BASE "/apex/"
 #define LOOP_CONTROL "/dev/loop-control"
+#define APEX_MAX_THREADS 4
+
+// The ext4 payload of an apex, copied to /tmp so the loop device doesn't
+// keep /system_root busy when it is unmounted after startup.
+struct twrpApexPayload {
+	std::string apexFile;
+	std::string image;
+	off64_t size;
+};
 
 class twrpApex {
 public:
@@ -33,8 +44,17 @@ public:
 	bool Unmount();
 
 private:
-	std::string unzipImage(std::string file);
+	static void* mountApexThread(void* cookie);
+	bool findPayload(const std::string& file, twrpApexPayload& payload);
+	std::string unzipImage(std::string file, ZipArchiveHandle handle, ZipEntry* entry);
+	std::string copyStoredImage(const std::string& file, off64_t offset, off64_t size);
 	bool mountApexOnLoopbackDevices(std::vector<std::string> apexFiles);
-	bool loadApexImage(std::string fileToMount, size_t loop_device_number);
+	bool loadApexImage(const twrpApexPayload& payload);
+
+	int loop_control_fd;
+	pthread_mutex_t loop_lock;			// held from LOOP_CTL_GET_FREE until the device is bound
+	pthread_mutex_t queue_lock;
+	std::vector<std::string> queue;
+	bool failed;
 };
 #endif
@@ -0,0 +1,733 @@
+/*
+		Copyright 2026 TeamWin
+		This file is part of TWRP/TeamWin Recovery Project.
+
+		TWRP is free software: you can redistribute it and/or modify
+		it under the terms of the GNU General Public License as published by
+		the Free Software Foundation, either version 3 of the License, or
+		(at your option) any later version.
+
+		TWRP is distributed in the hope that it will be useful,
+		but WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+		GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License
+		along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "twrpCrypt.hpp"
+#include "twcommon.h"
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+#include <openssl/aead.h>
+#include <openssl/evp.h>
+#include <openssl/mem.h>
+#include <openssl/rand.h>
+#include "openaes/inc/oaes_lib.h"
+#endif
+
+// Version 2 header: "OAES" <version 0x02> <cipher> <2 reserved>
+// <chunk size, le32> <PBKDF2 iterations, le32> <16 byte salt>.
+// Each record is <plaintext length, le32> <flags, le32> <ciphertext + tag>,
+// sealed with the header and its own 8 byte prefix as associated data and
+// its sequence number as nonce, so records cannot be reordered, dropped
+// or cut off without the open failing.
+#define CRYPT_HEADER_LEN		32
+#define CRYPT_SALT_OFFSET		16
+#define CRYPT_SALT_LEN			16
+#define CRYPT_RECORD_LEN		8
+#define CRYPT_TAG_LEN			16
+#define CRYPT_NONCE_LEN			12
+#define CRYPT_KEY_LEN			32
+#define CRYPT_VERSION			0x02
+#define CRYPT_CIPHER_AES256_GCM	0x01
+#define CRYPT_FLAG_LAST			0x01
+#define CRYPT_CHUNK_SIZE		(256 * 1024)
+#define CRYPT_MAX_CHUNK_SIZE	(16 * 1024 * 1024)
+#define CRYPT_KDF_ITERATIONS	100000
+#define CRYPT_MAX_ITERATIONS	10000000
+#define CRYPT_MAX_WORKERS		4
+#define CRYPT_SLOTS_PER_WORKER	2
+
+// openaes enc reads 4064 byte blocks and writes each as its own 4096 byte
+// record (header, IV, CBC data), so records can be decrypted independently.
+#define OAES_LEGACY_RECORD		4096
+#define OAES_LEGACY_BATCH		64
+
+static const unsigned char crypt_magic[4] = { 'O', 'A', 'E', 'S' };
+
+// Reads until Len bytes or EOF; returns the count or -1.
+static ssize_t read_full(int fd, unsigned char* buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = read(fd, buf + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+bool twrpCrypt::Is_Legacy(const unsigned char* Header, size_t Len) {
+	return Len >= 5 && memcmp(Header, crypt_magic, sizeof(crypt_magic)) == 0 && Header[4] == 0x01;
+}
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+
+enum crypt_mode {
+	CRYPT_ENCRYPT,
+	CRYPT_DECRYPT,
+	CRYPT_DECRYPT_LEGACY
+};
+
+enum crypt_slot_state {
+	SLOT_FREE,
+	SLOT_READY,		// filled by the reader, waiting for a worker
+	SLOT_BUSY,
+	SLOT_DONE		// out holds the result, waiting for the writer
+};
+
+struct crypt_slot {
+	std::vector<unsigned char> in, out;
+	size_t in_len, out_len;
+	uint64_t index;
+	bool last;
+	int state;
+};
+
+struct twrpCryptPipeline {
+	crypt_mode mode;
+	int in_fd, out_fd;
+	std::string password;
+	unsigned char header[CRYPT_HEADER_LEN];
+	size_t prefix_len;					// legacy header bytes already read from in_fd
+	uint32_t chunk_size;
+	EVP_AEAD_CTX aead;
+	bool aead_ready;
+
+	std::vector<crypt_slot> slots;
+	uint64_t read_count;				// records handed to the workers so far
+	uint64_t next_work;
+	bool read_done;
+	int error;							// first errno, 0 while healthy
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t reader, writer;
+	bool reader_started, writer_started;
+	std::vector<pthread_t> workers;
+};
+
+static void put_le32(unsigned char* p, uint32_t v) {
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int write_full(int fd, const unsigned char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static unsigned crypt_workers() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		return 1;
+	return cpus > CRYPT_MAX_WORKERS ? CRYPT_MAX_WORKERS : cpus;
+}
+
+static bool check_header(const unsigned char* header) {
+	if (memcmp(header, crypt_magic, sizeof(crypt_magic)) != 0 || header[4] != CRYPT_VERSION || header[5] != CRYPT_CIPHER_AES256_GCM)
+		return false;
+	uint32_t chunk_size = get_le32(header + 8), iterations = get_le32(header + 12);
+	return chunk_size > 0 && chunk_size <= CRYPT_MAX_CHUNK_SIZE && iterations > 0 && iterations <= CRYPT_MAX_ITERATIONS;
+}
+
+static bool derive_key(const std::string& password, const unsigned char* header, EVP_AEAD_CTX* aead) {
+	unsigned char key[CRYPT_KEY_LEN];
+	bool ret = PKCS5_PBKDF2_HMAC(password.data(), password.size(), header + CRYPT_SALT_OFFSET, CRYPT_SALT_LEN,
+		get_le32(header + 12), EVP_sha256(), sizeof(key), key) == 1 &&
+		EVP_AEAD_CTX_init(aead, EVP_aead_aes_256_gcm(), key, sizeof(key), CRYPT_TAG_LEN, NULL) == 1;
+	OPENSSL_cleanse(key, sizeof(key));
+	return ret;
+}
+
+static void record_nonce(uint64_t index, unsigned char* nonce) {
+	memset(nonce, 0, CRYPT_NONCE_LEN);
+	put_le32(nonce + 4, index & 0xffffffff);
+	put_le32(nonce + 8, index >> 32);
+}
+
+static void record_ad(const unsigned char* header, const unsigned char* record, unsigned char* ad) {
+	memcpy(ad, header, CRYPT_HEADER_LEN);
+	memcpy(ad + CRYPT_HEADER_LEN, record, CRYPT_RECORD_LEN);
+}
+
+// Opens record Index (Record is its 8 byte prefix followed by the sealed
+// data) into Out, which must hold the plaintext length from the prefix.
+static bool open_record(const EVP_AEAD_CTX* aead, const unsigned char* header, const unsigned char* record, uint64_t index, unsigned char* out) {
+	unsigned char nonce[CRYPT_NONCE_LEN], ad[CRYPT_HEADER_LEN + CRYPT_RECORD_LEN];
+	size_t len = get_le32(record), out_len = 0;
+
+	record_nonce(index, nonce);
+	record_ad(header, record, ad);
+	return EVP_AEAD_CTX_open(aead, out, &out_len, len, nonce, sizeof(nonce), record + CRYPT_RECORD_LEN,
+		len + CRYPT_TAG_LEN, ad, sizeof(ad)) == 1 && out_len == len;
+}
+
+static bool seal_record(const EVP_AEAD_CTX* aead, const unsigned char* header, crypt_slot* slot) {
+	unsigned char nonce[CRYPT_NONCE_LEN], ad[CRYPT_HEADER_LEN + CRYPT_RECORD_LEN];
+	unsigned char* record = &slot->out[0];
+	size_t sealed = 0;
+
+	put_le32(record, slot->in_len);
+	put_le32(record + 4, slot->last ? CRYPT_FLAG_LAST : 0);
+	record_nonce(slot->index, nonce);
+	record_ad(header, record, ad);
+	if (EVP_AEAD_CTX_seal(aead, record + CRYPT_RECORD_LEN, &sealed, slot->in_len + CRYPT_TAG_LEN, nonce, sizeof(nonce),
+			&slot->in[0], slot->in_len, ad, sizeof(ad)) != 1)
+		return false;
+	slot->out_len = CRYPT_RECORD_LEN + sealed;
+	return true;
+}
+
+static void legacy_key(const std::string& password, OAES_CTX* ctx) {
+	uint8_t key_data[32];
+	size_t key_len = password.size();
+
+	// Same padding as the openaes tool
+	for (size_t i = 0; i < sizeof(key_data); i++)
+		key_data[i] = i + 1;
+	if (key_len <= 16)
+		key_len = 16;
+	else if (key_len <= 24)
+		key_len = 24;
+	else
+		key_len = 32;
+	memcpy(key_data, password.data(), password.size() < sizeof(key_data) ? password.size() : sizeof(key_data));
+	oaes_key_import_data(ctx, key_data, key_len);
+}
+
+static bool legacy_decrypt(OAES_CTX* ctx, crypt_slot* slot) {
+	slot->out_len = 0;
+	for (size_t off = 0; off < slot->in_len; off += OAES_LEGACY_RECORD) {
+		size_t len = slot->in_len - off < OAES_LEGACY_RECORD ? slot->in_len - off : OAES_LEGACY_RECORD;
+		size_t out_len = slot->out.size() - slot->out_len;
+		if (oaes_decrypt(ctx, &slot->in[off], len, &slot->out[slot->out_len], &out_len) != OAES_RET_SUCCESS)
+			return false;
+		slot->out_len += out_len;
+	}
+	return true;
+}
+
+static void pipeline_fail(twrpCryptPipeline* p, int err) {
+	pthread_mutex_lock(&p->lock);
+	if (!p->error)
+		p->error = err;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Fills Slot with the next record from in_fd. Returns 1, 0 at a clean end
+// of input (nothing read), or -1 with errno set.
+static int read_record(twrpCryptPipeline* p, crypt_slot* slot) {
+	ssize_t r;
+
+	if (p->mode == CRYPT_ENCRYPT) {
+		r = read_full(p->in_fd, &slot->in[0], p->chunk_size);
+		if (r < 0)
+			return -1;
+		slot->in_len = r;
+		slot->last = (size_t)r < p->chunk_size;
+		return 1;
+	}
+	if (p->mode == CRYPT_DECRYPT_LEGACY) {
+		size_t prefix = p->prefix_len;
+		memcpy(&slot->in[0], p->header, prefix);
+		p->prefix_len = 0;
+		r = read_full(p->in_fd, &slot->in[prefix], slot->in.size() - prefix);
+		if (r < 0)
+			return -1;
+		slot->in_len = prefix + r;
+		slot->last = slot->in_len < slot->in.size();
+		return slot->in_len > 0 ? 1 : 0;
+	}
+
+	r = read_full(p->in_fd, &slot->in[0], CRYPT_RECORD_LEN);
+	if (r < 0)
+		return -1;
+	if (r != CRYPT_RECORD_LEN) {
+		// Every archive ends with a record flagged as last
+		errno = EBADMSG;
+		return -1;
+	}
+	slot->in_len = get_le32(&slot->in[0]);
+	slot->last = (get_le32(&slot->in[4]) & CRYPT_FLAG_LAST) != 0;
+	if (slot->in_len > p->chunk_size) {
+		errno = EBADMSG;
+		return -1;
+	}
+	r = read_full(p->in_fd, &slot->in[CRYPT_RECORD_LEN], slot->in_len + CRYPT_TAG_LEN);
+	if (r < 0)
+		return -1;
+	if ((size_t)r != slot->in_len + CRYPT_TAG_LEN) {
+		errno = EBADMSG;
+		return -1;
+	}
+	if (slot->last) {
+		unsigned char extra;
+		if ((r = read_full(p->in_fd, &extra, 1)) != 0) {
+			if (r > 0)
+				errno = EBADMSG;
+			return -1;
+		}
+	}
+	return 1;
+}
+
+static void* crypt_reader(void* cookie) {
+	twrpCryptPipeline* p = (twrpCryptPipeline*) cookie;
+
+	for (uint64_t index = 0; ; index++) {
+		crypt_slot* slot = &p->slots[index % p->slots.size()];
+
+		pthread_mutex_lock(&p->lock);
+		while (slot->state != SLOT_FREE && !p->error)
+			pthread_cond_wait(&p->cond, &p->lock);
+		bool stop = p->error != 0;
+		pthread_mutex_unlock(&p->lock);
+		if (stop)
+			break;
+
+		int ret = read_record(p, slot);
+		if (ret < 0) {
+			pipeline_fail(p, errno);
+			break;
+		}
+		if (ret == 0)
+			break;
+		pthread_mutex_lock(&p->lock);
+		slot->index = index;
+		slot->state = SLOT_READY;
+		p->read_count++;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		if (slot->last)
+			break;
+	}
+	close(p->in_fd);
+	pthread_mutex_lock(&p->lock);
+	p->read_done = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void* crypt_worker(void* cookie) {
+	twrpCryptPipeline* p = (twrpCryptPipeline*) cookie;
+	OAES_CTX* legacy = NULL;
+
+	if (p->mode == CRYPT_DECRYPT_LEGACY) {
+		// oaes contexts carry the CBC state, so each worker needs its own
+		legacy = oaes_alloc();
+		if (legacy == NULL) {
+			pipeline_fail(p, ENOMEM);
+			return NULL;
+		}
+		legacy_key(p->password, legacy);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		crypt_slot* slot = &p->slots[p->next_work % p->slots.size()];
+		while (!p->error && !(slot->state == SLOT_READY && slot->index == p->next_work) &&
+				!(p->read_done && p->next_work == p->read_count))
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->error || slot->state != SLOT_READY || slot->index != p->next_work)
+			break;
+		slot->state = SLOT_BUSY;
+		p->next_work++;
+		pthread_mutex_unlock(&p->lock);
+
+		bool ok;
+		if (p->mode == CRYPT_ENCRYPT)
+			ok = seal_record(&p->aead, p->header, slot);
+		else if (p->mode == CRYPT_DECRYPT) {
+			ok = open_record(&p->aead, p->header, &slot->in[0], slot->index, &slot->out[0]);
+			slot->out_len = slot->in_len;
+		} else
+			ok = legacy_decrypt(legacy, slot);
+
+		pthread_mutex_lock(&p->lock);
+		if (!ok) {
+			if (!p->error)
+				p->error = EBADMSG;
+			pthread_cond_broadcast(&p->cond);
+			break;
+		}
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (legacy)
+		oaes_free(&legacy);
+	return NULL;
+}
+
+static void* crypt_writer(void* cookie) {
+	twrpCryptPipeline* p = (twrpCryptPipeline*) cookie;
+
+	for (uint64_t index = 0; ; index++) {
+		crypt_slot* slot = &p->slots[index % p->slots.size()];
+
+		pthread_mutex_lock(&p->lock);
+		while (!p->error && !(slot->state == SLOT_DONE && slot->index == index) &&
+				!(p->read_done && index == p->read_count))
+			pthread_cond_wait(&p->cond, &p->lock);
+		bool stop = p->error || slot->state != SLOT_DONE || slot->index != index;
+		pthread_mutex_unlock(&p->lock);
+		if (stop)
+			break;
+
+		if (write_full(p->out_fd, &slot->out[0], slot->out_len) != 0) {
+			pipeline_fail(p, errno);
+			break;
+		}
+		bool last = slot->last;
+		pthread_mutex_lock(&p->lock);
+		slot->state = SLOT_FREE;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		if (last)
+			break;
+	}
+	close(p->out_fd);
+	return NULL;
+}
+
+static twrpCryptPipeline* pipeline_alloc(crypt_mode mode, int in_fd, int out_fd, const std::string& password) {
+	twrpCryptPipeline* p = new twrpCryptPipeline;
+	p->mode = mode;
+	p->in_fd = in_fd;
+	p->out_fd = out_fd;
+	p->password = password;
+	memset(p->header, 0, sizeof(p->header));
+	p->prefix_len = 0;
+	p->chunk_size = CRYPT_CHUNK_SIZE;
+	p->aead_ready = false;
+	p->read_count = 0;
+	p->next_work = 0;
+	p->read_done = false;
+	p->error = 0;
+	p->reader_started = false;
+	p->writer_started = false;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	return p;
+}
+
+static int pipeline_finish(twrpCryptPipeline* p) {
+	for (size_t i = 0; i < p->workers.size(); i++)
+		pthread_join(p->workers[i], NULL);
+	if (p->reader_started)
+		pthread_join(p->reader, NULL);
+	else
+		close(p->in_fd);
+	if (p->writer_started)
+		pthread_join(p->writer, NULL);
+	else
+		close(p->out_fd);
+
+	int err = p->error;
+	if (p->aead_ready)
+		EVP_AEAD_CTX_cleanup(&p->aead);
+	p->password.assign(p->password.size(), '\0');
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	delete p;
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int pipeline_start(twrpCryptPipeline* p) {
+	unsigned workers = crypt_workers();
+	size_t in_size, out_size;
+	sigset_t block, old;
+	int ret;
+
+	if (p->mode == CRYPT_ENCRYPT) {
+		in_size = p->chunk_size;
+		out_size = CRYPT_RECORD_LEN + p->chunk_size + CRYPT_TAG_LEN;
+	} else if (p->mode == CRYPT_DECRYPT) {
+		in_size = CRYPT_RECORD_LEN + p->chunk_size + CRYPT_TAG_LEN;
+		out_size = p->chunk_size;
+	} else {
+		in_size = out_size = OAES_LEGACY_RECORD * OAES_LEGACY_BATCH;
+	}
+	p->slots.resize(workers * CRYPT_SLOTS_PER_WORKER);
+	for (size_t i = 0; i < p->slots.size(); i++) {
+		p->slots[i].in.resize(in_size);
+		p->slots[i].out.resize(out_size);
+		p->slots[i].in_len = p->slots[i].out_len = 0;
+		p->slots[i].index = 0;
+		p->slots[i].last = false;
+		p->slots[i].state = SLOT_FREE;
+	}
+
+	// A decrypted stream's reader may stop early; report that as EPIPE
+	// instead of letting SIGPIPE take down the process.
+	sigemptyset(&block);
+	sigaddset(&block, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	ret = pthread_create(&p->writer, NULL, crypt_writer, p);
+	p->writer_started = ret == 0;
+	for (unsigned i = 0; ret == 0 && i < workers; i++) {
+		pthread_t worker;
+		ret = pthread_create(&worker, NULL, crypt_worker, p);
+		if (ret == 0)
+			p->workers.push_back(worker);
+	}
+	if (ret == 0) {
+		ret = pthread_create(&p->reader, NULL, crypt_reader, p);
+		p->reader_started = ret == 0;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		LOGINFO("twrpCrypt: unable to start pipeline threads: %s\n", strerror(ret));
+		pipeline_fail(p, ret);
+		pipeline_finish(p);
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+// Decrypts the first record of the archive at Path, or if Last as many
+// records from the end as it takes to hold Want bytes of plaintext,
+// stepping over the others by their length prefixes. The last record can
+// be empty when the data was an exact multiple of the chunk size, and a
+// short one can hold only part of a trailer.
+static int decrypt_file_record(const std::string& path, const std::string& password, bool last, size_t want, std::vector<unsigned char>& out) {
+	struct record_pos {
+		uint64_t index;
+		off64_t offset;
+		size_t len;
+	};
+	unsigned char header[CRYPT_HEADER_LEN], prefix[CRYPT_RECORD_LEN], empty;
+	std::vector<record_pos> records;
+	std::vector<unsigned char> sealed, plain;
+	EVP_AEAD_CTX aead;
+	off64_t offset = CRYPT_HEADER_LEN;
+	uint64_t index = 0;
+	size_t total = 0;
+	int fd, ret;
+
+	out.clear();
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+	if (fd < 0)
+		return -1;
+	if (read_full(fd, header, sizeof(header)) != (ssize_t)sizeof(header) || !check_header(header)) {
+		close(fd);
+		return -1;
+	}
+	for (;;) {
+		if (read_full(fd, prefix, CRYPT_RECORD_LEN) != CRYPT_RECORD_LEN) {
+			close(fd);
+			return 0;
+		}
+		record_pos pos = { index++, offset, get_le32(prefix) };
+		if (pos.len > get_le32(header + 8)) {
+			close(fd);
+			return 0;
+		}
+		// Only keep the records the tail still needs
+		records.push_back(pos);
+		total += pos.len;
+		while (records.size() > 1 && total - records[0].len >= want) {
+			total -= records[0].len;
+			records.erase(records.begin());
+		}
+		if (!last || (get_le32(prefix + 4) & CRYPT_FLAG_LAST))
+			break;
+		offset += CRYPT_RECORD_LEN + pos.len + CRYPT_TAG_LEN;
+		if (lseek64(fd, offset, SEEK_SET) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (!derive_key(password, header, &aead)) {
+		close(fd);
+		return -1;
+	}
+	ret = 1;
+	out.reserve(total);
+	for (size_t i = 0; ret == 1 && i < records.size(); i++) {
+		size_t sealed_len = CRYPT_RECORD_LEN + records[i].len + CRYPT_TAG_LEN;
+		sealed.resize(sealed_len);
+		plain.resize(records[i].len);
+		if (lseek64(fd, records[i].offset, SEEK_SET) < 0 || read_full(fd, &sealed[0], sealed_len) != (ssize_t)sealed_len)
+			ret = 0;
+		else if (!open_record(&aead, header, &sealed[0], records[i].index, plain.empty() ? &empty : &plain[0]))
+			ret = 0;
+		else
+			out.insert(out.end(), plain.begin(), plain.end());
+	}
+	EVP_AEAD_CTX_cleanup(&aead);
+	close(fd);
+	if (ret != 1)
+		out.clear();
+	return ret;
+}
+
+#endif // ndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+
+twrpCrypt::twrpCrypt() {
+	pipeline = NULL;
+}
+
+twrpCrypt::~twrpCrypt() {
+	if (pipeline)
+		Wait();
+}
+
+int twrpCrypt::Start_Encrypt(int In, int Out, const std::string& Password) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	twrpCryptPipeline* p = pipeline_alloc(CRYPT_ENCRYPT, In, Out, Password);
+
+	memcpy(p->header, crypt_magic, sizeof(crypt_magic));
+	p->header[4] = CRYPT_VERSION;
+	p->header[5] = CRYPT_CIPHER_AES256_GCM;
+	put_le32(p->header + 8, p->chunk_size);
+	put_le32(p->header + 12, CRYPT_KDF_ITERATIONS);
+	if (RAND_bytes(p->header + CRYPT_SALT_OFFSET, CRYPT_SALT_LEN) != 1 || !derive_key(Password, p->header, &p->aead)) {
+		LOGINFO("twrpCrypt: unable to set up the backup key\n");
+		pipeline_fail(p, EINVAL);
+		pipeline_finish(p);
+		return -1;
+	}
+	p->aead_ready = true;
+	if (write_full(Out, p->header, sizeof(p->header)) != 0) {
+		LOGINFO("twrpCrypt: unable to write archive header: %s\n", strerror(errno));
+		pipeline_fail(p, errno);
+		pipeline_finish(p);
+		return -1;
+	}
+	if (pipeline_start(p) != 0)
+		return -1;
+	pipeline = p;
+	return 0;
+#else
+	close(In);
+	close(Out);
+	LOGINFO("twrpCrypt: encrypted backup support not included\n");
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+int twrpCrypt::Start_Decrypt(int In, int Out, const std::string& Password) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	twrpCryptPipeline* p = pipeline_alloc(CRYPT_DECRYPT, In, Out, Password);
+	ssize_t r = read_full(In, p->header, sizeof(p->header));
+
+	if (r > 0 && Is_Legacy(p->header, r)) {
+		p->mode = CRYPT_DECRYPT_LEGACY;
+		p->prefix_len = r;
+	} else if (r == (ssize_t)sizeof(p->header) && check_header(p->header)) {
+		p->chunk_size = get_le32(p->header + 8);
+		if (!derive_key(Password, p->header, &p->aead)) {
+			LOGINFO("twrpCrypt: unable to set up the backup key\n");
+			pipeline_fail(p, EINVAL);
+			pipeline_finish(p);
+			return -1;
+		}
+		p->aead_ready = true;
+	} else {
+		LOGINFO("twrpCrypt: not an encrypted backup archive\n");
+		pipeline_fail(p, r < 0 ? errno : EBADMSG);
+		return pipeline_finish(p);
+	}
+	if (pipeline_start(p) != 0)
+		return -1;
+	pipeline = p;
+	return 0;
+#else
+	close(In);
+	close(Out);
+	LOGINFO("twrpCrypt: encrypted backup support not included\n");
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+int twrpCrypt::Wait() {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (pipeline == NULL)
+		return 0;
+	twrpCryptPipeline* p = pipeline;
+	pipeline = NULL;
+	return pipeline_finish(p);
+#else
+	return 0;
+#endif
+}
+
+int twrpCrypt::Decrypt_Head(const std::string& Path, const std::string& Password, std::vector<unsigned char>& Head) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	return decrypt_file_record(Path, Password, false, 0, Head);
+#else
+	return -1;
+#endif
+}
+
+int twrpCrypt::Decrypt_Tail(const std::string& Path, const std::string& Password, size_t Len, std::vector<unsigned char>& Tail) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	return decrypt_file_record(Path, Password, true, Len, Tail);
+#else
+	return -1;
+#endif
+}
+
+bool twrpCrypt::Is_Legacy(const std::string& Path) {
+	unsigned char header[5];
+	int fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+	ssize_t r = read_full(fd, header, sizeof(header));
+	close(fd);
+	return r > 0 && Is_Legacy(header, r);
+}
@@ -0,0 +1,71 @@
+/*
+		Copyright 2026 TeamWin
+		This file is part of TWRP/TeamWin Recovery Project.
+
+		TWRP is free software: you can redistribute it and/or modify
+		it under the terms of the GNU General Public License as published by
+		the Free Software Foundation, either version 3 of the License, or
+		(at your option) any later version.
+
+		TWRP is distributed in the hope that it will be useful,
+		but WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+		GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License
+		along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPCRYPT_HPP
+#define TWRPCRYPT_HPP
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+struct twrpCryptPipeline;
+
+// In-process backup encryption. New archives use header version 2 of the
+// OAES container: a 32 byte header carrying a PBKDF2 salt, followed by
+// independent AES-256-GCM records of up to 256KiB that are sealed and
+// opened on several threads. Legacy version 1 (openaes CBC) archives are
+// still decrypted, also record-parallel.
+//
+// Start_* hand both fds to a background pipeline which closes them when
+// it finishes; Wait must be called before the object is destroyed.
+class twrpCrypt {
+public:
+	twrpCrypt();
+	~twrpCrypt();
+
+	// Encrypts everything read from In until EOF and writes the archive to Out.
+	int Start_Encrypt(int In, int Out, const std::string& Password);
+	// Decrypts an archive of either header version read from In into Out.
+	int Start_Decrypt(int In, int Out, const std::string& Password);
+	// Joins the pipeline. Returns 0, or -1 with errno set from the first
+	// failure (EBADMSG for a wrong password or damaged archive, EPIPE if
+	// the reader of a decrypted stream went away early).
+	int Wait();
+	bool Running() const { return pipeline != NULL; }
+
+	// Decrypts the first record of a version 2 archive at Path into Head.
+	// Returns 1, 0 if the password is wrong or the data is damaged, or -1
+	// if the file could not be read or is not a version 2 archive.
+	static int Decrypt_Head(const std::string& Path, const std::string& Password, std::vector<unsigned char>& Head);
+	// Same for the end of the archive, e.g. to read a gzip trailer: decrypts
+	// enough trailing records for Tail to end with at least Len bytes of
+	// plaintext, unless the whole archive is shorter.
+	static int Decrypt_Tail(const std::string& Path, const std::string& Password, size_t Len, std::vector<unsigned char>& Tail);
+	// True if Header, or the file at Path, starts with a legacy version 1
+	// OAES header.
+	static bool Is_Legacy(const unsigned char* Header, size_t Len);
+	static bool Is_Legacy(const std::string& Path);
+
+private:
+	twrpCrypt(const twrpCrypt&);
+	twrpCrypt& operator=(const twrpCrypt&);
+
+	twrpCryptPipeline* pipeline;
+};
+
+#endif // TWRPCRYPT_HPP
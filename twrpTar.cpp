@@ -19,7 +19,6 @@
 
 extern "C" {
 	#include "libtar/libtar.h"
-	#include "twrpTar.h"
 	#include "tarWrite.h"
 }
 #include <sys/types.h>
@@ -74,13 +73,14 @@ twrpTar::twrpTar(void) {
 	use_compression = 0;
 	split_archives = 0;
 	pigz_pid = 0;
-	oaes_pid = 0;
 	Total_Backup_Size = 0;
 	Archive_Current_Size = 0;
 	include_root_dir = true;
+	write_buffer_size = 0;
 	tar_type.openfunc = open;
 	tar_type.closefunc = close;
 	tar_type.readfunc = read;
+	tar_type.writefunc = write;
 	input_fd = -1;
 	output_fd = -1;
 	backup_exclusions = NULL;
@@ -292,6 +292,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				reg.use_compression = use_compression;
 				reg.split_archives = 1;
 				reg.progress_pipe_fd = progress_pipe_fd;
+				reg.write_buffer_size = write_buffer_size;
 				reg.part_settings = part_settings;
 				LOGINFO("Creating unencrypted backup...\n");
 				if (createList((void*)&reg) != 0) {
@@ -337,6 +338,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				enc[i].use_compression = use_compression;
 				enc[i].split_archives = 1;
 				enc[i].progress_pipe_fd = progress_pipe_fd;
+				enc[i].write_buffer_size = write_buffer_size;
 				enc[i].part_settings = part_settings;
 				LOGINFO("Start encryption thread %i\n", i);
 				ret = pthread_create(&enc_thread[i], &tattr, createList, (void*)&enc[i]);
@@ -412,6 +414,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			reg.use_compression = use_compression;
 			reg.setsize(Total_Backup_Size);
 			reg.progress_pipe_fd = progress_pipe_fd;
+			reg.write_buffer_size = write_buffer_size;
 			reg.part_settings = part_settings;
 			if (Total_Backup_Size > MAX_ARCHIVE_SIZE && !part_settings->adbbackup) {
 				gui_msg("split_backup=Breaking backup file into multiple archives...");
@@ -712,6 +715,10 @@ int twrpTar::extractTar() {
 	if (tar_extract_all(t, charRootDir, &progress_pipe_fd) != 0) {
 		LOGINFO("Unable to extract tar archive '%s'\n", tarfn.c_str());
 		gui_err("restore_error=Error during restore process.");
+		if (crypt.Running()) {
+			tar_close(t);
+			crypt.Wait();
+		}
 		return -1;
 	}
 	if (tar_close(t) != 0) {
@@ -719,6 +726,12 @@ int twrpTar::extractTar() {
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
+	// EPIPE only means tar stopped reading at the end-of-archive blocks
+	if (crypt.Running() && crypt.Wait() != 0 && errno != EPIPE) {
+		LOGINFO("Decrypting '%s' failed: %s\n", tarfn.c_str(), strerror(errno));
+		gui_msg(Msg(msg::kError, "fail_decrypt_tar=Failed to decrypt tar file '{1}'")(tarfn));
+		return -1;
+	}
 #ifndef BUILD_TWRPTAR_MAIN
 	if (part_settings->adbbackup) {
 		if (!twadbbu::Write_TWEOF())
@@ -946,40 +959,25 @@ int twrpTar::createTar() {
 			}
 		} else {
 			// Parent
-			oaes_pid = fork();
-
-			if (oaes_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
+			close(pipes[0]);
+			close(pipes[3]);
+			if (crypt.Start_Encrypt(pipes[2], output_fd, password) != 0) {
+				LOGINFO("Unable to start encryption: %s\n", strerror(errno));
 				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
+				output_fd = -1;
+				close(pipes[1]);
 				return -1;
-			} else if (oaes_pid == 0) {
-				// openaes Child
-				dup2(pipes[2], STDIN_FILENO);
-				dup2(output_fd, STDOUT_FILENO);
-				if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-					LOGINFO("execlp openaes ERROR!\n");
-					gui_err("backup_error=Error creating backup.");
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]);
-				close(pipes[2]);
-				close(pipes[3]);
-				fd = pipes[1];
-				init_libtar_no_buffer(progress_pipe_fd);
-				tar_type.writefunc = write_tar_no_buffer;
-				if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("backup_error=Error creating backup.");
-					return -1;
-				}
-				return 0;
 			}
+			output_fd = -1; // owned by the encryption stage now
+			fd = pipes[1];
+			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+				close(fd);
+				LOGINFO("tar_fdopen failed\n");
+				gui_err("backup_error=Error creating backup.");
+				return -1;
+			}
+			init_libtar_buffer(t, write_buffer_size, progress_pipe_fd);
+			return 0;
 		}
 	} else if (use_compression) {
 		// Compressed
@@ -1026,84 +1024,67 @@ int twrpTar::createTar() {
 			// Parent
 			close(pigzfd[0]); // close parent input
 			fd = pigzfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
 			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
 				close(fd);
 				LOGINFO("tar_fdopen failed\n");
 				gui_err("backup_error=Error creating backup.");
 				return -1;
 			}
+			init_libtar_buffer(t, write_buffer_size, progress_pipe_fd);
 		}
 	} else if (use_encryption) {
 		// Encrypted
 		current_archive_type = ENCRYPTED;
 		LOGINFO("Using encryption...\n");
-		int oaesfd[2];
+		int cryptfd[2];
 		output_fd = open(tarfn.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		if (output_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-		if (pipe2(oaesfd, O_CLOEXEC) < 0) {
+		if (pipe2(cryptfd, O_CLOEXEC) < 0) {
 			LOGINFO("Error creating pipe\n");
 			gui_err("backup_error=Error creating backup.");
 			close(output_fd);
 			return -1;
 		}
-		oaes_pid = fork();
-
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
+		if (crypt.Start_Encrypt(cryptfd[0], output_fd, password) != 0) {
+			LOGINFO("Unable to start encryption: %s\n", strerror(errno));
 			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
+			output_fd = -1;
+			close(cryptfd[1]);
 			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			dup2(oaesfd[0], STDIN_FILENO); // remap stdin
-			dup2(output_fd, STDOUT_FILENO); // remap stdout to output file
-			if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[0]); // close parent input
-			fd = oaesfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
-			return 0;
 		}
+		output_fd = -1; // owned by the encryption stage now
+		fd = cryptfd[1];
+		if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			close(fd);
+			LOGINFO("tar_fdopen failed\n");
+			gui_err("backup_error=Error creating backup.");
+			return -1;
+		}
+		init_libtar_buffer(t, write_buffer_size, progress_pipe_fd);
+		return 0;
 	} else {
 		// Not compressed or encrypted
 		current_archive_type = UNCOMPRESSED;
-		init_libtar_buffer(0, progress_pipe_fd);
 		if (part_settings->adbbackup) {
 			LOGINFO("Opening TW_ADB_BACKUP uncompressed stream\n");
-			tar_type.writefunc = write_tar_no_buffer;
 			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
 			if(tar_fdopen(&t, output_fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
 				close(output_fd);
 				LOGERR("tar_fdopen failed\n");
 				return -1;
 			}
+			init_libtar_no_buffer(t, progress_pipe_fd);
 		}
 		else {
-			tar_type.writefunc = write_tar;
 			if (tar_open(&t, charTarFile, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1) {
 				LOGERR("tar_open error opening '%s'\n", tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
 				return -1;
 			}
+			init_libtar_buffer(t, write_buffer_size, progress_pipe_fd);
 		}
 	}
 	return 0;
@@ -1137,101 +1118,74 @@ int twrpTar::openTar() {
 			close(input_fd);
 			return -1;
 		}
-		oaes_pid = fork();
+		pigz_pid = fork();
 
-		if (oaes_pid < 0) {
+		if (pigz_pid < 0) {
 			LOGINFO("pigz fork() failed\n");
 			gui_err("restore_error=Error during restore process.");
 			close(input_fd);
 			for (i = 0; i < 4; i++)
 				close(pipes[i]); // close all
 			return -1;
-		} else if (oaes_pid == 0) {
-			// openaes Child
-			dup2(input_fd, STDIN_FILENO);
-			dup2(pipes[1], STDOUT_FILENO);
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
+		} else if (pigz_pid == 0) {
+			// pigz Child
+			dup2(pipes[0], STDIN_FILENO);
+			dup2(pipes[3], STDOUT_FILENO);
+			if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
+				LOGINFO("execlp pigz ERROR!\n");
 				gui_err("restore_error=Error during restore process.");
 				_exit(-1);
 			}
 		} else {
 			// Parent
-			pigz_pid = fork();
-
-			if (pigz_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
+			close(pipes[0]); // Close pipes not used by parent
+			close(pipes[3]);
+			if (crypt.Start_Decrypt(input_fd, pipes[1], password) != 0) {
+				LOGINFO("Unable to start decryption: %s\n", strerror(errno));
+				gui_err("restore_error=Error during restore process.");
+				input_fd = -1;
+				close(pipes[2]);
+				return -1;
+			}
+			input_fd = -1; // owned by the decryption stage now
+			fd = pipes[2];
+			if (tar_fdopen(&t, fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+				close(fd);
+				LOGINFO("tar_fdopen failed\n");
 				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
 				return -1;
-			} else if (pigz_pid == 0) {
-				// pigz Child
-				dup2(pipes[0], STDIN_FILENO);
-				dup2(pipes[3], STDOUT_FILENO);
-				if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-					LOGINFO("execlp pigz ERROR!\n");
-					gui_err("restore_error=Error during restore process.");
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]); // Close pipes not used by parent
-				close(pipes[1]);
-				close(pipes[3]);
-				fd = pipes[2];
-				if (tar_fdopen(&t, fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("restore_error=Error during restore process.");
-					return -1;
-				}
 			}
 		}
 	} else if (current_archive_type == ENCRYPTED) {
 		LOGINFO("Opening encrypted backup...\n");
-		int oaesfd[2];
+		int cryptfd[2];
 		input_fd = open(tarfn.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE);
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
 
-		if (pipe2(oaesfd, O_CLOEXEC) < 0) {
+		if (pipe2(cryptfd, O_CLOEXEC) < 0) {
 			LOGINFO("Error creating pipe\n");
 			gui_err("restore_error=Error during restore process.");
 			close(input_fd);
 			return -1;
 		}
 
-		oaes_pid = fork();
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
+		if (crypt.Start_Decrypt(input_fd, cryptfd[1], password) != 0) {
+			LOGINFO("Unable to start decryption: %s\n", strerror(errno));
+			gui_err("restore_error=Error during restore process.");
+			input_fd = -1;
+			close(cryptfd[0]);
+			return -1;
+		}
+		input_fd = -1; // owned by the decryption stage now
+		fd = cryptfd[0];
+		if (tar_fdopen(&t, fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			close(fd);
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
 			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			dup2(oaesfd[1], STDOUT_FILENO); // remap stdout
-			dup2(input_fd, STDIN_FILENO); // remap input fd to stdin
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[1]); // close parent output
-			fd = oaesfd[0];   // copy parent input
-			if (tar_fdopen(&t, fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("restore_error=Error during restore process.");
-				return -1;
-			}
 		}
 	} else if (current_archive_type == COMPRESSED) {
 		int pigzfd[2];
@@ -1341,9 +1295,16 @@ int twrpTar::addFile(string fn, bool include_root) {
 
 int twrpTar::closeTar() {
 	LOGINFO("Closing tar\n");
-	flush_libtar_buffer(t->fd);
+	flush_libtar_buffer(t);
 	if (tar_append_eof(t) != 0) {
 		LOGINFO("tar_append_eof(): %s\n", strerror(errno));
+		free_libtar_buffer(t);
+		tar_close(t);
+		return -1;
+	}
+	// Flush the write state before tar_close() closes the fd under it
+	if (free_libtar_buffer(t) != 0) {
+		LOGINFO("Error flushing tar archive: '%s'\n", tarfn.c_str());
 		tar_close(t);
 		return -1;
 	}
@@ -1355,10 +1316,11 @@ int twrpTar::closeTar() {
 		int status;
 		if (pigz_pid > 0 && TWFunc::Wait_For_Child(pigz_pid, &status, "pigz") != 0)
 			return -1;
-		if (oaes_pid > 0 && TWFunc::Wait_For_Child(oaes_pid, &status, "openaes") != 0)
+		if (crypt.Running() && crypt.Wait() != 0) {
+			LOGINFO("Encrypting '%s' failed: %s\n", tarfn.c_str(), strerror(errno));
 			return -1;
+		}
 	}
-	free_libtar_buffer();
 	if (!part_settings->adbbackup) {
 		if (use_compression && !use_encryption) {
 			string gzname = tarfn + ".gz";
@@ -1499,6 +1461,14 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 		} else if (ret == 1) {
 			LOGERR("Decrypted file is not in tar format.\n");
 			total_size = TWFunc::Get_File_Size(filename);
+		} else if (ret == 3 && !twrpCrypt::Is_Legacy(filename)) {
+			// Same as pigz -l: the gzip trailer ends with the original size mod 2^32
+			vector<unsigned char> tail;
+			if (twrpCrypt::Decrypt_Tail(filename, password, 4, tail) == 1 && tail.size() >= 4) {
+				const unsigned char* isize = &tail[tail.size() - 4];
+				total_size = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((unsigned long long)isize[3] << 24);
+			} else
+				total_size = TWFunc::Get_File_Size(filename);
 		} else if (ret == 3) {
 			Command = "openaes dec --key \"" + password + "\" --in '" + filename + "' | pigz -l";
 			/* if we set Command = "pigz -l " + tarfn + " | sed '1d' | cut -f5 -d' '";
@@ -1523,11 +1493,3 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 
 	return total_size;
 }
-
-extern "C" ssize_t write_tar(int fd, const void *buffer, size_t size) {
-	return (ssize_t) write_libtar_buffer(fd, buffer, size);
-}
-
-extern "C" ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size) {
-	return (ssize_t) write_libtar_no_buffer(fd, buffer, size);
-}
@@ -1,25 +0,0 @@
-/*
-	Copyright 2012 bigbiff/Dees_Troy TeamWin
-	This file is part of TWRP/TeamWin Recovery Project.
-
-	TWRP is free software: you can redistribute it and/or modify
-	it under the terms of the GNU General Public License as published by
-	the Free Software Foundation, either version 3 of the License, or
-	(at your option) any later version.
-
-	TWRP is distributed in the hope that it will be useful,
-	but WITHOUT ANY WARRANTY; without even the implied warranty of
-	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-	GNU General Public License for more details.
-
-	You should have received a copy of the GNU General Public License
-	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
-*/
-
-#ifndef _TWRPTAR_HEADER
-#define _TWRPTAR_HEADER
-
-ssize_t write_tar(int fd, const void *buffer, size_t size);
-ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size);
-
-#endif  // _TWRPTAR_HEADER
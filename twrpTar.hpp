@@ -31,6 +31,7 @@ extern "C" {
 #include "progresstracking.hpp"
 #include "partitions.hpp"
 #include "twrp-functions.hpp"
+#include "twrpCrypt.hpp"
 
 using namespace std;
 
@@ -64,6 +65,7 @@ public:
 	int split_archives;
 	string backup_name;
 	int progress_pipe_fd;
+	unsigned write_buffer_size;                                                     // per-archive write buffer in bytes, 0 for the default
 	string partition_name;
 	string backup_folder;
 	PartitionSettings *part_settings;
@@ -96,7 +98,7 @@ private:
 	int fd;
 	int input_fd;                                                                   // this stores the fd for libtar to write to
 	pid_t pigz_pid;
-	pid_t oaes_pid;
+	twrpCrypt crypt;                                                                // in-process encryption stage of encrypted archives
 	unsigned long long file_count;
 
 	string tardir;
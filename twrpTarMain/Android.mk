@@ -7,8 +7,10 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpCrypt.cpp \
 	../tarWrite.c \
 	../exclude.cpp \
+	../direnum.cpp \
 	../progresstracking.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
@@ -31,7 +33,8 @@ endif
 ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 else
-	LOCAL_STATIC_LIBRARIES += libopenaes_static
+	LOCAL_C_INCLUDES += external/boringssl/include
+	LOCAL_STATIC_LIBRARIES += libopenaes_static libcrypto_static
 endif
 
 LOCAL_MODULE:= twrpTar_static
@@ -49,8 +52,10 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpCrypt.cpp \
 	../tarWrite.c \
 	../exclude.cpp \
+	../direnum.cpp \
 	../progresstracking.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
@@ -72,7 +77,8 @@ endif
 ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 else
-	LOCAL_SHARED_LIBRARIES += libopenaes
+	LOCAL_C_INCLUDES += external/boringssl/include
+	LOCAL_SHARED_LIBRARIES += libopenaes libcrypto
 endif
 
 LOCAL_MODULE:= twrpTar
@@ -80,3 +86,7 @@ LOCAL_MODULE_TAGS:= optional
 LOCAL_MODULE_CLASS := UTILITY_EXECUTABLES
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
 include $(BUILD_EXECUTABLE)
+
+ifneq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
+    include $(LOCAL_PATH)/tests/Android.mk
+endif
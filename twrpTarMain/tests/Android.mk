@@ -0,0 +1,29 @@
+# Build the twrpCrypt unit tests
+
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+
+LOCAL_SRC_FILES:= \
+    twrpcrypt_test.cpp \
+    ../../twrpCrypt.cpp
+
+LOCAL_CFLAGS := -DBUILD_TWRPTAR_MAIN
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/../.. \
+    external/boringssl/include
+
+LOCAL_SHARED_LIBRARIES := \
+    libcrypto
+
+LOCAL_STATIC_LIBRARIES := \
+    libopenaes_static \
+    libgtest \
+    libgtest_main
+
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := twrpcrypt_test
+
+include $(BUILD_NATIVE_TEST)
@@ -0,0 +1,257 @@
+/*
+		Copyright 2026 TeamWin
+		This file is part of TWRP/TeamWin Recovery Project.
+
+		TWRP is free software: you can redistribute it and/or modify
+		it under the terms of the GNU General Public License as published by
+		the Free Software Foundation, either version 3 of the License, or
+		(at your option) any later version.
+
+		TWRP is distributed in the hope that it will be useful,
+		but WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+		GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License
+		along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "twrpCrypt.hpp"
+#include "openaes/inc/oaes_lib.h"
+
+// The archive layout the tests poke at: a 32 byte header, then records of
+// <plaintext length, le32> <flags, le32> <ciphertext> <16 byte tag>.
+#define TEST_HEADER_LEN		32
+#define TEST_RECORD_LEN		8
+#define TEST_TAG_LEN		16
+#define TEST_CHUNK_SIZE		(256 * 1024)
+
+static const char* test_password = "twrp backup password";
+
+class TwrpCryptTest : public ::testing::Test {
+protected:
+	void SetUp() override {
+		char dir[] = "/data/local/tmp/twrpcrypt_test.XXXXXX";
+		char host_dir[] = "/tmp/twrpcrypt_test.XXXXXX";
+		char* made = mkdtemp(dir);
+		if (made == NULL)
+			made = mkdtemp(host_dir);
+		ASSERT_TRUE(made != NULL) << strerror(errno);
+		tmp_dir = made;
+		plain_path = tmp_dir + "/plain";
+		archive_path = tmp_dir + "/archive";
+		out_path = tmp_dir + "/out";
+	}
+
+	void TearDown() override {
+		unlink(plain_path.c_str());
+		unlink(archive_path.c_str());
+		unlink(out_path.c_str());
+		rmdir(tmp_dir.c_str());
+	}
+
+	static std::vector<unsigned char> Pattern(size_t len) {
+		std::vector<unsigned char> data(len);
+		uint32_t x = 2463534242u;
+		for (size_t i = 0; i < len; i++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			data[i] = x & 0xff;
+		}
+		return data;
+	}
+
+	static void WriteFile(const std::string& path, const std::vector<unsigned char>& data) {
+		FILE* fp = fopen(path.c_str(), "wb");
+		ASSERT_TRUE(fp != NULL) << strerror(errno);
+		if (!data.empty())
+			ASSERT_EQ(data.size(), fwrite(&data[0], 1, data.size(), fp));
+		ASSERT_EQ(0, fclose(fp));
+	}
+
+	static std::vector<unsigned char> ReadFile(const std::string& path) {
+		std::vector<unsigned char> data;
+		unsigned char buf[65536];
+		size_t len;
+		FILE* fp = fopen(path.c_str(), "rb");
+		if (fp == NULL)
+			return data;
+		while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+			data.insert(data.end(), buf, buf + len);
+		fclose(fp);
+		return data;
+	}
+
+	// Runs In through Start_Encrypt or Start_Decrypt into Out and returns
+	// Wait's result, with errno from the pipeline in Err.
+	static int Run(bool encrypt, const std::string& in, const std::string& out, const std::string& password, int* err) {
+		twrpCrypt crypt;
+		int in_fd = open(in.c_str(), O_RDONLY | O_CLOEXEC);
+		int out_fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (in_fd < 0 || out_fd < 0) {
+			*err = errno;
+			if (in_fd >= 0)
+				close(in_fd);
+			if (out_fd >= 0)
+				close(out_fd);
+			return -1;
+		}
+		int ret = encrypt ? crypt.Start_Encrypt(in_fd, out_fd, password) : crypt.Start_Decrypt(in_fd, out_fd, password);
+		if (ret == 0)
+			ret = crypt.Wait();
+		*err = ret == 0 ? 0 : errno;
+		return ret;
+	}
+
+	void RoundTrip(size_t len) {
+		std::vector<unsigned char> plain = Pattern(len);
+		int err;
+
+		WriteFile(plain_path, plain);
+		ASSERT_EQ(0, Run(true, plain_path, archive_path, test_password, &err)) << strerror(err);
+		std::vector<unsigned char> archive = ReadFile(archive_path);
+		ASSERT_GE(archive.size(), (size_t)TEST_HEADER_LEN);
+		EXPECT_EQ(0, memcmp(&archive[0], "OAES\x02", 5));
+		EXPECT_FALSE(twrpCrypt::Is_Legacy(archive_path));
+
+		ASSERT_EQ(0, Run(false, archive_path, out_path, test_password, &err)) << strerror(err);
+		EXPECT_TRUE(plain == ReadFile(out_path));
+	}
+
+	std::string tmp_dir;
+	std::string plain_path;
+	std::string archive_path;
+	std::string out_path;
+};
+
+TEST_F(TwrpCryptTest, RoundTrip) {
+	RoundTrip(3 * TEST_CHUNK_SIZE + 12345);
+}
+
+TEST_F(TwrpCryptTest, RoundTripExactChunks) {
+	RoundTrip(2 * TEST_CHUNK_SIZE);
+}
+
+TEST_F(TwrpCryptTest, RoundTripEmpty) {
+	RoundTrip(0);
+}
+
+TEST_F(TwrpCryptTest, DecryptHeadAndTail) {
+	std::vector<unsigned char> plain = Pattern(TEST_CHUNK_SIZE + 100);
+	std::vector<unsigned char> head, tail;
+	int err;
+
+	WriteFile(plain_path, plain);
+	ASSERT_EQ(0, Run(true, plain_path, archive_path, test_password, &err)) << strerror(err);
+
+	ASSERT_EQ(1, twrpCrypt::Decrypt_Head(archive_path, test_password, head));
+	ASSERT_LE(head.size(), plain.size());
+	EXPECT_TRUE(std::equal(head.begin(), head.end(), plain.begin()));
+	EXPECT_EQ(0, twrpCrypt::Decrypt_Head(archive_path, "wrong password", head));
+
+	// The last record only holds 100 bytes, so asking for 200 has to reach
+	// back into the one before it.
+	ASSERT_EQ(1, twrpCrypt::Decrypt_Tail(archive_path, test_password, 200, tail));
+	ASSERT_GE(tail.size(), (size_t)200);
+	EXPECT_TRUE(std::equal(tail.begin(), tail.end(), plain.end() - tail.size()));
+}
+
+TEST_F(TwrpCryptTest, WrongPasswordFails) {
+	int err;
+
+	WriteFile(plain_path, Pattern(100000));
+	ASSERT_EQ(0, Run(true, plain_path, archive_path, test_password, &err)) << strerror(err);
+	EXPECT_EQ(-1, Run(false, archive_path, out_path, "wrong password", &err));
+	EXPECT_EQ(EBADMSG, err);
+}
+
+TEST_F(TwrpCryptTest, TamperedRecordFails) {
+	int err;
+
+	WriteFile(plain_path, Pattern(2 * TEST_CHUNK_SIZE + 10));
+	ASSERT_EQ(0, Run(true, plain_path, archive_path, test_password, &err)) << strerror(err);
+	std::vector<unsigned char> archive = ReadFile(archive_path);
+
+	// Flip one bit of ciphertext in the second record.
+	std::vector<unsigned char> tampered = archive;
+	tampered[TEST_HEADER_LEN + TEST_RECORD_LEN + TEST_CHUNK_SIZE + TEST_TAG_LEN + TEST_RECORD_LEN + 1000] ^= 0x01;
+	WriteFile(archive_path, tampered);
+	EXPECT_EQ(-1, Run(false, archive_path, out_path, test_password, &err));
+	EXPECT_EQ(EBADMSG, err);
+
+	// The header is authenticated with every record.
+	tampered = archive;
+	tampered[TEST_HEADER_LEN - 1] ^= 0x01;
+	WriteFile(archive_path, tampered);
+	EXPECT_EQ(-1, Run(false, archive_path, out_path, test_password, &err));
+	EXPECT_EQ(EBADMSG, err);
+}
+
+TEST_F(TwrpCryptTest, TruncatedArchiveFails) {
+	int err;
+
+	WriteFile(plain_path, Pattern(2 * TEST_CHUNK_SIZE + 10));
+	ASSERT_EQ(0, Run(true, plain_path, archive_path, test_password, &err)) << strerror(err);
+	std::vector<unsigned char> archive = ReadFile(archive_path);
+
+	// Dropping the last record leaves a well formed archive that was never
+	// marked as finished.
+	archive.resize(archive.size() - (TEST_RECORD_LEN + 10 + TEST_TAG_LEN));
+	WriteFile(archive_path, archive);
+	EXPECT_EQ(-1, Run(false, archive_path, out_path, test_password, &err));
+	EXPECT_EQ(EBADMSG, err);
+}
+
+// Writes Plain the way `openaes enc` does: 4064 byte reads, each encrypted
+// into its own 4096 byte OAES record.
+static bool WriteLegacyArchive(const std::string& path, const std::vector<unsigned char>& plain, const std::string& password) {
+	uint8_t key_data[32];
+	size_t key_len = password.size() <= 16 ? 16 : (password.size() <= 24 ? 24 : 32);
+	OAES_CTX* ctx = oaes_alloc();
+	FILE* fp = fopen(path.c_str(), "wb");
+	bool ret = ctx != NULL && fp != NULL;
+
+	for (size_t i = 0; i < sizeof(key_data); i++)
+		key_data[i] = i + 1;
+	memcpy(key_data, password.data(), password.size() < sizeof(key_data) ? password.size() : sizeof(key_data));
+	if (ret)
+		ret = oaes_key_import_data(ctx, key_data, key_len) == OAES_RET_SUCCESS;
+	for (size_t off = 0; ret && off < plain.size(); off += 4064) {
+		size_t len = plain.size() - off < 4064 ? plain.size() - off : 4064;
+		size_t out_len = 0;
+		ret = oaes_encrypt(ctx, &plain[off], len, NULL, &out_len) == OAES_RET_SUCCESS;
+		std::vector<uint8_t> out(out_len);
+		ret = ret && oaes_encrypt(ctx, &plain[off], len, &out[0], &out_len) == OAES_RET_SUCCESS &&
+			fwrite(&out[0], 1, out_len, fp) == out_len;
+	}
+	if (fp != NULL && fclose(fp) != 0)
+		ret = false;
+	if (ctx != NULL)
+		oaes_free(&ctx);
+	return ret;
+}
+
+TEST_F(TwrpCryptTest, LegacyDecrypt) {
+	// Enough records for several worker batches, ending in a short one.
+	std::vector<unsigned char> plain = Pattern(4064 * 200 + 777);
+	int err;
+
+	ASSERT_TRUE(WriteLegacyArchive(archive_path, plain, test_password));
+	EXPECT_TRUE(twrpCrypt::Is_Legacy(archive_path));
+	ASSERT_EQ(0, Run(false, archive_path, out_path, test_password, &err)) << strerror(err);
+	EXPECT_TRUE(plain == ReadFile(out_path));
+}
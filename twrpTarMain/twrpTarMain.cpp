@@ -21,9 +21,21 @@
 #include "../twrpTar.hpp"
 #include "../exclude.hpp"
 #include "../progresstracking.hpp"
+#include "../direnum.hpp"
 #include "../gui/gui.hpp"
 #include "../gui/twmsg.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+extern "C" {
+#include "../libtar/libtar.h"
+#include "../tarWrite.h"
+}
 
 void gui_msg(const char* text)
 {
@@ -64,21 +76,172 @@ void gui_msg(Message msg)
 	fputs(output.c_str(), stdout);
 }
 
+void usage();
+
+// Counts the archive-side read()/write() calls libtar makes so the
+// benchmark can show how many syscalls a backup or restore costs.
+static unsigned long long bench_calls, bench_bytes;
+
+static ssize_t bench_read(int fd, void *buf, size_t len) {
+	ssize_t ret = read(fd, buf, len);
+	bench_calls++;
+	if (ret > 0)
+		bench_bytes += ret;
+	return ret;
+}
+
+static ssize_t bench_write(int fd, const void *buf, size_t len) {
+	ssize_t ret = write(fd, buf, len);
+	bench_calls++;
+	if (ret > 0)
+		bench_bytes += ret;
+	return ret;
+}
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char* phase, double start) {
+	double secs = bench_now() - start;
+	double mb = bench_bytes / (1024.0 * 1024.0);
+	printf("%-8s %10.1f MB %12llu calls %10.3f s %10.1f MB/s\n", phase, mb, bench_calls, secs, secs > 0 ? mb / secs : 0);
+}
+
+// Runs libtar in-process (no fork, no pigz/openaes) so the numbers only
+// reflect the tar data path.
+static int benchmark(const string& Directory, const string& Tar_Filename) {
+	tartype_t type = { open, close, bench_read, bench_write };
+	string Extract_Dir = Tar_Filename + ".extract";
+	int progress_fd = 0;
+	double start;
+	TAR *t;
+
+	if (Directory.empty() || Tar_Filename.empty()) {
+		usage();
+		return -1;
+	}
+	unlink(Tar_Filename.c_str());
+	TWDirEnum::Remove_Tree(Extract_Dir, true);
+	if (mkdir(Extract_Dir.c_str(), 0755) != 0) {
+		printf("Unable to create '%s'\n", Extract_Dir.c_str());
+		return -1;
+	}
+
+	bench_calls = bench_bytes = 0;
+	start = bench_now();
+	if (tar_open(&t, Tar_Filename.c_str(), &type, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644, TAR_GNU) != 0) {
+		printf("tar_open failed for '%s'\n", Tar_Filename.c_str());
+		return -1;
+	}
+	if (tar_append_tree(t, (char*) Directory.c_str(), (char*) "bench") != 0 || tar_append_eof(t) != 0) {
+		printf("Error creating '%s'\n", Tar_Filename.c_str());
+		tar_close(t);
+		return -1;
+	}
+	fsync(tar_fd(t));
+	tar_close(t);
+	bench_report("create", start);
+
+	bench_calls = bench_bytes = 0;
+	start = bench_now();
+	if (tar_open(&t, Tar_Filename.c_str(), &type, O_RDONLY | O_LARGEFILE, 0644, TAR_GNU) != 0) {
+		printf("tar_open failed for '%s'\n", Tar_Filename.c_str());
+		return -1;
+	}
+	if (tar_extract_all(t, (char*) Extract_Dir.c_str(), &progress_fd) != 0) {
+		printf("Error extracting '%s'\n", Tar_Filename.c_str());
+		tar_close(t);
+		return -1;
+	}
+	tar_close(t);
+	sync();
+	bench_report("extract", start);
+
+	unlink(Tar_Filename.c_str());
+	TWDirEnum::Remove_Tree(Extract_Dir, true);
+	return 0;
+}
+
+#define REMOVE_BENCH_DIRS		64
+#define REMOVE_BENCH_SUBDIRS	32
+#define REMOVE_BENCH_FILES		50	// 64 * 32 * 50 = 102400 files
+
+static int remove_bench_populate(const string& Root) {
+	char path[PATH_MAX];
+
+	if (mkdir(Root.c_str(), 0755) != 0) {
+		printf("Unable to create '%s': %s\n", Root.c_str(), strerror(errno));
+		return -1;
+	}
+	for (int d = 0; d < REMOVE_BENCH_DIRS; d++) {
+		snprintf(path, sizeof(path), "%s/d%d", Root.c_str(), d);
+		mkdir(path, 0755);
+		for (int s = 0; s < REMOVE_BENCH_SUBDIRS; s++) {
+			snprintf(path, sizeof(path), "%s/d%d/s%d", Root.c_str(), d, s);
+			mkdir(path, 0755);
+			for (int f = 0; f < REMOVE_BENCH_FILES; f++) {
+				snprintf(path, sizeof(path), "%s/d%d/s%d/f%d", Root.c_str(), d, s, f);
+				int fd = open(path, O_WRONLY | O_CREAT, 0644);
+				if (fd < 0) {
+					printf("Unable to create '%s': %s\n", path, strerror(errno));
+					return -1;
+				}
+				close(fd);
+			}
+		}
+	}
+	sync();
+	return 0;
+}
+
+// Times TWDirEnum::Remove_Tree, which backs TWFunc::removeDir and the
+// data wipes, on one worker and on the default pool.
+static int remove_benchmark(const string& Directory) {
+	string Root = Directory + "/twrp-remove-bench";
+	unsigned threads[2] = { 1, TWDirEnum::Default_Threads() };
+
+	if (Directory.empty()) {
+		usage();
+		return -1;
+	}
+	TWDirEnum::Remove_Tree(Root, true);
+	for (int i = 0; i < 2; i++) {
+		if (remove_bench_populate(Root) != 0)
+			return -1;
+		double start = bench_now();
+		if (TWDirEnum::Remove_Tree(Root, true, TWDirEnum::Remove_Filter(), TWDirEnum::Remove_Progress(), NULL, NULL, threads[i]) != 0) {
+			printf("Error removing '%s': %s\n", Root.c_str(), strerror(errno));
+			return -1;
+		}
+		sync();
+		printf("remove %u thread(s) %10.3f s\n", threads[i], bench_now() - start);
+	}
+	return 0;
+}
+
 void usage() {
 	printf("twrpTar <action> [options]\n\n");
 	printf("actions: -c create\n");
-	printf("         -x extract\n\n");
+	printf("         -x extract\n");
+	printf("         -b benchmark libtar create and extract of -d using -t as scratch\n");
+	printf("         -r benchmark recursive delete of a synthetic tree created under -d\n\n");
 	printf(" -d    target directory\n");
 	printf(" -t    output file\n");
 	printf(" -m    skip media subfolder (has data media)\n");
 	printf(" -z    compress backup (/system/bin/pigz must be present)\n");
+	printf(" -s    write buffer size in KiB (default %u)\n", TW_TAR_DEFAULT_BUFFER_SIZE / 1024);
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	printf(" -e    encrypt/decrypt backup followed by password (/system/bin/openaes must be present)\n");
+	printf(" -e    encrypt/decrypt backup followed by password\n");
 	printf(" -u    encrypt using userdata encryption (must be used with -e)\n");
 #endif
 	printf("\n\n");
 	printf("Example: twrpTar -c -d /cache -t /sdcard/test.tar\n");
 	printf("         twrpTar -x -d /cache -t /sdcard/test.tar\n");
+	printf("         twrpTar -b -d /data/app -t /sdcard/bench.tar\n");
+	printf("         twrpTar -r -d /data/media/0\n");
 }
 
 int main(int argc, char **argv) {
@@ -102,6 +265,10 @@ int main(int argc, char **argv) {
 		action = 1; // create tar
 	else if (strcmp(argv[1], "-x") == 0)
 		action = 2; // extract tar
+	else if (strcmp(argv[1], "-b") == 0)
+		action = 3; // benchmark
+	else if (strcmp(argv[1], "-r") == 0)
+		action = 4; // remove benchmark
 	else {
 		printf("Invalid action '%s' specified.\n", argv[1]);
 		usage();
@@ -143,6 +310,15 @@ int main(int argc, char **argv) {
 			usage();
 			return -1;
 #endif
+		} else if (strcmp(argv[i], "-s") == 0) {
+			i++;
+			if (argc <= i) {
+				printf("No argument specified for %s\n", argv[i - 1]);
+				usage();
+				return -1;
+			} else {
+				tar.write_buffer_size = strtoul(argv[i], NULL, 10) * 1024;
+			}
 		} else if (strcmp(argv[i], "-m") == 0) {
 			if (action == 2)
 				printf("NOTE: %s option not needed when extracting.\n", argv[i]);
@@ -164,6 +340,11 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (action == 3)
+		return benchmark(Directory, Tar_Filename);
+	if (action == 4)
+		return remove_benchmark(Directory);
+
 	TWExclude exclude;
 	exclude.add_absolute_dir("/data/media");
 	tar.has_data_media = has_data_media;
@@ -258,6 +258,8 @@ static int Run_Update_Binary(const char *path, int* wipe_cache, zip_type ztype)
 	fclose(child_data);
 
 	int waitrc = TWFunc::Wait_For_Child(pid, &status, "Updater");
+	// The updater mounts and writes partitions on its own
+	TWFunc::Invalidate_Property_Cache();
 
   	// Should never happen, but in case of crash or other unexpected condition
   	if (aroma_running == 1) {
@@ -27,21 +27,30 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
@@ -77,10 +86,39 @@ static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
 static constexpr mode_t MARKER_DIRECTORY_MODE = 0700;
 
+// Number of blocks read per chunk when hashing a RangeSet, and how many chunks may be in flight
+// between the reader thread and the hasher.
+static constexpr size_t kHashChunkBlocks = 256;
+static constexpr size_t kHashChunkCount = 4;
+// Overrides the memory budget (in MiB) for in-memory stashes; 0 keeps every stash on /cache.
+static constexpr const char* kStashRamBudgetProperty = "recovery.updater.stash_ram_mb";
+
 static CauseCode failure_type = kNoCause;
 static bool is_retry = false;
 static std::unordered_map<std::string, RangeSet> stash_map;
 
+// Stashes kept in memory instead of /cache, keyed by stash id. A stash is only written out once
+// its source blocks are about to be overwritten (see FlushOverlappingStashes()), since until then
+// a resumed update can simply re-read it from the source.
+static std::unordered_map<std::string, std::vector<uint8_t>> ram_stash;
+static size_t ram_stash_bytes = 0;
+static size_t ram_stash_budget = 0;
+
+// Results of range_sha1 and block_image_verify within this updater session, keyed on the device
+// identity and its write generation (see GetDeviceGeneration()). Any write to the device changes
+// the generation, so stale entries are simply never looked up again.
+static std::unordered_map<std::string, std::string> range_sha1_cache;
+static std::unordered_set<std::string> verified_cache;
+// Bumped whenever this process writes to a block device through blockimg, so that writes which
+// haven't reached the device statistics yet still invalidate the caches above.
+static uint64_t local_write_generation = 0;
+
+void InvalidateBlockImageCaches() {
+  local_write_generation++;
+  range_sha1_cache.clear();
+  verified_cache.clear();
+}
+
 static void DeleteLastCommandFile() {
   const std::string& last_command_file = Paths::Get().last_command_file();
   if (unlink(last_command_file.c_str()) == -1 && errno != ENOENT) {
@@ -524,6 +562,131 @@ static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer,
   return 0;
 }
 
+// Computes the SHA-1 of the blocks in |rs|. Reading is done on a helper thread in chunks of
+// kHashChunkBlocks while the calling thread hashes the previous chunks, so the device I/O overlaps
+// with the digest computation. SHA-1 must consume the data in order, which is why the work is
+// pipelined instead of split across the ranges. On read failure returns false with errno set.
+static bool HashRangeSet(int fd, const RangeSet& rs, uint8_t digest[SHA_DIGEST_LENGTH]) {
+  struct Chunk {
+    std::vector<uint8_t> data;
+    size_t size;
+  };
+  std::vector<Chunk> chunks(kHashChunkCount);
+  std::deque<size_t> free_chunks;
+  std::deque<size_t> filled_chunks;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    chunks[i].data.resize(kHashChunkBlocks * BLOCKSIZE);
+    free_chunks.push_back(i);
+  }
+
+  std::mutex mu;
+  std::condition_variable cv;
+  bool reader_done = false;
+  bool read_failed = false;
+  int read_errno = 0;
+
+  std::thread reader([&]() {
+    for (const auto& [begin, end] : rs) {
+      for (size_t block = begin; block < end; block += kHashChunkBlocks) {
+        size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mu);
+          cv.wait(lock, [&] { return !free_chunks.empty(); });
+          index = free_chunks.front();
+          free_chunks.pop_front();
+        }
+
+        Chunk& chunk = chunks[index];
+        chunk.size = std::min(end - block, kHashChunkBlocks) * BLOCKSIZE;
+        bool ok = android::base::ReadFullyAtOffset(fd, chunk.data.data(), chunk.size,
+                                                   static_cast<off64_t>(block) * BLOCKSIZE);
+        std::lock_guard<std::mutex> lock(mu);
+        if (!ok) {
+          read_failed = true;
+          read_errno = errno;
+          reader_done = true;
+          cv.notify_all();
+          return;
+        }
+        filled_chunks.push_back(index);
+        cv.notify_all();
+      }
+    }
+    std::lock_guard<std::mutex> lock(mu);
+    reader_done = true;
+    cv.notify_all();
+  });
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  while (true) {
+    size_t index;
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock, [&] { return !filled_chunks.empty() || reader_done; });
+      if (read_failed) break;
+      if (filled_chunks.empty()) break;
+      index = filled_chunks.front();
+      filled_chunks.pop_front();
+    }
+
+    SHA1_Update(&ctx, chunks[index].data.data(), chunks[index].size);
+
+    std::lock_guard<std::mutex> lock(mu);
+    free_chunks.push_back(index);
+    cv.notify_all();
+  }
+  reader.join();
+
+  if (read_failed) {
+    errno = read_errno;
+    return false;
+  }
+  SHA1_Final(digest, &ctx);
+  return true;
+}
+
+// Returns a key that changes whenever the contents behind |fd| may have changed. For block devices
+// this combines the device number with the "sectors written" counter from sysfs, which covers
+// writes from other processes (e.g. run_program) once they reach the device; for regular files
+// (as used by the host tests) the modification time and size are used instead. Returns an empty
+// string if no reliable generation can be determined, which disables caching.
+static std::string GetDeviceGeneration(int fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    return "";
+  }
+
+  if (S_ISBLK(sb.st_mode)) {
+    std::string stat_path = android::base::StringPrintf("/sys/dev/block/%u:%u/stat",
+                                                        major(sb.st_rdev), minor(sb.st_rdev));
+    std::string content;
+    if (!android::base::ReadFileToString(stat_path, &content)) {
+      return "";
+    }
+    uint64_t fields[7];
+    if (sscanf(content.c_str(),
+               "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+               &fields[0], &fields[1], &fields[2], &fields[3], &fields[4], &fields[5],
+               &fields[6]) != 7) {
+      return "";
+    }
+    // The 7th field is the number of sectors written to the device.
+    return android::base::StringPrintf("blk:%u:%u:%" PRIu64 ":%" PRIu64, major(sb.st_rdev),
+                                       minor(sb.st_rdev), fields[6], local_write_generation);
+  }
+
+  if (S_ISREG(sb.st_mode)) {
+    return android::base::StringPrintf(
+        "reg:%" PRIu64 ":%" PRIu64 ":%" PRId64 ".%09ld:%" PRId64 ":%" PRIu64,
+        static_cast<uint64_t>(sb.st_dev), static_cast<uint64_t>(sb.st_ino),
+        static_cast<int64_t>(sb.st_mtim.tv_sec), sb.st_mtim.tv_nsec,
+        static_cast<int64_t>(sb.st_size), local_write_generation);
+  }
+
+  return "";
+}
+
 // Parameters for transfer list command functions
 struct CommandParameters {
     std::vector<std::string> tokens;
@@ -717,7 +880,21 @@ static void DeleteFile(const std::string& fn) {
   }
 }
 
+static void ClearRamStash() {
+  ram_stash.clear();
+  ram_stash_bytes = 0;
+}
+
+static void FreeRamStash(const std::string& id) {
+  auto it = ram_stash.find(id);
+  if (it != ram_stash.end()) {
+    ram_stash_bytes -= it->second.size();
+    ram_stash.erase(it);
+  }
+}
+
 static void DeleteStash(const std::string& base) {
+  ClearRamStash();
   if (base.empty()) return;
 
   LOG(INFO) << "deleting stash " << base;
@@ -732,8 +909,41 @@ static void DeleteStash(const std::string& base) {
   }
 }
 
+// Returns the number of bytes of stash data that may be kept in memory: a quarter of the free RAM
+// unless overridden by kStashRamBudgetProperty.
+static size_t GetStashRamBudget() {
+  uint64_t budget_mb = android::base::GetUintProperty<uint64_t>(
+      kStashRamBudgetProperty, std::numeric_limits<uint64_t>::max());
+  uint64_t budget;
+  if (budget_mb != std::numeric_limits<uint64_t>::max()) {
+    budget = budget_mb * 1024 * 1024;
+  } else {
+    struct sysinfo si;
+    if (sysinfo(&si) == -1) {
+      PLOG(WARNING) << "sysinfo failed; keeping stashes on disk";
+      return 0;
+    }
+    budget = static_cast<uint64_t>(si.freeram) * si.mem_unit / 4;
+  }
+  return static_cast<size_t>(
+      std::min<uint64_t>(budget, std::numeric_limits<size_t>::max() / 2));
+}
+
 static int LoadStash(const CommandParameters& params, const std::string& id, bool verify,
                      std::vector<uint8_t>* buffer, bool printnoent) {
+  auto ram_it = ram_stash.find(id);
+  if (ram_it != ram_stash.end()) {
+    const std::vector<uint8_t>& data = ram_it->second;
+    allocate(data.size(), buffer);
+    std::copy(data.begin(), data.end(), buffer->begin());
+    if (verify && VerifyBlocks(id, *buffer, data.size() / BLOCKSIZE, true) != 0) {
+      LOG(ERROR) << "unexpected contents in memory stash " << id;
+      FreeRamStash(id);
+      return -1;
+    }
+    return 0;
+  }
+
   // In verify mode, if source range_set was saved for the given hash, check contents in the source
   // blocks first. If the check fails, search for the stashed files on /cache as usual.
   if (!params.canwrite) {
@@ -953,11 +1163,35 @@ static int FreeStash(const std::string& base, const std::string& id) {
     return -1;
   }
 
+  FreeRamStash(id);
   DeleteFile(GetStashFileName(base, id, ""));
 
   return 0;
 }
 
+// Writes out the in-memory stashes whose source blocks are about to be overwritten by |tgt|. From
+// then on the stash holds the only copy of that data, so it must be on disk before the write for
+// the update to remain resumable.
+static int FlushOverlappingStashes(const CommandParameters& params, const RangeSet& tgt) {
+  for (auto it = ram_stash.begin(); it != ram_stash.end();) {
+    auto src = stash_map.find(it->first);
+    if (src != stash_map.end() && !src->second.Overlaps(tgt)) {
+      ++it;
+      continue;
+    }
+
+    size_t blocks = it->second.size() / BLOCKSIZE;
+    LOG(INFO) << "flushing " << blocks << " blocks of stash " << it->first
+              << " before overwriting its source";
+    if (WriteStash(params.stashbase, it->first, blocks, it->second, false, nullptr) != 0) {
+      return -1;
+    }
+    ram_stash_bytes -= it->second.size();
+    it = ram_stash.erase(it);
+  }
+  return 0;
+}
+
 // Source contains packed data, which we want to move to the locations given in locs in the dest
 // buffer. source and dest may be the same buffer.
 static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
@@ -1135,9 +1369,14 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
     if (overlap && params.canwrite) {
       LOG(INFO) << "stashing " << *src_blocks << " overlapping blocks to " << srchash;
 
-      bool stash_exists = false;
+      // An in-memory stash with the same id is still needed by later commands, so it's persisted
+      // and kept like an existing stash file would be.
+      bool stash_exists = ram_stash.find(srchash) != ram_stash.end();
+      if (stash_exists) {
+        FreeRamStash(srchash);
+      }
       if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true,
-                     &stash_exists) != 0) {
+                     stash_exists ? nullptr : &stash_exists) != 0) {
         LOG(ERROR) << "failed to stash overlapping source blocks";
         return -1;
       }
@@ -1192,6 +1431,10 @@ static int PerformCommandMove(CommandParameters& params) {
     if (status == 0) {
       LOG(INFO) << "  moving " << blocks << " blocks";
 
+      if (FlushOverlappingStashes(params, tgt) == -1) {
+        return -1;
+      }
+
       if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
         return -1;
       }
@@ -1247,6 +1490,15 @@ static int PerformCommandStash(CommandParameters& params) {
     return 0;
   }
 
+  size_t size = blocks * BLOCKSIZE;
+  if (ram_stash_bytes + size <= ram_stash_budget && ram_stash.find(id) == ram_stash.end()) {
+    LOG(INFO) << "stashing " << blocks << " blocks to memory " << id;
+    ram_stash.emplace(id, std::vector<uint8_t>(params.buffer.begin(), params.buffer.begin() + size));
+    ram_stash_bytes += size;
+    params.stashed += blocks;
+    return 0;
+  }
+
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
   int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
   if (result == 0) {
@@ -1287,6 +1539,10 @@ static int PerformCommandZero(CommandParameters& params) {
   memset(params.buffer.data(), 0, BLOCKSIZE);
 
   if (params.canwrite) {
+    if (FlushOverlappingStashes(params, tgt) == -1) {
+      return -1;
+    }
+
     for (const auto& [begin, end] : tgt) {
       off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
       size_t size = (end - begin) * BLOCKSIZE;
@@ -1329,6 +1585,10 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
+    if (FlushOverlappingStashes(params, tgt) == -1) {
+      return -1;
+    }
+
     pthread_mutex_lock(&params.nti.mu);
     params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
     pthread_cond_broadcast(&params.nti.cv);
@@ -1391,6 +1651,11 @@ static int PerformCommandDiff(CommandParameters& params) {
   if (params.canwrite) {
     if (status == 0) {
       LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
+
+      if (FlushOverlappingStashes(params, tgt) == -1) {
+        return -1;
+      }
+
       Value patch_value(
           Value::Type::BLOB,
           std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
@@ -1465,6 +1730,10 @@ static int PerformCommandErase(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " erasing " << tgt.blocks() << " blocks";
 
+    if (FlushOverlappingStashes(params, tgt) == -1) {
+      return -1;
+    }
+
     for (const auto& [begin, end] : tgt) {
       off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
       size_t size = (end - begin) * BLOCKSIZE;
@@ -1572,6 +1841,10 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
     return -1;
   }
 
+  if (params.canwrite && FlushOverlappingStashes(params, hash_tree_ranges) == -1) {
+    return -1;
+  }
+
   uint64_t write_offset = static_cast<uint64_t>(hash_tree_ranges.GetBlockNumber(0)) * BLOCKSIZE;
   if (params.canwrite && !builder.WriteHashTreeToFd(params.fd, write_offset)) {
     LOG(ERROR) << "Failed to write hash tree to output";
@@ -1629,7 +1902,9 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
                                       const CommandMap& command_map, bool dryrun) {
   CommandParameters params{};
   stash_map.clear();
+  ClearRamStash();
   params.canwrite = !dryrun;
+  ram_stash_budget = params.canwrite ? GetStashRamBudget() : 0;
 
   LOG(INFO) << "performing " << (dryrun ? "verification" : "update");
   if (state->is_retry) {
@@ -1709,6 +1984,28 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
+  // A successful verification of the same transfer list against an unchanged device doesn't need
+  // to be repeated. Only fresh (non-resumed) verifications are cached, since a resumed one may
+  // update the last command file as a side effect.
+  std::string verified_key;
+  if (dryrun) {
+    std::string generation = GetDeviceGeneration(params.fd);
+    size_t last_command_index;
+    if (!generation.empty() && !ParseLastCommandFile(&last_command_index)) {
+      uint8_t list_digest[SHA_DIGEST_LENGTH];
+      SHA1(reinterpret_cast<const uint8_t*>(transfer_list_value->data.data()),
+           transfer_list_value->data.size(), list_digest);
+      verified_key = generation + "@" + print_sha1(list_digest);
+      if (verified_cache.find(verified_key) != verified_cache.end()) {
+        LOG(INFO) << "Skipping verification of " << block_device_path
+                  << ", already verified in this session";
+        return StringValue("t");
+      }
+    }
+  } else {
+    local_write_generation++;
+  }
+
   uint8_t digest[SHA_DIGEST_LENGTH];
   if (!Sha1DevicePath(block_device_path, digest)) {
     return StringValue("");
@@ -1851,9 +2148,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     }
 
     // Skip all commands before the saved last command index when resuming an update, except for
-    // "new" command. Because new commands read in the data sequentially.
+    // "new" command. Because new commands read in the data sequentially. "stash" commands are
+    // replayed as well, since in-memory stashes didn't survive the interruption; their sources are
+    // still intact unless the stash had been flushed to /cache, in which case it's loaded from
+    // there. Skipped "free" commands only drop the replayed in-memory copy, so that stash files
+    // with a duplicate id aren't deleted (b/69858743).
     if (params.canwrite && skip_executed_command && cmdindex <= saved_last_command_index &&
-        cmd_type != Command::Type::NEW) {
+        cmd_type != Command::Type::NEW && cmd_type != Command::Type::STASH) {
+      if (cmd_type == Command::Type::FREE && params.tokens.size() > 1) {
+        FreeRamStash(params.tokens[1]);
+        stash_map.erase(params.tokens[1]);
+      }
       LOG(INFO) << "Skipping already executed command: " << cmdindex
                 << ", last executed command for previous update: " << saved_last_command_index;
       continue;
@@ -1948,12 +2253,18 @@ pbiudone:
     pthread_cond_destroy(&params.nti.cv);
   } else if (rc == 0) {
     LOG(INFO) << "verified partition contents; update may be resumed";
+    if (!verified_key.empty()) {
+      verified_cache.insert(verified_key);
+    }
   }
 
   if (fsync(params.fd) == -1) {
     failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
     PLOG(ERROR) << "fsync failed";
   }
+  if (params.canwrite) {
+    local_write_generation++;
+  }
   // params.fd will be automatically closed because it's a unique_fd.
 
   if (params.nti.brotli_decoder_state != nullptr) {
@@ -1970,6 +2281,7 @@ pbiudone:
   if (params.isunresumable || (!params.canwrite && params.createdstash)) {
     DeleteStash(params.stashbase);
   }
+  ClearRamStash();
 
   if (failure_type != kNoCause && state->cause_code == kNoCause) {
     state->cause_code = failure_type;
@@ -2107,32 +2419,31 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
   RangeSet rs = RangeSet::Parse(ranges->data);
   CHECK(static_cast<bool>(rs));
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
-
-  std::vector<uint8_t> buffer(BLOCKSIZE);
-  for (const auto& [begin, end] : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", block_device_path.c_str(),
-                 strerror(errno));
-      return StringValue("");
-    }
-
-    for (size_t j = begin; j < end; ++j) {
-      if (!android::base::ReadFully(fd, buffer.data(), BLOCKSIZE)) {
-        CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
-        ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
-                   strerror(errno));
-        return StringValue("");
-      }
-
-      SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
+  // The same partition is commonly hashed more than once per package (e.g. by the assertions and
+  // again after block_image_update); reuse the result as long as the device hasn't been written.
+  std::string generation = GetDeviceGeneration(fd);
+  std::string cache_key = generation + "@" + ranges->data;
+  if (!generation.empty()) {
+    auto it = range_sha1_cache.find(cache_key);
+    if (it != range_sha1_cache.end()) {
+      LOG(INFO) << "Using cached range_sha1 of " << block_device_path;
+      return StringValue(it->second);
     }
   }
+
   uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1_Final(digest, &ctx);
+  if (!HashRangeSet(fd, rs, digest)) {
+    CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
+    ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
+               strerror(errno));
+    return StringValue("");
+  }
 
-  return StringValue(print_sha1(digest));
+  std::string hexdigest = print_sha1(digest);
+  if (!generation.empty()) {
+    range_sha1_cache[cache_key] = hexdigest;
+  }
+  return StringValue(hexdigest);
 }
 
 // This function checks if a device has been remounted R/W prior to an incremental
@@ -2265,6 +2576,9 @@ Value* BlockImageRecoverFn(const char* name, State* state,
     return StringValue("");
   }
 
+  // libfec may rewrite corrected blocks below.
+  local_write_generation++;
+
   uint8_t buffer[BLOCKSIZE];
   for (const auto& [begin, end] : rs) {
     for (size_t j = begin; j < end; ++j) {
@@ -32,6 +32,7 @@
 #include "otautil/error_code.h"
 #include "otautil/paths.h"
 #include "private/utils.h"
+#include "updater/blockimg.h"
 
 static std::vector<std::string> ReadStringArgs(const char* name, State* state,
                                                const std::vector<std::unique_ptr<Expr>>& argv,
@@ -68,6 +69,8 @@ Value* UnmapPartitionFn(const char* name, State* state,
   auto args = ReadStringArgs(name, state, argv, { "name" });
   if (args.empty()) return StringValue("");
 
+  // The device node may be reused for a different partition.
+  InvalidateBlockImageCaches();
   auto updater_runtime = state->updater->GetRuntime();
   return updater_runtime->UnmapPartitionOnDeviceMapper(args[0]) ? StringValue("t")
                                                                 : StringValue("");
@@ -78,6 +81,7 @@ Value* MapPartitionFn(const char* name, State* state,
   auto args = ReadStringArgs(name, state, argv, { "name" });
   if (args.empty()) return StringValue("");
 
+  InvalidateBlockImageCaches();
   std::string path;
   auto updater_runtime = state->updater->GetRuntime();
   bool result = updater_runtime->MapPartitionOnDeviceMapper(args[0], &path);
@@ -102,6 +106,7 @@ Value* UpdateDynamicPartitionsFn(const char* name, State* state,
     return StringValue("");
   }
 
+  InvalidateBlockImageCaches();
   std::string updated_marker = Paths::Get().stash_directory_base() + kMetadataUpdatedMarker;
   if (state->is_retry) {
     struct stat sb;
@@ -21,4 +21,9 @@
 
 void RegisterBlockImageFunctions();
 
+// Drops the range_sha1() and block_image_verify() results cached in this session. Updater
+// functions that may write to a block device outside of blockimg call this first, since such
+// writes don't necessarily show up in the device's write counters before the next lookup.
+void InvalidateBlockImageCaches();
+
 #endif
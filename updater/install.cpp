@@ -63,6 +63,7 @@
 #include "otautil/error_code.h"
 #include "otautil/print_sha1.h"
 #include "otautil/sysutil.h"
+#include "updater/blockimg.h"
 
 #ifndef __ANDROID__
 #include <cutils/memory.h>  // for strlcpy
@@ -129,6 +130,8 @@ Value* PackageExtractFileFn(const char* name, State* state,
       dest_path = block_device_name;
     }
 
+    // dest_path may be a block device that range_sha1() has hashed before.
+    InvalidateBlockImageCaches();
     android::base::unique_fd fd(TEMP_FAILURE_RETRY(
         open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
     if (fd == -1) {
@@ -253,6 +256,7 @@ Value* PatchPartitionFn(const char* name, State* state,
     return ErrorAbort(state, kArgsParsingFailure, "%s(): Failed to parse the argument(s)", name);
   }
 
+  InvalidateBlockImageCaches();
   std::string err;
   auto target = Partition::Parse(args[0], &err);
   if (!target) {
@@ -405,6 +409,8 @@ Value* FormatFn(const char* name, State* state, const std::vector<std::unique_pt
   const std::string& fs_size = args[3];
   const std::string& mount_point = args[4];
 
+  InvalidateBlockImageCaches();
+
   if (fs_type.empty()) {
     return ErrorAbort(state, kArgsParsingFailure, "fs_type argument to %s() can't be empty", name);
   }
@@ -654,6 +660,8 @@ Value* PackageExtractFileFn(const char* name, State* state,
       return StringValue("");
     }
 
+    // dest_path may be a block device that range_sha1() has hashed before.
+    InvalidateBlockImageCaches();
     unique_fd fd(TEMP_FAILURE_RETRY(
         ota_open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
     if (fd == -1) {
@@ -1105,6 +1113,7 @@ Value* RunProgramFn(const char* name, State* state, const std::vector<std::uniqu
     return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse the argument(s)", name);
   }
 
+  InvalidateBlockImageCaches();
   auto updater_runtime = state->updater->GetRuntime();
   auto status = updater_runtime->RunProgram(args, false);
   return StringValue(std::to_string(status));
@@ -1153,6 +1162,7 @@ Value* WriteValueFn(const char* name, State* state, const std::vector<std::uniqu
     return ErrorAbort(state, kArgsParsingFailure, "%s(): Filename cannot be empty", name);
   }
 
+  InvalidateBlockImageCaches();
   const std::string& value = args[0];
   auto updater_runtime = state->updater->GetRuntime();
   if (!updater_runtime->WriteStringToFile(value, filename)) {
@@ -1285,6 +1295,7 @@ Value* WipeBlockDeviceFn(const char* name, State* state, const std::vector<std::
     return nullptr;
   }
 
+  InvalidateBlockImageCaches();
   auto updater_runtime = state->updater->GetRuntime();
   int status = updater_runtime->WipeBlockDevice(filename, len);
   return StringValue(status == 0 ? "t" : "");
@@ -1310,6 +1321,7 @@ Value* Tune2FsFn(const char* name, State* state, const std::vector<std::unique_p
     return ErrorAbort(state, kArgsParsingFailure, "%s() could not read args", name);
   }
 
+  InvalidateBlockImageCaches();
   // tune2fs expects the program name as its first arg.
   args.insert(args.begin(), "tune2fs");
   auto updater_runtime = state->updater->GetRuntime();
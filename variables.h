@@ -158,6 +158,7 @@ static int Fox_Current_ROM_IsMIUI = 0; // is the currently installed ROM a MIUI
 
 //
 #define TW_USE_COMPRESSION_VAR      	"tw_use_compression"
+#define TW_TAR_BUFFER_SIZE_VAR      	"tw_tar_buffer_size_kb"
 #define TW_FILENAME                 	"tw_filename"
 #define TW_ZIP_INDEX                	"tw_zip_index"
 #define TW_ZIP_QUEUE_COUNT       	"tw_zip_queue_count"